@@ -0,0 +1,135 @@
+{-# LANGUAGE OverloadedStrings #-}
+
+import Control.Exception
+import Criterion.Main
+import qualified Data.ByteString.Char8 as BS8
+import qualified Data.ByteString.Lazy as LBS
+import qualified Data.Map.Strict as M
+import qualified Data.List as L
+import qualified System.EasyFile as FS
+import qualified Wikilon.DB as DB
+import qualified Wikilon.KVM as KVM
+import qualified Wikilon.CBT as CBT
+import qualified Awelon.Syntax as P
+import qualified Awelon.Dict.Format as F
+
+-- KVM versus the in-memory CBT reference, at a million keys. Stowed
+-- lookups include the withRsc path through LMDB.
+--
+-- Awelon.Syntax decoders over a full dictionary. For parallel decode
+-- scaling, run with `+RTS -N1` through `-N16`; the `chunks` cases
+-- hold the chunking fixed while varying the cores.
+
+nKeys :: Int
+nKeys = 1000000
+
+key :: Int -> BS8.ByteString
+key i = BS8.pack ("key-" ++ show i)
+
+val :: Int -> BS8.ByteString
+val i = BS8.pack (show (i * 7))
+
+-- a scattered sample of keys
+sample :: Int -> [Int]
+sample n = L.take n (L.iterate step 1) where
+    step i = 1 + ((i * 7919) `mod` nKeys)
+
+nDefs :: Int
+nDefs = 50000
+
+-- a dictionary where a few words are used very many times
+dictText :: BS8.ByteString
+dictText = BS8.unlines (fmap def [1..nDefs]) where
+    w i = "w-" ++ show (max 0 i)
+    def i = BS8.pack $ "@" ++ w i ++ " " ++ w (i - 1) ++ " " ++ w (i `div` 2)
+         ++ " [dup swap (par) \"text " ++ show i ++ "\"] bind@list "
+         ++ show (i `mod` 100) ++ " add"
+
+-- the definitions, sliced from the dictionary
+dictDefs :: BS8.ByteString -> [BS8.ByteString]
+dictDefs = fmap (BS8.drop 1 . BS8.dropWhile (/= ' ')) . BS8.lines
+
+-- force a program, without encoding it
+progSize :: P.Prog -> Int
+progSize = L.foldl' (+) 0 . fmap opSize . P.progOps where
+    opSize (P.OpWord w) = BS8.length (P.wordBytes w)
+    opSize (P.OpAnno a) = BS8.length (P.wordBytes (P.annoWord a))
+    opSize (P.OpBlock p) = 1 + progSize p
+    opSize (P.OpText t) = BS8.length (P.textData t)
+    opSize (P.OpNS op ns) = opSize op + BS8.length (P.wordBytes (P.nsWord ns))
+
+decodeSize :: Either e P.Prog -> Int
+decodeSize = either (const 0) progSize
+
+main :: IO ()
+main = withTmpDir "wikilon-bench" $ do
+    db <- DB.open "bench-db" 4000
+    tx <- DB.newTX db
+    let kvs = [(key i, val i) | i <- [1..nKeys]]
+    let cbt = CBT.fromList kvs
+    let kvm = KVM.fromList kvs
+    _ <- evaluate (L.length (CBT.toList cbt))
+    _ <- evaluate . L.length =<< KVM.toList tx kvm
+    kvmS <- KVM.compact tx 4096 kvm
+    let ks = fmap key (sample 1000)
+    let batch = M.fromList [(key i, Just "updated") | i <- sample 1000]
+    let dictL = LBS.fromStrict dictText
+    let defsS = dictDefs dictText
+    let defsL = fmap LBS.fromStrict defsS
+    _ <- evaluate (L.length defsS)
+    let progs = [p | Right p <- fmap P.decodeS defsS]
+    _ <- evaluate (L.foldl' (+) 0 (fmap progSize progs))
+    defaultMain
+        [ bgroup "fromList"
+            [ bench "CBT" $ whnf (L.length . CBT.toList . CBT.fromList) kvs
+            , bench "KVM" $ whnfIO (L.length <$> KVM.toList tx (KVM.fromList kvs))
+            ]
+        , bgroup "lookup x1000"
+            [ bench "CBT" $ nf (fmap (flip CBT.lookup cbt)) ks
+            , bench "KVM" $ nfIO (mapM (\ k -> KVM.lookup tx k kvm) ks)
+            , bench "KVM stowed" $ nfIO (mapM (\ k -> KVM.lookup tx k kvmS) ks)
+            ]
+        , bgroup "update x1000"
+            [ bench "CBT" $ whnf (\ m -> L.length (CBT.toList (L.foldl' ins m (M.toList batch)))) cbt
+            , bench "KVM batch" $ whnfIO (KVM.null <$> KVM.applyBatch tx batch kvm)
+            , bench "KVM stowed batch+compact" $ whnfIO $
+                KVM.applyBatch tx batch kvmS >>= KVM.compact tx 4096 >>= return . KVM.null
+            ]
+        , bgroup "diff"
+            [ bench "KVM stowed" $ nfIO $ do
+                kvmS' <- KVM.applyBatch tx batch kvmS >>= KVM.compact tx 4096
+                L.length <$> KVM.diff tx kvmS kvmS'
+            ]
+        , bgroup "dictionary decode"
+            [ bench "Dict.Format.decode" $ whnf (M.size . F.dictDefs . snd . F.decode) dictL
+            , bench "decode" $ whnf (L.foldl' (+) 0 . fmap (decodeSize . P.decode)) defsL
+            , bench "decodeS" $ whnf (L.foldl' (+) 0 . fmap (decodeSize . P.decodeS)) defsS
+            , bench "decodeS+intern" $ whnfIO $
+                L.foldl' (+) 0 . fmap progSize <$> mapM P.intern progs
+            ]
+        , bgroup "dictionary decode (parallel)" $
+            bench "decodePar" (whnf (M.size . F.dictDefs . snd . F.decodePar) dictL) :
+            [ bench ("chunks " ++ show n) $ 
+                whnf (M.size . F.dictDefs . snd . F.decodeParN n) dictL
+            | n <- [1, 2, 4, 8, 16] ]
+        , bgroup "dictionary encode"
+            [ bench "encode" $ whnf (L.foldl' (+) 0 . fmap (LBS.length . P.encode)) progs
+            ]
+        ]
+  where
+    ins m (k, Just v) = CBT.insert k v m
+    ins m (_, Nothing) = m
+
+withTmpDir :: FilePath -> IO a -> IO a
+withTmpDir subdir action = do
+    initialPath <- FS.getCurrentDirectory
+    tmp <- FS.getTemporaryDirectory
+    let myTmpDir = tmp FS.</> subdir
+    FS.createDirectoryIfMissing False myTmpDir
+    FS.setCurrentDirectory myTmpDir
+    r <- try action
+    FS.setCurrentDirectory initialPath
+    reraise r
+
+reraise :: Either SomeException a -> IO a
+reraise = either throw return
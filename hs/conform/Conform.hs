@@ -0,0 +1,100 @@
+-- | The Haskell side of the cross-runtime conformance checks. The F#
+-- runtime generates a corpus and compares results (see `-conform` in
+-- src/Main.fs and src/Awelon/Conformance.fs). Here we read the same
+-- corpus and write our results under `DIR/hs`, one line per item:
+--
+--   hash.txt     RscHash per blob (see rscHash)
+--   parse.txt    re-encoded program per line, or `?` on failure
+--   dict.txt     sorted `word def` after an encode and decode round trip
+--   stow.txt     RscHash of each blob as loaded back from our database,
+--                or `missing`, to compare with the F# database
+--   timing.txt   `check items bytes millis` per check
+--
+import Control.Exception
+import Control.Monad
+import qualified Data.ByteString as BS
+import qualified Data.ByteString.Char8 as BS8
+import qualified Data.ByteString.Lazy as LBS
+import qualified Data.Map.Strict as M
+import qualified Data.List as L
+import Data.Bits (testBit)
+import qualified Crypto.Hash.BLAKE2.BLAKE2b as B2b
+import Data.Time.Clock (getCurrentTime, diffUTCTime)
+import qualified System.Environment as Env
+import qualified System.Exit as Sys
+import qualified System.EasyFile as FS
+import qualified Awelon.Hash as H
+import qualified Awelon.Syntax as P
+import qualified Awelon.Dict.Format as F
+import qualified Wikilon.DB as DB
+
+main :: IO ()
+main = Env.getArgs >>= \ args -> case args of
+    ["run", dir] -> run dir
+    _ -> do
+        putStrLn "usage: wikilon-conform run DIR"
+        Sys.exitFailure
+
+run :: FilePath -> IO ()
+run dir = do
+    let out = dir FS.</> "hs"
+    FS.createDirectoryIfMissing True out
+    blobs <- BS8.lines <$> BS.readFile (dir FS.</> "blobs.txt")
+    progs <- BS8.lines <$> BS.readFile (dir FS.</> "programs.txt")
+    dict <- BS.readFile (dir FS.</> "dict.hs.txt")
+    db <- DB.open (dir FS.</> "hs-db") 1024
+    let checks =
+            [ ("hash", blobs, return . fmap rscHash)
+            , ("parse", progs, return . fmap runParse)
+            , ("dict", [dict], return . L.concatMap runDict)
+            , ("stow", blobs, runStow db)
+            ]
+    timing <- forM checks $ \ (name, inputs, fn) -> do
+        _ <- evaluate (L.foldl' (\ n s -> n + BS.length s) 0 inputs)
+        t0 <- getCurrentTime
+        results <- fn inputs
+        _ <- evaluate (L.foldl' (\ n s -> n + BS.length s) 0 results)
+        t1 <- getCurrentTime
+        BS.writeFile (out FS.</> (name ++ ".txt")) (BS8.unlines results)
+        let millis = floor (1000 * diffUTCTime t1 t0) :: Integer
+        let bytes = L.sum (fmap BS.length inputs)
+        return (name ++ " " ++ show (L.length inputs) ++ " " ++ show bytes
+                     ++ " " ++ show millis)
+    writeFile (out FS.</> "timing.txt") (L.unlines timing)
+
+runParse :: BS.ByteString -> BS.ByteString
+runParse s = case P.decodeS s of
+    Right p -> LBS.toStrict (P.encode p)
+    Left _ -> BS8.pack "?"
+
+-- a sorted `word def` dump, after an encode and decode round trip
+runDict :: BS.ByteString -> [BS.ByteString]
+runDict s = fmap ent (M.toAscList (F.dictDefs d')) where
+    (_, d) = F.decode (LBS.fromStrict s)
+    (_, d') = F.decode (F.encode d)
+    ent (w, p) =
+        let def = LBS.toStrict (P.encode p) in
+        if BS.null def then P.wordBytes w else
+        BS.concat [P.wordBytes w, BS8.pack " ", def]
+
+-- The F# RscHash: a 320-bit BLAKE2b in Awelon's base32 alphabet, high
+-- bit first. Awelon.Hash uses the same alphabet with 280 bits.
+rscHash :: BS.ByteString -> BS.ByteString
+rscHash = base32 . B2b.hash 40 mempty where
+    base32 = BS8.pack . fmap ((H.hashAlphabet !!) . toW5) . groups . L.concatMap bits . BS.unpack
+    bits w = [testBit w ix | ix <- [7,6..0]]
+    groups [] = []
+    groups bs = let (a, b) = L.splitAt 5 bs in a : groups b
+    toW5 = L.foldl' (\ n b -> 2 * n + fromEnum b) 0
+
+-- stow every blob in one transaction, then load each after commit
+runStow :: DB.DB -> [BS.ByteString] -> IO [BS.ByteString]
+runStow db blobs = do
+    tx <- DB.newTX db
+    hs <- mapM (DB.stowRsc tx) blobs
+    ok <- DB.commit tx
+    unless ok $ fail "conformance stowage commit failed"
+    forM hs $ \ h -> do
+        r <- DB.loadRsc tx h
+        return $ maybe (BS8.pack "missing") rscHash r
+
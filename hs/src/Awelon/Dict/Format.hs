@@ -37,6 +37,7 @@
 module Awelon.Dict.Format
     ( Dict(..), emptyDict
     , decode, DictErr
+    , decodePar, decodeParN, splitChunks
     , encodeBB, encode
     , splitDict, splitLL, findLLSep 
     ) where
@@ -51,6 +52,8 @@ import Data.Int (Int64)
 import Data.Word (Word8)
 import qualified Data.Map as M
 import Data.Monoid
+import Control.Parallel.Strategies (Strategy, parMap)
+import GHC.Conc (numCapabilities)
 import Awelon.Syntax (NS(..), Word(..), Prog(..), validWordByte)
 import qualified Awelon.Syntax as P
 import Awelon.Hash
@@ -110,6 +113,35 @@ decode binary = ((eInc, eEnt), Dict inc ns defs) where
     ns = M.fromList [x | Right (Left x) <- ents]
     defs = M.fromList [x | Left x <- ents]
 
+-- | Decode a dictionary binary in parallel.
+--
+-- The binary is split into chunks at logical line boundaries (see
+-- splitChunks), and each chunk is decoded as a patch by a separate
+-- spark. Results are merged in order, so the last definition wins as
+-- with the sequential decoder. Returned parse errors are the same.
+--
+-- This uses one chunk per capability, so run with `+RTS -N`.
+decodePar :: LBS.ByteString -> (DictErr, Dict)
+decodePar = decodeParN numCapabilities
+
+-- | Parallel decode with a given number of chunks.
+decodeParN :: Int -> LBS.ByteString -> (DictErr, Dict)
+decodeParN n = mergeDecoded . parMap rdecoded decode . splitChunks n
+
+-- The Dict maps are spine-strict, so their size is computed only after
+-- every entry is parsed. And error entries are parsed to be listed.
+rdecoded :: Strategy (DictErr, Dict)
+rdecoded r@((_, eEnt), Dict _ ns defs) =
+    M.size ns `seq` M.size defs `seq` L.length eEnt `seq` return r
+
+-- merge in order; left-biased union with later chunks first
+mergeDecoded :: [(DictErr, Dict)] -> (DictErr, Dict)
+mergeDecoded [] = ((mempty, mempty), emptyDict)
+mergeDecoded rs@(((eInc,_), Dict inc _ _) : _) = ((eInc, eEnt), Dict inc ns defs) where
+    eEnt = L.concatMap (snd . fst) rs
+    ns = M.unions (L.reverse (fmap (dictNS . snd) rs))
+    defs = M.unions (L.reverse (fmap (dictDefs . snd) rs))
+
 decodeEnt :: LBS.ByteString -> Either (Word, Prog) (Either (NS, Maybe Hash) LBS.ByteString)
 decodeEnt s = 
     let badEnt = Right (Right s) in
@@ -191,6 +223,21 @@ splitDict s = case LBS.uncons s of
         Nothing -> (s, mempty)
         Just ix -> (LBS.take ix s, splitLL (LBS.drop (ix + 2) s))
 
+-- | Split a dictionary binary into about n chunks of similar size, at
+-- `LF @` line separators, dropping the LF. The first chunk has the
+-- header, and every other chunk starts with `@` so it may be decoded
+-- as a patch without a header.
+splitChunks :: Int -> LBS.ByteString -> [LBS.ByteString]
+splitChunks n s = 
+    let target = max 1 (LBS.length s `div` fromIntegral (max 1 n)) in
+    if (n <= 1) || (LBS.length s <= target) then [s] else
+    let (pre, suf) = LBS.splitAt (target - 1) s in
+    case findLLSep suf of
+        Nothing -> [s]
+        Just ix -> 
+            let len = LBS.length pre + ix in
+            LBS.take len s : splitChunks (n - 1) (LBS.drop (len + 1) s)
+
 -- note: we might wish to annotate line numbers in case of a parse error.
 
 -- parse hashes
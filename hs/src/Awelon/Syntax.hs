@@ -14,21 +14,23 @@ module Awelon.Syntax
     , Prog(..), Op(..)
     , encode, encodeBB
     , decode, DecoderStack, DecoderStuck
+    , decodeS, DecoderStuckS
+    , intern, internBytes
     , validWord, validWordByte, validAnno, validNS
     , validText, validTextByte
     ) where
 
 -- NOTES:
 --
--- I'd like to support a zero-copy option for parsing and zero allocation
--- for serializations.
+-- For zero-copy parsing, see `decodeS`, which slices tokens from a strict
+-- input. The encoder writes directly into a Builder.
 --
--- It might also be useful to support a rewrite optimization to intern the
--- tokens, albeit only if I'll be holding onto a program for a long while 
--- during normal usage.
+-- Interning tokens via `intern` is useful if we'll be holding onto a
+-- program for a long while during normal usage.
 
 import Prelude hiding (Word)
 import qualified Data.ByteString as BS
+import qualified Data.ByteString.Internal as BSI
 import qualified Data.ByteString.Lazy as LBS
 import qualified Data.ByteString.Builder as BB
 import qualified Data.ByteString.Builder.Extra as BB
@@ -39,6 +41,13 @@ import qualified Data.Array.Unboxed as A
 import Data.String
 import Data.Word (Word8)
 import Data.Monoid
+import Data.Bits (xor)
+import qualified Data.IntMap.Strict as IM
+import Control.Monad (filterM)
+import Control.Concurrent.MVar
+import System.Mem.Weak
+import GHC.ForeignPtr (ForeignPtr(..))
+import System.IO.Unsafe (unsafePerformIO)
 
 -- | Words are the primary user-definable unit of Awelon. A word is
 -- identified by an ideally small UTF-8 bytestring.
@@ -112,8 +121,10 @@ encode = toLBS . encodeBB where
 -- | In case you need to integrate the program into a larger binary,
 -- or desire an alternative allocation strategy.
 encodeBB :: Prog -> BB.Builder
-encodeBB = mconcat . addWhitespace . fmap opBB . progOps where
-    addWhitespace = L.intersperse (BB.word8 32)
+encodeBB (Prog ops) = case ops of
+    (op:ops') -> opBB op <> L.foldr sepOp mempty ops'
+    [] -> mempty
+  where sepOp op b = BB.word8 32 <> opBB op <> b
 
 opBB :: Op -> BB.Builder
 opBB (OpWord w) = BB.byteString (wordBytes w)
@@ -141,11 +152,34 @@ type DecoderStack = [[Op]]
 -- lightweight parse error diagnosis.
 type DecoderStuck = (DecoderStack, LBS.ByteString)
 
+-- | Input for the decoder, so one decoder serves lazy input (decode)
+-- and strict input (decodeS). Tokens are slices of the input, made
+-- strict by `tokBytes`.
+class DecoderInput s where
+    unconsI :: s -> Maybe (Word8, s)
+    spanI :: (Word8 -> Bool) -> s -> (s, s)
+    nullI :: s -> Bool
+    tokBytes :: s -> BS.ByteString
+
+instance DecoderInput LBS.ByteString where
+    unconsI = LBS.uncons
+    spanI = LBS.span
+    nullI = LBS.null
+    tokBytes = LBS.toStrict
+
+instance DecoderInput BS.ByteString where
+    unconsI = BS.uncons
+    spanI = BS.span
+    nullI = BS.null
+    tokBytes = id
+
 -- | decode input in small steps, with given parser state
-dstep :: DecoderStack -> [Op] -> LBS.ByteString -> Either DecoderStuck Prog
+dstep :: DecoderInput s => DecoderStack -> [Op] -> s -> Either (DecoderStack, s) Prog
+{-# SPECIALIZE dstep :: DecoderStack -> [Op] -> LBS.ByteString -> Either DecoderStuck Prog #-}
+{-# SPECIALIZE dstep :: DecoderStack -> [Op] -> BS.ByteString -> Either DecoderStuckS Prog #-}
 dstep cc r s =
     let decoderStuck = Left (r:cc, s) in
-    case LBS.uncons s of
+    case unconsI s of
         Nothing -> case cc of
             [] -> Right (Prog (L.reverse r)) -- program fully parsed!
             _ -> decoderStuck -- imbalanced blocks (missing ']')
@@ -158,37 +192,118 @@ dstep cc r s =
                     block = OpBlock (Prog (L.reverse r))
                 _ -> decoderStuck -- imbalanced blocks (extra ']')
             40 {- ( -} ->  -- annotations
-                let mkOp = OpAnno . Anno . Word . LBS.toStrict in
-                let (a, eoa) = LBS.span validWordByte s' in
-                if (LBS.null a) then decoderStuck else -- empty annotation?
-                case LBS.uncons eoa of
+                let mkOp = OpAnno . Anno . Word . tokBytes in
+                let (a, eoa) = spanI validWordByte s' in
+                if (nullI a) then decoderStuck else -- empty annotation?
+                case unconsI eoa of
                     Just (41, eoa') -> dstepNS cc r (mkOp a) eoa'
                     _ -> decoderStuck -- could not find close parens
             34 {- " -} -> -- embedded texts
-                let mkOp = OpText . Text . LBS.toStrict in
-                let (t, eot) = LBS.span validTextByte s' in
-                case LBS.uncons eot of
+                let mkOp = OpText . Text . tokBytes in
+                let (t, eot) = spanI validTextByte s' in
+                case unconsI eot of
                     Just (34, eot') -> dstepNS cc r (mkOp t) eot'
                     _ -> decoderStuck
             _ -> -- otherwise should be a normal word
-                let mkOp = OpWord . Word . LBS.toStrict in
-                let (w, eow) = LBS.span validWordByte s in
-                if LBS.null w then decoderStuck else
+                let mkOp = OpWord . Word . tokBytes in
+                let (w, eow) = spanI validWordByte s in
+                if nullI w then decoderStuck else
                 dstepNS cc r (mkOp w) eow
 
 -- | parse the namespace qualifier after any normal operation.
 -- Potentially qualify an operation multiple times.
-dstepNS :: DecoderStack -> [Op] -> Op -> LBS.ByteString -> Either DecoderStuck Prog
+dstepNS :: DecoderInput s => DecoderStack -> [Op] -> Op -> s -> Either (DecoderStack, s) Prog
+{-# SPECIALIZE dstepNS :: DecoderStack -> [Op] -> Op -> LBS.ByteString -> Either DecoderStuck Prog #-}
+{-# SPECIALIZE dstepNS :: DecoderStack -> [Op] -> Op -> BS.ByteString -> Either DecoderStuckS Prog #-}
 dstepNS cc r op s = 
     let decoderStuck = Left ((op:r):cc, s) in
-    case LBS.uncons s of
+    case unconsI s of
         Just (64, s') -> -- add namespace
-            let mkNS = OpNS op . NS . Word . LBS.toStrict in
-            let (ns, eons) = LBS.span validWordByte s' in
-            if LBS.null ns then decoderStuck else -- empty NS?
+            let mkNS = OpNS op . NS . Word . tokBytes in
+            let (ns, eons) = spanI validWordByte s' in
+            if nullI ns then decoderStuck else -- empty NS?
             dstepNS cc r (mkNS ns) eons
         _ -> dstep cc (op:r) s -- no NS qualifier
 
+-- | Parse a strict, serialized Awelon program without copying.
+--
+-- Words, annotations, namespaces, and texts are slices of the input,
+-- so a parsed program holds onto the entire input. That's a good fit
+-- for short-lived programs, or if the input is held anyway, such as a
+-- dictionary in memory. Otherwise, consider `intern` on the result.
+decodeS :: BS.ByteString -> Either DecoderStuckS Prog
+decodeS = dstep [] []
+
+-- | As DecoderStuck, but for a strict input.
+type DecoderStuckS = (DecoderStack, BS.ByteString)
+
+-- | Intern the words, annotations, and namespaces of a program, and
+-- copy its texts. 
+--
+-- Interned tokens are shared between all programs that use them, and
+-- the result no longer holds onto a larger input (see decodeS). This
+-- is worthwhile for programs held a long while, e.g. a dictionary in
+-- memory, where a few words are used very many times.
+intern :: Prog -> IO Prog
+intern = fmap Prog . mapM internOp . progOps
+
+internOp :: Op -> IO Op
+internOp (OpWord w) = OpWord <$> internWord w
+internOp (OpAnno (Anno w)) = OpAnno . Anno <$> internWord w
+internOp (OpBlock p) = OpBlock <$> intern p
+internOp (OpText (Text t)) = return $! OpText (Text (BS.copy t))
+internOp (OpNS op (NS w)) = OpNS <$> internOp op <*> (NS <$> internWord w)
+
+internWord :: Word -> IO Word
+internWord = fmap Word . internBytes . wordBytes
+
+-- Our intern table is keyed by a hash of the token, with weak refs
+-- to the interned tokens. Entries are pruned as tokens are collected.
+--
+-- The weak refs are keyed on the token's buffer (ForeignPtrContents),
+-- not the ByteString box, which GHC may unbox and rebox freely. So an
+-- entry lives as long as any slice of the interned buffer.
+type InternTable = IM.IntMap [Weak BS.ByteString]
+
+internTable :: MVar InternTable
+internTable = unsafePerformIO (newMVar IM.empty)
+{-# NOINLINE internTable #-}
+
+-- FNV-1a
+tokenHash :: BS.ByteString -> Int
+tokenHash = BS.foldl' step 2166136261 where
+    step h c = (h `xor` fromIntegral c) * 16777619
+
+-- | Return a shared copy of a token. 
+internBytes :: BS.ByteString -> IO BS.ByteString
+internBytes s = modifyMVar internTable $ \ tbl -> do
+    let h = tokenHash s
+    let ws = IM.findWithDefault [] h tbl
+    found <- findLive ws
+    case found of
+        Just s' -> return (tbl, s')
+        Nothing -> do
+            let s' = BS.copy s
+            w <- mkWeakBytes s' (prune h)
+            return (IM.insert h (w:ws) tbl, s')
+  where
+    findLive (w:ws) = deRefWeak w >>= \ mbs -> case mbs of
+        Just s' | (s' == s) -> return (Just s')
+        _ -> findLive ws
+    findLive [] = return Nothing
+
+-- weak reference to a token, keyed on its buffer
+mkWeakBytes :: BS.ByteString -> IO () -> IO (Weak BS.ByteString)
+mkWeakBytes s fin = case BSI.toForeignPtr s of
+    (ForeignPtr _ contents, _, _) -> mkWeak contents s (Just fin)
+
+-- remove dead entries from a bucket
+prune :: Int -> IO ()
+prune h = modifyMVar_ internTable $ \ tbl -> do
+    let ws = IM.findWithDefault [] h tbl
+    live <- filterM (fmap (maybe False (const True)) . deRefWeak) ws
+    return $! if L.null live then IM.delete h tbl else IM.insert h live tbl
+
 -- take text data, escaping characters as needed. 
 takeText :: LBS.ByteString -> (LBS.ByteString, LBS.ByteString) 
 takeText s = case LBS.uncons s of
@@ -66,7 +66,7 @@ instance CBK Word64 where
     {-# INLINE critBit #-}
 
 getBitFB :: FiniteBits b => Int -> b -> Bool
-getBitFB n a = testBit a ((finiteBitSize a) - n)
+getBitFB n a = testBit a ((finiteBitSize a) - 1 - n)
 {-# INLINE getBitFB #-}
 
 critBitFB :: FiniteBits b => Int -> b -> b -> Maybe Int
@@ -28,6 +28,7 @@ module Wikilon.DB
     , commit, commit_async
     , check
     , gcDB, gcDB_async
+    , GCStats(..), gcStats, gcFrameDelay
     , hashDeps
     , FilePath
     , ByteString
@@ -70,22 +71,18 @@ import Debug.Trace
 dbError :: String -> a
 dbError = error . (++) "Wikilon.DB: "
 
--- Thoughts: It would be convenient to ensure reads are also protected
--- by the ephemeron tables. This would require delay of GC for resources
--- potentially viewed through a reader lock.
+-- Reads are also protected by the ephemeron tables. New candidates for
+-- GC are delayed by a few write frames (gcFrameDelay), enough that our
+-- highest latency readers still have time to add ephemeral roots, and
+-- a TX adds an ephemeral root for every resource it loads.
 --
--- A viable option is to delay new candidates for GC by a few write frames,
--- enough that our highest latency readers still have time to add ephemeral
--- roots, and also to track ephemerons added on every new read.
+-- This raises the cost of reads by a small amount. But this is probably
+-- acceptable: the whole premise of Wikilon DB is to push most read-write
+-- costs to the stowage layer. In practice, we should only be reading a
+-- few roots.
 --
--- Obviously this would raise the cost of reads by a small amount. But this
--- is probably acceptable: the whole premise of Wikilon DB is to push most
--- read-write costs to the stowage layer. In practice, we should only be
--- reading a few roots.
---
--- More importantly, it would give me much of peace-of-mind to know that
--- all stowage references I've read are 'safe' for duration of a transaction,
--- modulo only those referenced from external sources.
+-- All stowage references read through a TX are thus 'safe' for duration
+-- of a transaction, modulo only those referenced from external sources.
 
 -- | Wikilon Database Object
 --
@@ -126,6 +123,7 @@ data DB = DB
   , db_new      :: !(MVar Stowage)         -- pending stowage
   , db_commit   :: !(MVar [Commit])        -- commit requests
   , db_hold     :: !(MVar RCU)             -- ephemeron table
+  , db_stats    :: !(MVar GCStats)         -- GC metrics
   } 
 -- notes: Reference counts are partitioned so we can quickly locate
 -- objects with zero references for purpose of incremental GC. The
@@ -149,6 +147,25 @@ type KVMap = M.Map ByteString ByteString    -- ^ safe keys and values.
 type Commit = ((KVMap,KVMap), MVar Bool)    -- ^ ((reads,writes),returns)
 data R = R !(MVar Int) !(MVar ())           -- ^ simple reader count
 type EphTbl = RCU                           -- ^ prevent GC of resources
+type GCAge = M.Map Hash Int                 -- ^ frame first seen as GC candidate
+
+-- | Number of write frames a resource must remain a GC candidate
+-- before it is collected. This gives readers time to root resources
+-- they've observed through a read lock.
+gcFrameDelay :: Int
+gcFrameDelay = 3
+
+-- | Garbage collection metrics, cumulative except where noted.
+data GCStats = GCStats
+  { gc_frames       :: !Int     -- ^ write frames
+  , gc_pending      :: !Int     -- ^ candidates awaiting delay (current)
+  , gc_oldestAge    :: !Int     -- ^ frames for oldest pending candidate (current)
+  , gc_reclaimed    :: !Int     -- ^ resources collected
+  , gc_reclaimedB   :: !Int     -- ^ bytes of resources collected
+  } deriving (Eq, Show)
+
+emptyGCStats :: GCStats
+emptyGCStats = GCStats 0 0 0 0 0
 
 -- Key Length for Stowage
 --
@@ -345,6 +362,7 @@ open fp nMB = do
             dbCommit <- newMVar mempty
             dbNew <- newMVar mempty
             dbHold <- newMVar mempty
+            dbStats <- newMVar emptyGCStats
 
             let db = DB { db_fp = fp
                         , db_fl = lock
@@ -358,6 +376,7 @@ open fp nMB = do
                         , db_commit = dbCommit
                         , db_new = dbNew
                         , db_hold = dbHold
+                        , db_stats = dbStats
                         }
 
             forkIO (dbWriter db)
@@ -602,10 +621,24 @@ assumeKey (TX _ st) (force -> !k) (force -> !mbv) =
 -- attacks, which leaves a sufficient 140 bits for security. But the
 -- client should take care to leak no more than the database does. 
 loadRsc :: TX -> Hash -> IO (Maybe ByteString)
-loadRsc (TX db _) = loadRscDB db
+loadRsc tx h = 
+    loadRscDB (txDB tx) h >>= \ r ->
+    when (isJust r) (holdRsc tx h) >> return r
     -- At the moment, we don't store pending stowage in the TX.
     -- But this might change later.
 
+-- Add a loaded resource to the TX ephemeron table. The dependencies
+-- of a rooted resource can't be collected, so we don't scan for them.
+-- The resource itself might have been observed through a read lock
+-- just before it became a GC candidate, but it can't be collected for
+-- a few more frames (gcFrameDelay).
+holdRsc :: TX -> Hash -> IO ()
+holdRsc (TX db st) (force -> !h) = modifyMVarMasked_ st $ \ s ->
+    if M.member (shortHash h) (tx_hold s) then return s else do
+    let ephUpd = mkRCU 1 [h]
+    dbAddEph db ephUpd
+    return $! s { tx_hold = M.union (tx_hold s) ephUpd }
+
 -- | Load resource from database.
 loadRscDB :: DB -> Hash -> IO (Maybe ByteString)
 loadRscDB db h = 
@@ -646,7 +679,8 @@ withRscMDB' db txn h action = withBS_as_MDB h $ \ mdbH ->
 -- The bytestring provided here is unsafe outside the `withRsc` call.
 --
 withRsc :: TX -> Hash -> (ByteString -> IO a) -> IO (Maybe a)
-withRsc (TX db _) = withRscDB db
+withRsc tx h action = withRscDB (txDB tx) h $ \ v -> 
+    holdRsc tx h >> action v
 
 withRscDB :: DB -> Hash -> (ByteString -> IO a) -> IO (Maybe a)
 withRscDB db h action =
@@ -793,16 +827,27 @@ verifyReadsDB db r =
 -- so this forces GC by committing an faux transaction. Committing an
 -- empty transaction doesn't do the same because read-only transactions 
 -- are optimized.
+--
+-- GC candidates must age across a few write frames (gcFrameDelay), so
+-- this runs enough frames to collect resources that are currently
+-- unrooted.
 gcDB :: DB -> IO ()
-gcDB db = gcDB_async db >>= id
+gcDB db = replicateM_ (1 + gcFrameDelay) (gcDB_async db >>= id)
 
--- | asynchronous variant of gcDB
+-- | asynchronous variant of gcDB, running a single write frame.
+--
+-- This is safe to call periodically alongside readers and writers,
+-- and will eventually collect resources that stay unrooted.
 gcDB_async :: DB -> IO (IO ())
 gcDB_async db = do
     ret <- newEmptyMVar
     dbPushCommit db ((mempty,mempty),ret)
     return (readMVar ret >>= \ b -> assert b $ return ())
 
+-- | Recent GC metrics.
+gcStats :: DB -> IO GCStats
+gcStats = readMVar . db_stats
+
 -- | Diagnose a transaction.
 --
 -- This function returns a list of keys whose transactional values
@@ -828,12 +873,14 @@ check (TX db st) =
 -- memory-mapped database to avoid copying data that is about to
 -- be deleted or overwritten (via unsafeMDB_to_BS).
 -- 
--- There is also a two frame latency between decref of any resource 
--- and subsequent GC. This ensures we don't eliminate any reference
--- that an active reader (such as readKey) might be observing. The
--- reader may add a reference to db_hold to hold it for longer. This
--- latency is mitigated by potentially running multiple GC frames 
--- while progress is steady.
+-- There is also a latency of gcFrameDelay write frames between a
+-- resource becoming a GC candidate and its collection. This ensures
+-- we don't eliminate any reference that an active reader (such as
+-- readKey or loadRsc) might be observing. The reader may add a
+-- reference to db_hold to hold it for longer, which resets the age
+-- of the candidate. Once a resource is collected, its dependencies
+-- may be collected in the same frame, since they were reachable only
+-- through an aged candidate.
 -- 
 -- All new resources are written. Due to db_hold of new stowage, it's
 -- almost never the case that we can filter new resources based on a
@@ -856,7 +903,7 @@ dbWriter !db = initLoop `catches` handlers where
         Sys.exitFailure
 
     -- start loop with initial read frame
-    initLoop = advanceReadFrame db >>= writeLoop mempty
+    initLoop = advanceReadFrame db >>= writeLoop 0 mempty mempty
 
     -- verify a read against accepted write set or LMDB
     checkRead :: MDB_txn -> KVMap -> (ByteString, ByteString) -> IO Bool
@@ -873,8 +920,8 @@ dbWriter !db = initLoop `catches` handlers where
         tryPutMVar ret False >> return ws
 
         
-    writeLoop :: EphTbl -> R -> IO ()
-    writeLoop !rHold !r = do
+    writeLoop :: Int -> GCAge -> EphTbl -> R -> IO ()
+    writeLoop !frame !ages !rHold !r = do
         -- wait for work
         takeMVar (db_signal db) 
         
@@ -905,10 +952,20 @@ dbWriter !db = initLoop `catches` handlers where
                 let memb = M.member (shortHash h) in
                 memb rcu0 || memb hold || memb rHold
         let initRC = mapKeysM (dbGetRefct db txn)
-        let gcLoop !gc !rc ngc = 
+
+        -- new candidates must age before GC, so we skip candidates that
+        -- are still young and record when we first see the others.
+        let isYoung h = maybe False (\ f -> (frame - f) < gcFrameDelay) (M.lookup h ages)
+        let isAged h = maybe False (\ f -> (frame - f) >= gcFrameDelay) (M.lookup h ages)
+
+        -- Cascading GC collects dependencies that reach zero only if they
+        -- have already aged. Others are deferred as new candidates, since
+        -- a reader may have seen them via the candidate we collect.
+        let gcLoop !gc !rc !gcB defer ngc = 
                 let done = (qgc < M.size gc) || (M.null ngc) in
-                if done then return (gc, rc) else
+                if done then return (gc, rc, gcB, defer) else
                 mapM (peekRsc db txn) (M.keys ngc) >>= \ dd -> -- dropped deps
+                let gcB' = gcB + L.sum (fmap (maybe 0 BS.length) dd) in
                 let rcu = mkRCU (-1) (L.concatMap (maybe [] hashDeps) dd) in
                 initRC (M.difference rcu rc) >>= \ nrc -> -- new reference counts
                 let rc' = M.unionsWith (+) [(M.difference rc ngc), rcu, nrc] in
@@ -919,11 +976,20 @@ dbWriter !db = initLoop `catches` handlers where
                         Just ct -> (0 == ct) && not (blockDel h)
                 in
                 let ngc' = filterKeys mayGC rcu in -- next GC is subset of rcu
-                gcLoop gc' rc' ngc'
-        
+                let (ngcAged, ngcNew) = M.partitionWithKey (\ h _ -> isAged h) ngc' in
+                gcLoop gc' rc' gcB' (M.keys ngcNew ++ defer) ngcAged
+
         rc0 <- M.unionWith (+) rcu0 <$> initRC rcu0
-        ngc0 <- mkRCU 0 <$> dbGCPend db txn (not . blockDel) qc
-        (gc,rc) <- gcLoop mempty rc0 ngc0
+        pend <- dbGCPend db txn (\ h -> not (blockDel h || isYoung h)) qc
+        let (aged, unseen) = L.partition isAged pend
+        let ngc0 = mkRCU 0 aged
+        (gc,rc,gcB,deferred) <- gcLoop mempty rc0 0 [] ngc0
+
+        -- candidates rooted, referenced, or collected must start over.
+        -- Deferred candidates keep their age if they already have one.
+        let stillZero h _ = not (blockDel h) && maybe True (== 0) (M.lookup h rc)
+        ages' <- evaluate $!! M.union (M.filterWithKey stillZero (M.difference ages gc))
+                                      (M.fromList [(BS.copy h, frame) | h <- unseen ++ deferred])
 
         assert (M.null (M.intersection gc rc)) $ return () -- sanity check
         when (M.size gc >= qc) $ dbSignal db -- heuristically signal more GC
@@ -952,10 +1018,20 @@ dbWriter !db = initLoop `catches` handlers where
         let rHold' = owRCU                  -- hold decref'd resources one more frame
         mdb_env_sync_flush (db_env db)      -- commit write to disk
 
+        -- update metrics
+        let oldest = if M.null ages' then 0 else (frame - L.minimum (M.elems ages'))
+        modifyMVarMasked_ (db_stats db) $ \ st -> return $! 
+            st { gc_frames = 1 + gc_frames st
+               , gc_pending = M.size ages'
+               , gc_oldestAge = oldest
+               , gc_reclaimed = M.size gc + gc_reclaimed st
+               , gc_reclaimedB = gcB + gc_reclaimedB st 
+               }
+
         -- report success, release completed stowage, continue
         mapM_ (flip tryPutMVar True . snd) txList
         modifyMVarMasked_ (db_new db) $ \ m -> return $! (M.difference m stowed)
-        writeLoop rHold' r' 
+        writeLoop (frame + 1) ages' rHold' r' 
 
 
 -- zero-copy reference to an LMDB layer bytestring. This result is
@@ -1,10 +1,10 @@
-
+{-# LANGUAGE BangPatterns #-}
 -- | First-Class Key-Value Databases
 --
 -- Wikilon.DB offers a mutable key-value database with stowage and GC.
 -- This KVM models a key-value map above stowage, enabling first class
 -- database values to potentially be larger than memory.
--- 
+--
 -- The tree structure used for KVM is a variant of a crit-bit tree or
 -- trie. Differences from conventional crit-bit tree:
 --
@@ -12,7 +12,7 @@
 -- - each key is associated with a binary value (which may be empty)
 -- - keys, values, nodes may be stowed outside of volatile memory
 --
--- Keys and values within the KVM are free to reference other stowage 
+-- Keys and values within the KVM are free to reference other stowage
 -- resources. But keys mustn't have any trailing null bytes.
 --
 -- Batched updates are important: it's inefficient to allocate lots of
@@ -21,18 +21,49 @@
 --
 -- First-class database values offer a lot of benefits over conventional
 -- key-value databases: histories, forking, diffs, composition. Wikilon
--- relies on KVM for most data indexing and processing. 
+-- relies on KVM for most data indexing and processing.
 --
 module Wikilon.KVM
     ( Key, Val
-
+    , KVM(..), Node(..)
+    , empty, null, singleton, validKey
+    , lookup, member, toList, fromList
+    , union, unionWith, difference
+    , VDiff(..), diff
+    , Batch, applyBatch, insert, delete
+    , Buffer, buffer, bufBase, bufPending
+    , bufLookup, bufWrite, bufFlush
+    , compact
+    , encode, decode
     ) where
 
+import Prelude hiding (lookup, null)
+import Control.Monad
+import Control.Exception (evaluate)
+import Control.DeepSeq (force)
+import Data.Functor.Identity
+import Data.Monoid
+import Data.Bits
+import qualified Data.ByteString as BS
+import qualified Data.ByteString.Char8 as BS8
+import qualified Data.ByteString.Unsafe as BS
 import qualified Data.ByteString.Lazy as LBS
-import Control.Exception
+import qualified Data.ByteString.Builder as BB
+import qualified Data.Map.Strict as M
+import qualified Data.List as L
+import Awelon.Hash (Hash)
+import qualified Wikilon.DB as DB
+
+-- Keys and values are strict bytestrings, same as Wikilon.DB. This
+-- allows us to slice keys and values from a stowed node without a
+-- separate copy for every field.
+type Key = BS.ByteString
+type Val = BS.ByteString
 
-type Key = LBS.ByteString
-type Val = LBS.ByteString
+-- these errors indicate a corrupt or missing stowage node, or an
+-- invalid key
+kvmError :: String -> a
+kvmError = error . (++) "Wikilon.KVM: "
 
 -- our crit-bit tree doesn't distinguish keys with trailing NULLs,
 -- instead treating every key as having an infinite extent of zero
@@ -41,11 +72,409 @@ type Val = LBS.ByteString
 -- Since we can't distinguish keys with trailing NULLs, we also should
 -- not accept them into our trees.
 validKey :: Key -> Bool
-validKey s = LBS.null s || (0 /= LBS.last s)
+validKey s = BS.null s || (0 /= BS.last s)
+
+-- reject keys that would collide with a shorter key
+checkKey :: Key -> Key
+checkKey k | validKey k = k
+           | otherwise = kvmError ("invalid key (trailing NUL) " ++ show k)
+
+-- | A key-value map. Structurally similar to Wikilon.CBT, except that
+-- nodes may be stowed. Stowed nodes are loaded through a transaction,
+-- which should root them (see Wikilon.DB.clearRsc).
+data KVM
+    = Empty
+    | Root !Key !Node
+    deriving (Eq)
+
+data Node
+    = Leaf !Val
+    | Inner {-# UNPACK #-} !Int Node !Key Node
+    | Stowed !Hash
+    deriving (Eq)
+
+instance Show KVM where
+    showsPrec _ Empty = showString "KVM.empty"
+    showsPrec _ (Root k _) = showString "KVM@" . shows k
+
+empty :: KVM
+empty = Empty
+
+null :: KVM -> Bool
+null Empty = True
+null _ = False
+
+singleton :: Key -> Val -> KVM
+singleton k v = Root k (Leaf v)
+
+-- bit at offset n, with offset 0 as the high bit of the first byte.
+getBit :: Int -> Key -> Bool
+getBit n k =
+    let (q,r) = n `divMod` 8 in
+    if (q >= BS.length k) then False else
+    testBit (BS.unsafeIndex k q) (7 - r)
+{-# INLINE getBit #-}
+
+-- first differing bit no less than offset n, or Nothing if equal.
+critBit :: Int -> Key -> Key -> Maybe Int
+critBit n a b = go (n `div` 8) where
+    end = max (BS.length a) (BS.length b)
+    byte s q = if (q >= BS.length s) then 0 else BS.unsafeIndex s q
+    mask q x = if (q == (n `div` 8)) then x .&. (0xFF `shiftR` (n `mod` 8)) else x
+    go !q =
+        if (q >= end) then Nothing else
+        let x = mask q (byte a q `xor` byte b q) in
+        if (0 == x) then go (q + 1) else
+        Just $! (8 * q) + countLeadingZeros x
+
+-- least key and node
+type T = (Key, Node)
+
+-- crit-bit of an exposed node; leaves are below every crit-bit.
+topBit :: Node -> Int
+topBit (Inner cb _ _ _) = cb
+topBit _ = maxBound
+
+-- join subtrees at crit-bit. An empty side collapses the node.
+inner :: Int -> Maybe T -> Maybe T -> Maybe T
+inner cb (Just (k,l)) (Just (rk,r)) = Just (k, Inner cb l rk r)
+inner _ l Nothing = l
+inner _ Nothing r = r
+
+toKVM :: Maybe T -> KVM
+toKVM = maybe Empty (uncurry Root)
+
+-- Load a stowed node one level. Nested stowed nodes remain stowed.
+-- The resource is copied once, then keys and values are slices.
+exposeTX :: DB.TX -> Node -> IO Node
+exposeTX tx (Stowed h) = DB.loadRsc tx h >>= \ mbs -> case mbs of
+    Just s -> case decodeNode s of
+        Just (n, rem) | BS.null rem -> exposeTX tx n
+        _ -> kvmError ("malformed node " ++ show h)
+    Nothing -> kvmError ("missing node " ++ show h)
+exposeTX _ n = return n
+
+-- for in-memory trees
+exposeMem :: Node -> Identity Node
+exposeMem (Stowed h) = kvmError ("unexpected stowed node " ++ show h)
+exposeMem n = return n
+
+-- | Lookup a key.
+--
+-- Stowed nodes are scanned in place via Wikilon.DB.withRsc, without
+-- decoding the node. Only the result and the least key and hash of
+-- the next stowed node are copied.
+lookup :: DB.TX -> Key -> KVM -> IO (Maybe Val)
+lookup _ _ Empty = return Nothing
+lookup tx k (Root lk0 n0) = go lk0 n0 where
+    go lk (Leaf v) = return $! if (lk == k) then Just v else Nothing
+    go lk (Inner cb l rk r) = if getBit cb k then go rk r else go lk l
+    go lk (Stowed h) = DB.withRsc tx h (evaluate . force . scan lk) >>= \ r -> case r of
+        Just (Right v) -> return v
+        Just (Left (lk', h')) -> go lk' (Stowed h')
+        Nothing -> kvmError ("missing node " ++ show h)
+
+    scan lk s = case BS.uncons s of
+        Just (58, s') -> case readSized s' of -- ':' leaf
+            Just (v, _) -> Right (if (lk == k) then Just (BS.copy v) else Nothing)
+            Nothing -> kvmError "malformed leaf"
+        Just (42, s') -> case readInner s' of -- '*' inner
+            Just (cb, l, rk, r) -> if getBit cb k then scan rk r else scan lk l
+            Nothing -> kvmError "malformed inner node"
+        Just (123, s') -> case readHash s' of -- '{' stowed
+            Just (h, _) -> Left (BS.copy lk, BS.copy h)
+            Nothing -> kvmError "malformed node reference"
+        _ -> kvmError "malformed node"
+
+member :: DB.TX -> Key -> KVM -> IO Bool
+member tx k m = maybe False (const True) <$> lookup tx k m
+
+-- | Load all key-value pairs, in key order.
+toList :: DB.TX -> KVM -> IO [(Key, Val)]
+toList _ Empty = return []
+toList tx (Root k n) = toListT (exposeTX tx) (k,n)
+
+toListT :: Monad m => (Node -> m Node) -> T -> m [(Key, Val)]
+toListT expose = go [] where
+    go acc (k,n) = expose n >>= \ n' -> case n' of
+        Leaf v -> return ((k,v) : acc)
+        Inner _ l rk r -> go acc (rk,r) >>= \ acc' -> go acc' (k,l)
+        Stowed _ -> kvmError "exposed a stowed node"
+
+-- | Construct an in-memory KVM from a list. Later keys win. Keys
+-- with trailing NULs are rejected (see validKey).
+fromList :: [(Key, Val)] -> KVM
+fromList = toKVM . L.foldl' ins Nothing where
+    ins Nothing (k,v) = (checkKey k) `seq` Just (k, Leaf v)
+    ins (Just t) (k,v) = (checkKey k) `seq` runIdentity (
+        mergeT exposeMem unionOp 0 (k, Leaf v) t)
+
+-- Merge of two trees. Subtrees only in the left tree are kept.
+-- Identical stowed subtrees are detected by hash and never loaded.
+data MergeOp = MergeOp
+    { mo_both   :: Val -> Val -> Maybe Val  -- key in both trees
+    , mo_right  :: !Bool                    -- keep keys only in right
+    , mo_same   :: !Bool                    -- keep identical subtrees
+    }
+
+unionOp :: MergeOp
+unionOp = MergeOp (\ a _ -> Just a) True True
+
+mergeT :: Monad m => (Node -> m Node) -> MergeOp -> Int -> T -> T -> m (Maybe T)
+mergeT expose op = go where
+    keepR t = if mo_right op then Just t else Nothing
+    go n a@(ka, Stowed ha) (kb, Stowed hb) | (ka == kb) && (ha == hb) =
+        return (if mo_same op then Just a else Nothing)
+    go n (ka,na0) (kb,nb0) = do
+        na <- expose na0
+        nb <- expose nb0
+        let c = maybe maxBound id (critBit n ka kb)
+        let ta = topBit na
+        let tb = topBit nb
+        if (c < ta) && (c < tb) then
+            -- disjoint trees, least key goes left
+            return $! if getBit c ka
+                then inner c (keepR (kb,nb0)) (Just (ka,na0))
+                else inner c (Just (ka,na0)) (keepR (kb,nb0))
+        else case (na, nb) of
+            (Leaf va, Leaf vb) ->
+                return $! fmap ((,) ka . Leaf) (mo_both op va vb)
+            (Inner t al ark ar, Inner t' bl brk br) | (t == t') -> do
+                l' <- go t (ka,al) (kb,bl)
+                r' <- go t (ark,ar) (brk,br)
+                return $! inner t l' r'
+            (Inner t al ark ar, _) | (t < tb) ->
+                if getBit t kb
+                    then inner t (Just (ka,al)) <$> go t (ark,ar) (kb,nb)
+                    else (\ l' -> inner t l' (Just (ark,ar))) <$> go t (ka,al) (kb,nb)
+            (_, Inner t bl brk br) ->
+                if getBit t ka
+                    then inner t (keepR (kb,bl)) <$> go t (ka,na) (brk,br)
+                    else (\ l' -> inner t l' (keepR (brk,br))) <$> go t (ka,na) (kb,bl)
+            _ -> kvmError "unexpected merge"
+
+mergeKVM :: DB.TX -> MergeOp -> KVM -> KVM -> IO KVM
+mergeKVM _ op a Empty = return a
+mergeKVM _ op Empty b = return (if mo_right op then b else Empty)
+mergeKVM tx op (Root ka na) (Root kb nb) =
+    toKVM <$> mergeT (exposeTX tx) op 0 (ka,na) (kb,nb)
 
+-- | Left-biased union. Subtrees that appear in only one argument
+-- are shared, not copied or loaded.
+union :: DB.TX -> KVM -> KVM -> IO KVM
+union tx = mergeKVM tx unionOp
 
+unionWith :: DB.TX -> (Val -> Val -> Val) -> KVM -> KVM -> IO KVM
+unionWith tx fn = mergeKVM tx (unionOp { mo_both = \ a b -> Just (fn a b) })
 
+-- | Keys in the left map but not the right.
+difference :: DB.TX -> KVM -> KVM -> IO KVM
+difference tx = mergeKVM tx (MergeOp (\ _ _ -> Nothing) False False)
+
+-- | Differences between two maps.
+data VDiff
+    = InL !Val          -- ^ key only in left
+    | InR !Val          -- ^ key only in right
+    | Diff !Val !Val    -- ^ key in both with different values
+    deriving (Eq, Show)
+
+-- | Compute differences in key order. Identical stowed subtrees are
+-- skipped without loading, so diffs between versions of a large map
+-- are proportional to the changes.
+diff :: DB.TX -> KVM -> KVM -> IO [(Key, VDiff)]
+diff _ Empty Empty = return []
+diff tx a Empty = fmap (fmap InL) <$> toList tx a
+diff tx Empty b = fmap (fmap InR) <$> toList tx b
+diff tx (Root ka0 a0) (Root kb0 b0) = go 0 (ka0,a0) (kb0,b0) where
+    expose = exposeTX tx
+    onlyL t = fmap (fmap InL) <$> toListT expose t
+    onlyR t = fmap (fmap InR) <$> toListT expose t
+    go _ (ka, Stowed ha) (kb, Stowed hb) | (ka == kb) && (ha == hb) = return []
+    go n (ka,na0) (kb,nb0) = do
+        na <- expose na0
+        nb <- expose nb0
+        let c = maybe maxBound id (critBit n ka kb)
+        let ta = topBit na
+        let tb = topBit nb
+        if (c < ta) && (c < tb) then
+            if getBit c ka
+                then (++) <$> onlyR (kb,nb) <*> onlyL (ka,na)
+                else (++) <$> onlyL (ka,na) <*> onlyR (kb,nb)
+        else case (na, nb) of
+            (Leaf va, Leaf vb) ->
+                return $ if (va == vb) then [] else [(ka, Diff va vb)]
+            (Inner t al ark ar, Inner t' bl brk br) | (t == t') ->
+                (++) <$> go t (ka,al) (kb,bl) <*> go t (ark,ar) (brk,br)
+            (Inner t al ark ar, _) | (t < tb) ->
+                if getBit t kb
+                    then (++) <$> onlyL (ka,al) <*> go t (ark,ar) (kb,nb)
+                    else (++) <$> go t (ka,al) (kb,nb) <*> onlyL (ark,ar)
+            (_, Inner t bl brk br) ->
+                if getBit t ka
+                    then (++) <$> onlyR (kb,bl) <*> go t (ka,na) (brk,br)
+                    else (++) <$> go t (ka,na) (kb,bl) <*> onlyR (brk,br)
+            _ -> kvmError "unexpected diff"
+
+-- | A batch of writes, with Nothing for deletion.
+type Batch = M.Map Key (Maybe Val)
+
+-- | Apply a batch of writes.
+--
+-- The batch is built into in-memory trees for insertions and deletions,
+-- then merged. Each path through the tree is rewritten at most once per
+-- merge, rather than once per key, and untouched subtrees are shared.
+applyBatch :: DB.TX -> Batch -> KVM -> IO KVM
+applyBatch tx b m = do
+    mapM_ (evaluate . checkKey) (M.keys b)
+    let ins = fromList [(k,v) | (k, Just v) <- M.toList b]
+    let del = fromList [(k,mempty) | (k, Nothing) <- M.toList b]
+    m' <- union tx ins m
+    difference tx m' del
+
+insert :: DB.TX -> Key -> Val -> KVM -> IO KVM
+insert tx k v = applyBatch tx (M.singleton k (Just v))
+
+delete :: DB.TX -> Key -> KVM -> IO KVM
+delete tx k = applyBatch tx (M.singleton k Nothing)
+
+-- | A KVM with pending writes, flushed as a batch.
+data Buffer = Buffer
+    { bufBase    :: !KVM
+    , bufPending :: !Batch
+    }
+
+buffer :: KVM -> Buffer
+buffer m = Buffer m mempty
+
+bufLookup :: DB.TX -> Key -> Buffer -> IO (Maybe Val)
+bufLookup tx k b = case M.lookup k (bufPending b) of
+    Just pending -> return pending
+    Nothing -> lookup tx k (bufBase b)
+
+-- | Write a key, or delete it with Nothing. Pending writes are flushed
+-- when there are more than the given number.
+bufWrite :: DB.TX -> Int -> Key -> Maybe Val -> Buffer -> IO Buffer
+bufWrite tx limit k v b = evaluate (checkKey k) >>
+    let b' = b { bufPending = M.insert k v (bufPending b) } in
+    if (M.size (bufPending b') <= limit) then return b' else
+    bufFlush tx b'
+
+bufFlush :: DB.TX -> Buffer -> IO Buffer
+bufFlush tx (Buffer m p) =
+    if M.null p then return (Buffer m p) else
+    buffer <$> applyBatch tx p m
+
+-- Node Encoding
+--
+--   node := ':' len SP val
+--         | '*' cb SP lsz SP node(lsz bytes) len SP key node
+--         | '{' hash '}'
+--
+-- The left node size lets lookups skip over left subtrees without
+-- parsing them. Numbers are decimal, which isn't in the hash alphabet,
+-- and hashes are delimited with braces, so Wikilon.DB's conservative
+-- GC recognizes stowed nodes.
+
+sized :: BS.ByteString -> BB.Builder
+sized s = BB.intDec (BS.length s) <> BB.char7 ' ' <> BB.byteString s
+
+sizedLen :: BS.ByteString -> Int
+sizedLen s = decLen (BS.length s) + 1 + BS.length s
+
+decLen :: Int -> Int
+decLen = L.length . show
+
+stowedRef :: Hash -> BB.Builder
+stowedRef h = BB.char7 '{' <> BB.byteString h <> BB.char7 '}'
+
+readNat :: BS.ByteString -> Maybe (Int, BS.ByteString)
+readNat s = case BS8.readInt s of
+    Just (n, s') | (n >= 0) -> case BS.uncons s' of
+        Just (32, s'') -> Just (n, s'')
+        _ -> Nothing
+    _ -> Nothing
+
+readSized :: BS.ByteString -> Maybe (BS.ByteString, BS.ByteString)
+readSized s = readNat s >>= \ (n, s') ->
+    if (n > BS.length s') then Nothing else
+    Just (BS.splitAt n s')
+
+-- (cb, left node, right key, right node)
+readInner :: BS.ByteString -> Maybe (Int, BS.ByteString, Key, BS.ByteString)
+readInner s = do
+    (cb, s1) <- readNat s
+    (lsz, s2) <- readNat s1
+    guard (lsz <= BS.length s2)
+    let (l, s3) = BS.splitAt lsz s2
+    (rk, r) <- readSized s3
+    return (cb, l, rk, r)
+
+readHash :: BS.ByteString -> Maybe (Hash, BS.ByteString)
+readHash s =
+    let (h, s') = BS.break (== 125) s in
+    case BS.uncons s' of
+        Just (125, s'') -> Just (h, s'')
+        _ -> Nothing
+
+decodeNode :: BS.ByteString -> Maybe (Node, BS.ByteString)
+decodeNode s = case BS.uncons s of
+    Just (58, s') -> readSized s' >>= \ (v, rem) -> return (Leaf v, rem)
+    Just (42, s') -> do
+        (cb, ls, rk, rs) <- readInner s'
+        (l, lrem) <- decodeNode ls
+        guard (BS.null lrem)
+        (r, rem) <- decodeNode rs
+        return (Inner cb l rk r, rem)
+    Just (123, s') -> readHash s' >>= \ (h, rem) -> return (Stowed h, rem)
+    _ -> Nothing
+
+-- encode a node, with its encoded size
+encodeNode :: Node -> (BB.Builder, Int)
+encodeNode (Leaf v) = (BB.char7 ':' <> sized v, 1 + sizedLen v)
+encodeNode (Stowed h) = (stowedRef h, 2 + BS.length h)
+encodeNode (Inner cb l k r) = innerEnc cb (encodeNode l) k (encodeNode r)
+
+innerEnc :: Int -> (BB.Builder, Int) -> Key -> (BB.Builder, Int) -> (BB.Builder, Int)
+innerEnc cb (lb, lsz) k (rb, rsz) = (b, sz) where
+    b = BB.char7 '*' <> BB.intDec cb <> BB.char7 ' '
+     <> BB.intDec lsz <> BB.char7 ' ' <> lb
+     <> sized k <> rb
+    sz = 1 + decLen cb + 1 + decLen lsz + 1 + lsz + sizedLen k + rsz
+
+toBS :: BB.Builder -> BS.ByteString
+toBS = LBS.toStrict . BB.toLazyByteString
+
+-- | Stow nodes whose encoding is larger than a threshold, bottom up.
+--
+-- Nodes already stowed are kept, so compacting an updated map only
+-- stows the new paths. A reasonable threshold is a few kilobytes,
+-- amortizing the hash and lookup overheads of stowage. The resulting
+-- hashes are rooted by the transaction until written to a key.
+compact :: DB.TX -> Int -> KVM -> IO KVM
+compact _ _ Empty = return Empty
+compact tx thresh (Root k n0) = Root k . fst <$> go n0 where
+    stow n enc@(b, sz) =
+        if (sz < thresh) then return (n, enc) else do
+        h <- DB.stowRsc tx (toBS b)
+        return (Stowed h, encodeNode (Stowed h))
+    go (Inner cb l rk r) = do
+        (l', le) <- go l
+        (r', re) <- go r
+        stow (Inner cb l' rk r') (innerEnc cb le rk re)
+    go n@(Stowed _) = return (n, encodeNode n)
+    go n = stow n (encodeNode n)
 
+-- | Encode a KVM root, e.g. for Wikilon.DB.writeKey. Compact the KVM
+-- first to keep the root small.
+encode :: KVM -> BS.ByteString
+encode Empty = mempty
+encode (Root k n) = toBS (sized k <> fst (encodeNode n))
 
--- | A simple trie with bytestring data. 
+decode :: BS.ByteString -> Maybe KVM
+decode s =
+    if BS.null s then Just Empty else do
+    (k, s') <- readSized s
+    (n, rem) <- decodeNode s'
+    guard (BS.null rem)
+    return (Root k n)
 
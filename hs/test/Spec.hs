@@ -1,12 +1,19 @@
 {-# LANGUAGE OverloadedStrings #-}
 
 import Control.Monad
+import qualified Data.ByteString as BS
 import qualified Data.ByteString.Lazy as LBS
+import qualified Data.ByteString.Internal as BSI
 import qualified Data.ByteString.Lazy.UTF8 as LU8
 import qualified System.EasyFile as FS
 import qualified Wikilon.DB as DB
+import qualified Wikilon.KVM as KVM
+import qualified Data.Map.Strict as M
+import qualified Awelon.Syntax as P
+import qualified Awelon.Dict.Format as F
 import qualified Data.List as L
 import Control.Exception
+import Data.Maybe
 import Debug.Trace
 import System.Mem
 
@@ -14,8 +21,10 @@ import System.Mem
     
 main :: IO ()
 main = withTmpDir "wikilon-test" $ do
+    testSyntax
     (Right db) <- DB.open "test-db" 1000
     testDB db
+    testKVM db
     return ()
 
 
@@ -97,7 +106,108 @@ testDB db = do
     unless (utf8 (sel hs) == hs') $
         fail ("failure to read expected hashes")
 
-
+    -- unrooted resources are collected once they've aged
+    st <- DB.gcStats db
+    unless ((DB.gc_frames st > DB.gcFrameDelay) && (DB.gc_reclaimed st > 0)) $
+        fail ("unexpected GC stats " ++ show st)
+
+    -- a child that reaches zero when an aged parent is collected is a
+    -- new candidate, so it must age in turn
+    tx4 <- DB.newTX db
+    hC <- DB.stowRsc tx4 "gc child"
+    hP <- DB.stowRsc tx4 (BS.append "gc parent " hC)
+    DB.writeKey tx4 "gc-child" (LBS.fromStrict hC)
+    DB.writeKey tx4 "gc-parent" (LBS.fromStrict hP)
+    DB.commit tx4
+    DB.clearRsc tx4
+    tx5 <- DB.newTX db
+    DB.writeKey tx5 "gc-child" "none"   -- child is still held by parent
+    DB.writeKey tx5 "gc-parent" "none"
+    DB.commit tx5
+    let present h = isJust <$> DB.loadRscDB db h
+    let frame = DB.gcDB_async db >>= id
+    let untilGone n = present hP >>= \ b -> when b $ do
+            when (n > (10 * DB.gcFrameDelay)) $ fail "parent was not collected"
+            frame >> untilGone (n + 1)
+    untilGone (0 :: Int)
+    replicateM_ (DB.gcFrameDelay - 1) frame
+    cAged <- present hC
+    unless cAged $ fail "child of a collected parent was not aged"
+    DB.gcDB db
+    cGone <- not <$> present hC
+    unless cGone $ fail "aged child was not collected"
+
+
+
+testSyntax :: IO ()
+testSyntax = do
+    let src = "1 [dup (par) \"hello, world!\"]@ns b@a@c swap"
+    let (Right p) = P.decode src
+    let (Right pS) = P.decodeS (LBS.toStrict src)
+    pI <- P.intern pS
+    unless ((p == pS) && (p == pI) && (P.encode pI == src)) $
+        fail "unexpected results for zero-copy decode"
+    (Right pI') <- mapM P.intern (P.decodeS (LBS.toStrict src))
+    let buffers = fmap buffer . P.progOps
+        buffer (P.OpWord (P.Word w)) = let (fp,_,_) = BSI.toForeignPtr w in Just fp
+        buffer _ = Nothing
+    unless ((pI' == pI) && (buffers pI' == buffers pI)) $
+        fail "interned words should share buffers"
+
+    -- parallel dictionary decode, with redefinitions and a bad entry
+    let def n = "@w" ++ show (n `mod` 700) ++ " " ++ show n ++ " w" ++ show (n `div` 2)
+    let dict = LU8.fromString $ L.intercalate "\n" $ 
+            [def n | n <- [1..2000 :: Int]] ++ ["@bad [", "@@ns "]
+    unless (F.decodeParN 7 dict == F.decode dict) $
+        fail "parallel dictionary decode differs"
+
+testKVM :: DB.DB -> IO ()
+testKVM db = do
+    tx <- DB.newTX db
+    let key n = LBS.toStrict (utf8 n)
+    let ns = [1..2000] :: [Int]
+    let m0 = KVM.fromList [(key n, key (n * n)) | n <- ns]
+
+    -- stow most of the tree, then write and reload the root
+    m1 <- KVM.compact tx 200 m0
+    DB.writeKey tx "kvm" (KVM.encode m1)
+    DB.commit tx
+    (Just m2) <- KVM.decode <$> DB.readKey tx "kvm"
+    vs <- mapM (\ n -> KVM.lookup tx (key n) m2) ns
+    unless (vs == fmap (Just . key . (\ n -> n * n)) ns) $
+        fail "unexpected KVM lookup results"
+    missing <- KVM.lookup tx (key (0 :: Int)) m2
+    unless (isNothing missing) $ fail "KVM lookup for missing key"
+
+    -- batch update: overwrite evens, delete multiples of three
+    let upd n = if (0 == n `mod` 3) then Nothing else Just "even"
+    let batch = M.fromList [(key n, upd n) | n <- ns, even n || (0 == n `mod` 3)]
+    m3 <- KVM.applyBatch tx batch m2 >>= KVM.compact tx 200
+    kvs <- KVM.toList tx m3
+    let expect n = if (0 == n `mod` 3) then Nothing
+                   else if even n then Just "even" else Just (key (n * n))
+    let expected = L.sortOn fst [(key n, v) | n <- ns, Just v <- [expect n]]
+    unless (kvs == expected) $ fail "unexpected KVM after batch"
+
+    -- diffs skip shared structure and report only changes
+    d <- KVM.diff tx m2 m3
+    unless (L.length d == M.size batch) $
+        fail ("unexpected KVM diff size " ++ show (L.length d))
+    m4 <- KVM.union tx m3 m2
+    kvs4 <- KVM.toList tx m4
+    unless (fmap fst kvs4 == L.sort (fmap key ns)) $
+        fail "unexpected KVM union keys"
+    m5 <- KVM.difference tx m2 m3
+    kvs5 <- KVM.toList tx m5
+    unless (fmap fst kvs5 == L.sort [key n | n <- ns, 0 == n `mod` 3]) $
+        fail "unexpected KVM difference"
+
+    -- keys with trailing NULs would collide with shorter keys
+    let rejected act = try act >>= \ r -> case r of
+            Left (ErrorCall _) -> return ()
+            Right _ -> fail "KVM accepted a key with a trailing NUL"
+    rejected (evaluate (KVM.fromList [("k", "a"), ("k\0", "b")]))
+    rejected (KVM.insert tx "k\0" "b" m3)
 
 withTmpDir :: FilePath -> IO a -> IO a
 withTmpDir subdir action = do
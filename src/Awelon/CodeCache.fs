@@ -0,0 +1,133 @@
+namespace Awelon
+open Data.ByteString
+open Stowage
+
+// Compiling or optimizing a word is expensive, but the result depends
+// only on the word's deep version (see WordVersion) and the compiler.
+// So we keep compiled artifacts in a durable cache keyed by version,
+// and a restart doesn't need to recompile hot words. Artifacts may be
+// optimized Awelon programs, serialized IL or expression trees, etc.,
+// distinguished by a `kind` such as `opt` or `il`.
+//
+// Every artifact is stamped with the compiler that produced it, and
+// artifacts from another compiler are rejected as misses, then replaced
+// by the next compilation. The compiler stamp should change whenever
+// the compiler's output would change, e.g. a build hash.
+//
+// Rehydration is lazy: the durable cache loads nodes as keys are used
+// (see DCache), and hot artifacts are also held in a memory cache.
+module CodeCache =
+
+    type Version = WordVersion.Version
+
+    /// Kind of artifact, e.g. `opt` or `il`.
+    type Kind = ByteString
+
+    /// Identifies a compiler build.
+    type Compiler = ByteString
+
+    // artifacts larger than this are stowed separately from the cache
+    // index, so cache nodes remain small.
+    let private thresh = 600UL
+
+    type private Entry = (struct(Compiler * CVRef<ByteString>))
+
+    let private cEntry : Codec<Entry> =
+        EncPair.codec' (EncBytes.codec) (EncCVRef.codec thresh (EncBytes.codec))
+
+    /// Statistics since the cache was opened.
+    ///
+    /// hits: artifacts found, in memory or durable
+    /// durableHits: hits loaded from the durable cache
+    /// misses: artifacts not found
+    /// rejected: artifacts from another compiler, counted as misses
+    /// compiled: artifacts added
+    type Stats =
+        { hits        : int
+          durableHits : int
+          misses      : int
+          rejected    : int
+          compiled    : int
+        }
+
+    let private noStats =
+        { hits = 0; durableHits = 0; misses = 0; rejected = 0; compiled = 0 }
+
+    let private key (kind:Kind) (v:Version) : ByteString =
+        BS.concat [kind; BS.singleton Dict.cSP; v]
+
+    /// A durable cache of compiled artifacts for one compiler.
+    type Cache =
+        val Compiler : Compiler
+        val private dc : DCache.Cache<Entry>
+        val private mem : MCache<ByteString, ByteString>
+        val mutable private stats : Stats
+        new(db:DB, k:ByteString, compiler:Compiler, quota:SizeEst) =
+            { Compiler = compiler
+              dc = DCache.load db k cEntry quota
+              mem = new MCache<ByteString, ByteString>()
+              stats = noStats
+            }
+
+        /// Statistics since the cache was opened.
+        member c.Stats with get() = lock c (fun () -> c.stats)
+
+        member private c.Count (fn:Stats -> Stats) : unit =
+            lock c (fun () -> c.stats <- fn (c.stats))
+
+        /// Find an artifact for a deep version of a word.
+        member c.TryFind (kind:Kind) (v:Version) : ByteString option =
+            let k = key kind v
+            match MCache.tryFind k (c.mem) with
+            | Some a ->
+                c.Count (fun s -> { s with hits = s.hits + 1 })
+                Some a
+            | None ->
+            match c.dc.TryFind k with
+            | Some (struct(compiler, ref)) when (compiler = c.Compiler) ->
+                let a = CVRef.load ref
+                let a' = MCache.tryAdd k a (uint64 (k.Length + a.Length)) (c.mem)
+                c.Count (fun s -> { s with hits = s.hits + 1; durableHits = s.durableHits + 1 })
+                Some a'
+            | Some _ ->
+                c.Count (fun s -> { s with misses = s.misses + 1; rejected = s.rejected + 1 })
+                None
+            | None ->
+                c.Count (fun s -> { s with misses = s.misses + 1 })
+                None
+
+        /// Add an artifact for a deep version of a word.
+        member c.Add (kind:Kind) (v:Version) (a:ByteString) : unit =
+            let k = key kind v
+            let sz = uint64 (k.Length + a.Length)
+            MCache.remove k (c.mem)
+            MCache.tryAdd k a sz (c.mem) |> ignore<ByteString>
+            c.dc.Add k (struct(c.Compiler, CVRef.local a)) sz
+            c.Count (fun s -> { s with compiled = s.compiled + 1 })
+
+        /// Find an artifact, or compile and add it.
+        member c.GetOrCompile (kind:Kind) (v:Version) (compile:unit -> ByteString) : ByteString =
+            match c.TryFind kind v with
+            | Some a -> a
+            | None ->
+                let a = compile ()
+                c.Add kind v a
+                a
+
+        /// Write recent artifacts to durable storage. Also happens
+        /// periodically as artifacts are added.
+        member c.Sync () : unit = c.dc.Sync()
+
+    /// Open a code cache at a DB key, with a quota in bytes.
+    let load (db:DB) (k:ByteString) (compiler:Compiler) (quota:SizeEst) : Cache =
+        new Cache(db, k, compiler, quota)
+
+    /// Find an artifact for a word in a dictionary, compiling it if
+    /// necessary. None if the word is undefined.
+    let compileWord (c:Cache) (kind:Kind) (compile:Dict -> Dict.Symbol -> ByteString)
+                    (d:Dict) (sym:Dict.Symbol) : ByteString option =
+        match WordVersion.ofDict d sym with
+        | Some v -> Some (c.GetOrCompile kind v (fun () -> compile d sym))
+        | None -> None
+
+type CodeCache = CodeCache.Cache
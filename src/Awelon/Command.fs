@@ -0,0 +1,154 @@
+namespace Awelon
+open System.Collections.Generic
+open Data.ByteString
+open Stowage
+
+// The command pattern from docs/ApplicationModel.md records a stream
+// of commands as a chain of words:
+//
+//      :foo-0 initial state constructor
+//      :foo-1 foo-0 command1
+//      ...
+//      :foo-99 foo-98 command99
+//      :foo-hd foo-99
+//
+// Evaluating the head naively replays every command, and notebook
+// sessions may reach thousands of commands. Here, we evaluate the
+// chain incrementally and occasionally stow the evaluated state as
+// a secure hash resource, keyed by deep version of the word. After an
+// edit in the middle of the chain, only versions from the edit onward
+// change, so we resume evaluation from the nearest checkpoint before
+// the edit. Forks of a dictionary share checkpoints for the same
+// reason.
+//
+// Evaluation is pluggable. The evaluated state is assumed to be an
+// Awelon program, such that evaluating `foo-k` is evaluating the state
+// of `foo-(k-1)` followed by `command-k`.
+module Command =
+
+    type Symbol = Dict.Symbol
+
+    /// Evaluate an Awelon program in context of a dictionary.
+    type Eval = Dict -> ByteString -> ByteString
+
+    /// Checkpoint policy. We stow a checkpoint after every `interval`
+    /// steps since the last checkpoint, or after any step that takes
+    /// at least `slowStep`.
+    type Policy =
+        { interval : int
+          slowStep : System.TimeSpan
+        }
+
+    let defaultPolicy =
+        { interval = 32
+          slowStep = System.TimeSpan.FromMilliseconds(100.0)
+        }
+
+    /// Statistics for the most recent evaluation.
+    ///
+    /// length: words in the command chain, including initial state
+    /// resumedAt: chain index of the checkpoint used, or -1 if none
+    /// steps: evaluation steps performed
+    /// stowed: checkpoints added
+    type Stats =
+        { length    : int
+          resumedAt : int
+          steps     : int
+          stowed    : int
+        }
+
+    // `foo-` for `foo-42`
+    let private familyOf (sym:Symbol) : ByteString =
+        BS.dropWhileEnd ((<>) (byte '-')) sym
+
+    /// A link in the chain: the initial program for the first word,
+    /// otherwise the command following the previous word.
+    type Link = (struct(Symbol * ByteString))
+
+    /// Find the command chain for a word, from initial state to the
+    /// given word. A definition continues the chain when it starts with
+    /// a word of the same family, e.g. `foo-98` for `foo-99` or `foo-hd`.
+    let chain (d:Dict) (head:Symbol) : Link[] =
+        let dir = BS.dropWhileEnd ((<>) Dict.cDir) head
+        let fam = familyOf head
+        let visited = new HashSet<Symbol>()
+        let rec loop acc sym =
+            match Dict.tryFind sym d with
+            | None -> acc // undefined word
+            | Some def ->
+                visited.Add(sym) |> ignore<bool>
+                let root = struct(sym, def.Data) :: acc
+                match Parser.parse (def.Data) with
+                | Parser.ParseOK (Parser.Atom (struct(Parser.TT.Word, w)) :: cmd) ->
+                    let prev = BS.append dir w
+                    let ok = (familyOf prev = fam) && not (visited.Contains(prev))
+                             && Option.isSome (Dict.tryFind prev d)
+                    if not ok then root else
+                    loop (struct(sym, Parser.write cmd) :: acc) prev
+                | _ -> root
+        loop [] head |> Array.ofList
+
+    /// Evaluation of command chains with shared checkpoints.
+    ///
+    /// Checkpoints are held in a memory cache, so they may be dropped
+    /// under memory pressure. This only costs us some replay.
+    type Checkpoints =
+        val private db : Stowage
+        val private eval : Eval
+        val Policy : Policy
+        val private table : MCache<WordVersion.Version, VRef<ByteString>>
+        val mutable private stats : Stats
+        new(db:Stowage, eval:Eval, policy:Policy) =
+            { db = db
+              eval = eval
+              Policy = policy
+              table = new MCache<WordVersion.Version, VRef<ByteString>>()
+              stats = { length = 0; resumedAt = -1; steps = 0; stowed = 0 }
+            }
+
+        /// Statistics for the most recent evaluation.
+        member c.Stats with get() = c.stats
+
+        /// Find a checkpoint for a deep version.
+        member c.TryFind (v:WordVersion.Version) : VRef<ByteString> option =
+            MCache.tryFind v (c.table)
+
+        /// Evaluate a word in a command chain, resuming from the nearest
+        /// checkpoint and adding checkpoints per our policy.
+        member c.Eval (d:Dict) (head:Symbol) : ByteString =
+            let links = chain d head
+            if (0 = links.Length) then invalidArg "head" "undefined word" else
+            let cache = new Dictionary<Symbol, WordVersion.Version>()
+            let find sym = Dict.tryFind sym d
+            let version (struct(sym,_)) = Option.get (WordVersion.version find cache sym)
+            let vs = Array.map version links
+            let rec nearest ix =
+                if (ix < 0) then struct(-1, BS.empty) else
+                match c.TryFind vs.[ix] with
+                | Some ref -> struct(ix, VRef.load ref)
+                | None -> nearest (ix - 1)
+            let struct(ix0, s0) = nearest (links.Length - 1)
+            let mutable state = s0
+            let mutable since = 0
+            let mutable stowed = 0
+            let sw = new System.Diagnostics.Stopwatch()
+            for ix = (ix0 + 1) to (links.Length - 1) do
+                let struct(_,code) = links.[ix]
+                let prog = if (0 = ix) then code else BS.concat [state; BS.singleton Dict.cSP; code]
+                sw.Restart()
+                state <- c.eval d prog
+                since <- since + 1
+                if (since >= c.Policy.interval) || (sw.Elapsed >= c.Policy.slowStep) then
+                    let ref = VRef.stow (EncBytesRaw.codec) (c.db) state
+                    let sz = uint64 (RscHash.size + state.Length)
+                    MCache.tryAdd vs.[ix] ref sz (c.table) |> ignore<VRef<ByteString>>
+                    stowed <- stowed + 1
+                    since <- 0
+            c.stats <- { length = links.Length; resumedAt = ix0
+                         steps = (links.Length - 1 - ix0); stowed = stowed }
+            state
+
+    /// Create a checkpoint service with the default policy.
+    let checkpoints (db:Stowage) (eval:Eval) : Checkpoints =
+        new Checkpoints(db, eval, defaultPolicy)
+
@@ -0,0 +1,229 @@
+namespace Awelon
+open System.IO
+open System.Diagnostics
+open Data.ByteString
+open Stowage
+
+// The F# runtime and the older Haskell runtime under `hs/` implement
+// the same formats: secure hashes, Awelon program syntax, dictionaries,
+// and LMDB stowage. This harness checks that they agree, and records
+// throughput side by side, so we know which techniques to port.
+//
+// A corpus directory holds inputs shared by both runtimes:
+//
+//   blobs.txt        one binary per line, for hashing and stowage
+//   programs.txt     one program per line, for parse and write
+//   dict.fs.txt      a dictionary in the F# format, `:word def`
+//   dict.hs.txt      the same dictionary in Haskell format, `@word def`
+//
+// Each runtime writes results to a subdirectory, `fs/` or `hs/`, with
+// a `check.txt` file per check, one line per item, and `timing.txt`
+// with lines `check items bytes millis`. See hs/conform for the Haskell
+// side. We then compare results byte for byte.
+//
+// Programs use the syntax common to both runtimes: words of form
+// `[a-z][a-z0-9-]*`, natural numbers, annotations, ASCII texts, and
+// blocks. A few are malformed, and both runtimes should reject them.
+//
+// Hashes are RscHash, a 320-bit BLAKE2b in Awelon's base32 alphabet.
+// The Haskell Awelon.Hash is 280 bits, so the Haskell side computes
+// the same digest for this check. The stow check writes the RscHash
+// of the bytes loaded back from each runtime's database, so the two
+// databases are compared by content rather than each with itself.
+module Conformance =
+
+    /// The checks, in the order they are run.
+    let checks = [ "hash"; "parse"; "dict"; "stow" ]
+
+    let private cLF = 10uy
+    let private bad = BS.fromString "?"
+    let private missing = BS.fromString "missing"
+
+    let private alpha = "abcdefghijklmnopqrstuvwxyz"
+    let private wordChars = alpha + "0123456789-"
+
+    let private genWord (rng:System.Random) : string =
+        let sb = new System.Text.StringBuilder()
+        sb.Append(alpha.[rng.Next(alpha.Length)]) |> ignore
+        for _ in 1 .. rng.Next(0, 8) do
+            sb.Append(wordChars.[rng.Next(wordChars.Length)]) |> ignore
+        sb.ToString()
+
+    // printable ASCII, excepting the `"` terminator
+    let private genText (rng:System.Random) : string =
+        let n = rng.Next(0, 24)
+        let c () =
+            let b = rng.Next(32, 126)
+            if (b = 34) then 'x' else char b
+        System.String(Array.init n (fun _ -> c ()))
+
+    let rec private genProg (rng:System.Random) (words:string[]) (depth:int) : string =
+        let word () =
+            if (words.Length > 0) && (0 = rng.Next(2))
+                then words.[rng.Next(words.Length)]
+                else genWord rng
+        let action () =
+            match rng.Next(0, 10) with
+            | 0 | 1 when (depth > 0) -> "[" + genProg rng words (depth - 1) + "]"
+            | 2 -> string (rng.Next(0, 1000000))
+            | 3 -> "(" + genWord rng + ")"
+            | 4 -> "\"" + genText rng + "\""
+            | _ -> word ()
+        let sp () = if (0 = rng.Next(8)) then "  " else " "
+        let ops = List.init (rng.Next(0, 7)) (fun _ -> action () + sp ())
+        let lead = if (0 = rng.Next(4)) then " " else ""
+        (lead + String.concat "" ops).TrimEnd(' ')
+
+    let private writeLines (fp:string) (lns:seq<string>) : unit =
+        File.WriteAllText(fp, String.concat "" (Seq.map (fun s -> s + "\n") lns))
+
+    /// Generate a corpus of about `n` items per check.
+    let generate (dir:string) (seed:int) (n:int) : unit =
+        Directory.CreateDirectory(dir) |> ignore<DirectoryInfo>
+        let rng = new System.Random(seed)
+
+        // binaries of any byte except LF, including empty lines
+        let blob () =
+            let b = Array.init (rng.Next(0, 600)) (fun _ -> byte (rng.Next(256)))
+            Array.map (fun c -> if (c = cLF) then 0uy else c) b
+        let blobs = Array.init n (fun _ -> blob ())
+        File.WriteAllBytes(Path.Combine(dir, "blobs.txt"),
+            Array.concat (blobs |> Array.map (fun b -> Array.append b [| cLF |])))
+
+        let prog () =
+            let p = genProg rng [||] 3
+            match rng.Next(40) with
+            | 0 -> "[" + p
+            | 1 -> p + " ]"
+            | _ -> p
+        writeLines (Path.Combine(dir, "programs.txt")) (Seq.init n (fun _ -> prog ()))
+
+        // distinct words, some redefined later in the file
+        let words = Seq.init n (fun _ -> genWord rng) |> Seq.distinct |> Array.ofSeq
+        let ents = new ResizeArray<string * string>()
+        for w in words do ents.Add((w, genProg rng words 2))
+        for _ in 1 .. (words.Length / 10) do
+            ents.Add((words.[rng.Next(words.Length)], genProg rng words 2))
+        let line c (w,def) = if (def = "") then c + w else c + w + " " + def
+        writeLines (Path.Combine(dir, "dict.fs.txt")) (Seq.map (line ":") ents)
+        writeLines (Path.Combine(dir, "dict.hs.txt")) (Seq.map (line "@") ents)
+
+    // lines of a file, dropping a final empty line
+    let private readLines (fp:string) : ByteString list =
+        let rec loop acc s =
+            if BS.isEmpty s then List.rev acc else
+            let struct(ln,more) = BS.span ((<>) cLF) s
+            loop (ln :: acc) (BS.drop 1 more)
+        loop [] (BS.unsafeCreateA (File.ReadAllBytes(fp)))
+
+    let private writeResults (fp:string) (lns:ByteString list) : unit =
+        let lf = BS.singleton cLF
+        File.WriteAllBytes(fp, BS.toArray (BS.concat (List.collect (fun ln -> [ln; lf]) lns)))
+
+    let private runParse (s:ByteString) : ByteString =
+        match Parser.parse s with
+        | Parser.ParseOK p -> Parser.write p
+        | Parser.ParseFail _ -> bad
+
+    // a sorted `word def` dump, after a write and parse round trip
+    let private runDict (db:Stowage) (s:ByteString) : ByteString list =
+        let d = Dict.parse db (Dict.parse db s |> Dict.write)
+        let ent (sym,def:Dict.Def) =
+            let def' = runParse (def.Data)
+            if BS.isEmpty def' then sym else BS.concat [sym; BS.singleton 32uy; def']
+        Dict.toSeq d |> Seq.sortBy fst |> Seq.map ent |> List.ofSeq
+
+    // RscHash of the bytes loaded back after stowage
+    let private runStow (db:Stowage) (s:ByteString) : ByteString =
+        let h = db.Stow s
+        let r = try RscHash.hash (db.Load h)
+                with
+                | MissingRsc _ -> missing
+        db.Decref h
+        r
+
+    /// Run the F# side over a corpus, writing results to `dir/fs`.
+    let run (db:Stowage) (dir:string) : unit =
+        let out = Path.Combine(dir, "fs")
+        Directory.CreateDirectory(out) |> ignore<DirectoryInfo>
+        let timing = new ResizeArray<string>()
+        let check name (inputs:ByteString list) (fn:ByteString list -> ByteString list) =
+            let bytes = List.sumBy (fun (s:ByteString) -> int64 s.Length) inputs
+            let sw = Stopwatch.StartNew()
+            let results = fn inputs
+            sw.Stop()
+            writeResults (Path.Combine(out, name + ".txt")) results
+            timing.Add(sprintf "%s %d %d %d" name inputs.Length bytes sw.ElapsedMilliseconds)
+        let blobs = readLines (Path.Combine(dir, "blobs.txt"))
+        let progs = readLines (Path.Combine(dir, "programs.txt"))
+        let dict = BS.unsafeCreateA (File.ReadAllBytes(Path.Combine(dir, "dict.fs.txt")))
+        check "hash" blobs (List.map RscHash.hash)
+        check "parse" progs (List.map runParse)
+        check "dict" [dict] (List.collect (runDict db))
+        check "stow" blobs (List.map (runStow db))
+        writeLines (Path.Combine(out, "timing.txt")) timing
+
+    /// Throughput for a check in one runtime.
+    type Timing =
+        { items  : int
+          bytes  : int64
+          millis : int64
+        }
+
+    let private readTiming (fp:string) : Map<string, Timing> =
+        if not (File.Exists(fp)) then Map.empty else
+        let parseLn (ln:string) =
+            match ln.Split(' ') with
+            | [| name; items; bytes; millis |] ->
+                Some (name, { items = int items; bytes = int64 bytes; millis = int64 millis })
+            | _ -> None
+        File.ReadAllLines(fp) |> Seq.choose parseLn |> Map.ofSeq
+
+    /// Comparison of one check between runtimes.
+    ///
+    /// agree: results are byte-identical
+    /// mismatch: index of the first differing line, or -1
+    type Result =
+        { check    : string
+          agree    : bool
+          mismatch : int
+          fs       : Timing option
+          hs       : Timing option
+        }
+
+    let private firstMismatch (a:string[]) (b:string[]) : int =
+        let n = min a.Length b.Length
+        match Seq.tryFind (fun ix -> (a.[ix] <> b.[ix])) (seq { 0 .. (n - 1) }) with
+        | Some ix -> ix
+        | None -> if (a.Length = b.Length) then -1 else n
+
+    /// Compare results written by both runtimes under a corpus.
+    let compareDir (dir:string) : Result list =
+        let fsDir = Path.Combine(dir, "fs")
+        let hsDir = Path.Combine(dir, "hs")
+        let tFS = readTiming (Path.Combine(fsDir, "timing.txt"))
+        let tHS = readTiming (Path.Combine(hsDir, "timing.txt"))
+        let result name =
+            let file d = Path.Combine(d, name + ".txt")
+            let read d = if File.Exists(file d) then File.ReadAllLines(file d) else [||]
+            let ix = firstMismatch (read fsDir) (read hsDir)
+            { check = name; agree = (ix < 0) && File.Exists(file fsDir)
+              mismatch = ix; fs = Map.tryFind name tFS; hs = Map.tryFind name tHS }
+        List.map result checks
+
+    let private mbps (t:Timing option) : string =
+        match t with
+        | Some t when (t.millis > 0L) ->
+            sprintf "%8.1f" ((float t.bytes / 1000000.0) / (float t.millis / 1000.0))
+        | Some _ -> "       -"
+        | None -> "     n/a"
+
+    /// Summarize a comparison, one line per check with MB/s for each.
+    let report (rs:Result list) : string list =
+        let line r =
+            let status =
+                if r.agree then "agree" else
+                sprintf "differs at line %d" r.mismatch
+            sprintf "%-6s fs %s MB/s  hs %s MB/s  %s" r.check (mbps r.fs) (mbps r.hs) status
+        List.map line rs
+
@@ -0,0 +1,382 @@
+namespace Awelon
+open System.Threading
+open System.Collections.Generic
+open Data.ByteString
+open Stowage
+
+// Managed dictionaries, per docs/ApplicationModel.md, have words with
+// three attributes:
+//
+// - opaque: definition structure is irrelevant and may be rewritten
+// - frozen: behavior of this word should never change in the future
+// - hidden: assume no external references directly access this word
+//
+// Which admit a corresponding set of rewrites:
+//
+// - opaque definitions may be simplified or evaluated
+// - frozen definitions may be inlined into opaque clients
+// - hidden definitions may be deleted if they have no clients
+//
+// Policy is represented by words ending in `meta-gc`, and applies to
+// all words sharing the prefix. For example, `:foo-meta-gc (hidden)`
+// marks every `foo-*` word as hidden, and `:meta-gc (frozen)` marks
+// every word in the dictionary as frozen. Attributes are annotations
+// so that policy words don't appear as clients in a reverse lookup.
+// Policy words are never rewritten or deleted.
+//
+// A pass computes every rewrite against a snapshot of a dictionary,
+// then produces a single batch of updates. The pass includes the old
+// definitions it relied upon and the words it deletes or inlines, such
+// that a background agent can detect conflicting concurrent updates,
+// including new clients of a deleted word, before committing.
+module DictGC =
+
+    type Symbol = Dict.Symbol
+
+    [<System.Flags>]
+    type Attr =
+        | None = 0
+        | Opaque = 1
+        | Frozen = 2
+        | Hidden = 4
+
+    let policySuffix = BS.fromString "meta-gc"
+
+    let private attrNames =
+        [ (BS.fromString "opaque", Attr.Opaque)
+          (BS.fromString "frozen", Attr.Frozen)
+          (BS.fromString "hidden", Attr.Hidden) ]
+
+    let inline private has (a:Attr) (flag:Attr) = (flag = (a &&& flag))
+
+    let isPolicyWord (sym:Symbol) : bool =
+        (policySuffix = BS.takeLast (policySuffix.Length) sym)
+
+    /// Policy is a list of prefixes with attributes.
+    type Policy = (struct(Dict.Prefix * Attr)) list
+
+    let private parseAttrs (def:Dict.Def) : Attr =
+        match Parser.parse (def.Data) with
+        | Parser.ParseOK p ->
+            let attrOf a =
+                match a with
+                | Parser.Atom (struct(Parser.TT.Anno, w)) ->
+                    match List.tryFind (fun (n,_) -> (n = w)) attrNames with
+                    | Some (_,f) -> f
+                    | None -> Attr.None
+                | _ -> Attr.None
+            List.fold (fun acc a -> acc ||| attrOf a) Attr.None p
+        | Parser.ParseFail _ -> Attr.None
+
+    /// Read the policy words from a dictionary.
+    let readPolicy (d:Dict) : Policy =
+        Dict.toSeq d
+            |> Seq.filter (fst >> isPolicyWord)
+            |> Seq.map (fun (sym,def) -> struct(BS.dropLast (policySuffix.Length) sym, parseAttrs def))
+            |> List.ofSeq
+
+    /// Attributes for a symbol, the union of all matching policies.
+    let attrs (policy:Policy) (sym:Symbol) : Attr =
+        if isPolicyWord sym then Attr.None else
+        let step acc (struct(p,a)) =
+            if (p = BS.take (p.Length) sym) then (acc ||| a) else acc
+        List.fold step Attr.None policy
+
+    /// Simplify or evaluate an opaque definition. Return None to keep
+    /// the definition as is.
+    type Simplify = Dict -> Symbol -> Parser.Program -> Parser.Program option
+
+    /// No simplification. Definitions are still normalized as written
+    /// by the parser, and frozen words are inlined.
+    let noSimplify : Simplify = fun _ _ _ -> None
+
+    /// Load code for a `$secureHash` reference, if available.
+    type LoadCode = RscHash -> ByteString option
+
+    /// Load code from a Stowage.
+    let loadFrom (db:Stowage) : LoadCode = fun h ->
+        try Some (db.Load h)
+        with
+        | MissingRsc _ -> None
+
+    /// Summary of a pass.
+    ///
+    /// deleted: hidden words without clients
+    /// inlined: frozen word references inlined into opaque clients
+    /// rewritten: opaque definitions changed by inlining or simplify
+    /// reclaimed: bytes reclaimed as dictionary lines (may be negative
+    ///   if inlining grows definitions more than deletions save)
+    type Report =
+        { deleted   : int
+          inlined   : int
+          rewritten : int
+          reclaimed : int64
+        }
+
+    let emptyReport = { deleted = 0; inlined = 0; rewritten = 0; reclaimed = 0L }
+
+    /// A pass: updates to commit as one batch, the snapshot and the
+    /// definitions they were computed from, and the words removed.
+    type Pass =
+        { source  : Dict
+          reads   : (struct(Symbol * Dict.Def option))[]
+          writes  : Dict.DictEnt[]
+          deleted : Symbol[]
+          inlined : Symbol[]
+          report  : Report
+        }
+
+    // size of `:symbol def` LF
+    let private lineSize (sym:Symbol) (def:ByteString) : int64 =
+        int64 (3 + sym.Length + def.Length)
+
+    // Inline frozen words into a program. Inlined actions are wrapped
+    // with the namespace of the reference, so relative words within a
+    // frozen definition keep their meaning.
+    let private inlineFrozen (frozenDef:Symbol -> Parser.Program option) (client:Symbol)
+                             (p:Parser.Program) : struct(Parser.Program * Symbol list) =
+        let dir = DictRLU.dictOf client
+        let used = new List<Symbol>()
+        let rec inlineP ns p = List.collect (inlineA ns id) p
+        and inlineA ns wrap a =
+            match a with
+            | Parser.Block b -> [wrap (Parser.Block (inlineP ns b))]
+            | Parser.NS (struct(w,a')) ->
+                inlineA (w::ns) (fun x -> wrap (Parser.NS (struct(w,x)))) a'
+            | Parser.Atom (struct(Parser.TT.Word, w)) ->
+                let sym = DictRLU.qualify dir ns w
+                match (if (sym = client) then None else frozenDef sym) with
+                | Some p' -> used.Add(sym); List.map wrap p'
+                | None -> [wrap a]
+            | Parser.Atom _ -> [wrap a]
+        let p' = inlineP [] p
+        struct(p', List.ofSeq used)
+
+    // Words used from `$secureHash` code, which DictRLU doesn't index.
+    // Code is read relative to the client's dictionary and namespace.
+    // Returns the words, and the dictionaries of clients whose code we
+    // could not load or parse, where no word should be deleted.
+    let private codeRoots (load:LoadCode) (d:Dict) : struct(HashSet<Symbol> * HashSet<Dict.Prefix>) =
+        let roots = new HashSet<Symbol>()
+        let dirs = new HashSet<Dict.Prefix>()
+        let seen = new HashSet<ByteString>()
+        let rec walkP dir ns inCode p = List.iter (walkA dir ns inCode) p
+        and walkA dir ns inCode a =
+            match a with
+            | Parser.Block b -> walkP dir ns inCode b
+            | Parser.NS (struct(w,a')) -> walkA dir (w::ns) inCode a'
+            | Parser.Atom (struct(Parser.TT.Word, w)) ->
+                if inCode then roots.Add(DictRLU.qualify dir ns w) |> ignore<bool>
+            | Parser.Atom (struct(Parser.TT.CodeRef, h)) ->
+                if seen.Add(BS.append (DictRLU.qualify dir ns BS.empty) h) then
+                    match Option.map Parser.parse (load h) with
+                    | Some (Parser.ParseOK p) -> walkP dir ns true p
+                    | _ -> dirs.Add(dir) |> ignore<bool>
+            | Parser.Atom _ -> ()
+        for (sym,def) in Dict.toSeq d do
+            if BS.exists ((=) (byte '$')) (def.Data) then
+                match Parser.parse (def.Data) with
+                | Parser.ParseOK p -> walkP (DictRLU.dictOf sym) [] false p
+                | Parser.ParseFail _ -> ()
+        struct(roots, dirs)
+
+    /// Compute a pass over a dictionary, given its reverse lookup index.
+    ///
+    /// Frozen definitions are inlined one level per pass, which avoids
+    /// exponential growth from deep inlining in a single step. Hidden
+    /// words are deleted transitively, i.e. deleting a word may leave
+    /// its dependencies without clients.
+    ///
+    /// Words used from `$secureHash` code are not deleted. If that code
+    /// cannot be loaded, no word in the client's dictionary is deleted.
+    let pass (simplify:Simplify) (load:LoadCode) (rlu:DictRLU.RLU) (d:Dict) : Pass =
+        let policy = readPolicy d
+        let attrOf = attrs policy
+        let reads = new Dictionary<Symbol, Dict.Def option>()
+        let writes = new List<Dict.DictEnt>()
+        let rewrites = new Dictionary<Symbol, ByteString>()
+        let inlined = new HashSet<Symbol>()
+        let read sym =
+            let def = Dict.tryFind sym d
+            reads.[sym] <- def
+            def
+        let mutable rlu = rlu
+        let mutable report = emptyReport
+        let frozenDef sym =
+            if not (has (attrOf sym) Attr.Frozen) then None else
+            match read sym with
+            | Some def ->
+                match Parser.parse (def.Data) with
+                | Parser.ParseOK p -> Some p
+                | Parser.ParseFail _ -> None
+            | None -> None
+
+        // opaque words: inline frozen dependencies, then simplify
+        let opaque = Dict.toSeq d |> Seq.filter (fun (sym,_) -> has (attrOf sym) Attr.Opaque) |> Array.ofSeq
+        for (sym,def) in opaque do
+            match Parser.parse (def.Data) with
+            | Parser.ParseFail _ -> ()
+            | Parser.ParseOK p ->
+                let struct(p',used) = inlineFrozen frozenDef sym p
+                inlined.UnionWith(used)
+                let p'' = defaultArg (simplify d sym p') p'
+                let s' = Parser.write p''
+                if (s' <> def.Data) then
+                    reads.[sym] <- Some def
+                    let def' = Dict.Def(s')
+                    writes.Add(Dict.Define(sym, Some def'))
+                    rewrites.[sym] <- s'
+                    rlu <- DictRLU.update sym (Some def') rlu
+                    report <- { report with
+                                    inlined = report.inlined + List.length used
+                                    rewritten = report.rewritten + 1
+                                    reclaimed = report.reclaimed + lineSize sym (def.Data) - lineSize sym s' }
+
+        // hidden words without clients, transitively
+        let struct(roots, keepDirs) = codeRoots load d
+        let isRoot (sym:Symbol) =
+            roots.Contains(sym) 
+                || Seq.exists (fun (dir:Dict.Prefix) -> (dir = BS.take (dir.Length) sym)) keepDirs
+        let deleted = new HashSet<Symbol>()
+        let rec gc work =
+            match work with
+            | (sym::work') ->
+                let ok = has (attrOf sym) Attr.Hidden
+                         && Set.isEmpty (DictRLU.clients sym rlu)
+                         && not (deleted.Contains(sym))
+                         && not (isRoot sym)
+                if not ok then gc work' else
+                match Dict.tryFind sym d with
+                | None -> gc work'
+                | Some def ->
+                    let deps = DictRLU.deps sym rlu
+                    let sz =
+                        match rewrites.TryGetValue(sym) with
+                        | true, s' -> lineSize sym s'
+                        | _ -> lineSize sym (def.Data)
+                    reads.[sym] <- Some def
+                    writes.Add(Dict.Define(sym, None))
+                    deleted.Add(sym) |> ignore<bool>
+                    rlu <- DictRLU.update sym None rlu
+                    report <- { report with deleted = report.deleted + 1
+                                            reclaimed = report.reclaimed + sz }
+                    gc (List.append deps work')
+            | [] -> ()
+        Dict.toSeq d |> Seq.map fst |> Seq.filter (fun sym -> has (attrOf sym) Attr.Hidden)
+                     |> List.ofSeq |> gc
+
+        { source = d
+          reads = reads |> Seq.map (fun kv -> struct(kv.Key, kv.Value)) |> Array.ofSeq
+          writes = writes.ToArray()
+          deleted = Array.ofSeq deleted
+          inlined = Array.ofSeq inlined
+          report = report
+        }
+
+    /// Test whether a pass may still be applied to a dictionary: the
+    /// definitions it relied upon are unchanged, and no word changed
+    /// since its snapshot references a word it deletes or inlines.
+    let isValid (d:Dict) (p:Pass) : bool =
+        let readsOK = p.reads |> Array.forall (fun (struct(sym,def)) -> (Dict.tryFind sym d = def))
+        if not readsOK then false else
+        // index only the words edited since the snapshot
+        let edits = DictRLU.applyDiff DictRLU.empty (Dict.diff (p.source) d)
+        let unused sym = Set.isEmpty (DictRLU.clients sym edits)
+        Array.forall unused (p.deleted) && Array.forall unused (p.inlined)
+
+    /// Apply a pass to a dictionary as a single batch of updates.
+    let apply (d:Dict) (p:Pass) : Dict =
+        Dict.applyBatch d (p.writes)
+
+    /// Background GC agent for a managed dictionary.
+    ///
+    /// The agent periodically reads the dictionary, computes a pass,
+    /// and tries to commit it. The commit function should atomically
+    /// check that the pass is still valid (see isValid) and apply it,
+    /// returning false on conflict. Conflicting passes are retried at
+    /// the next interval.
+    type Agent =
+        val private read : unit -> Dict
+        val private commit : Pass -> bool
+        val private simplify : Simplify
+        val private load : LoadCode
+        val private interval : System.TimeSpan
+        val mutable private rlu : DictRLU.RLU
+        val mutable private last : Dict
+        val mutable private total : Report
+        val mutable private stop : bool
+        val mutable private thread : Thread option
+        new(read, commit, simplify, load, interval) =
+            { read = read
+              commit = commit
+              simplify = simplify
+              load = load
+              interval = interval
+              rlu = DictRLU.empty
+              last = Dict.empty
+              total = emptyReport
+              stop = false
+              thread = None
+            }
+
+        /// Total of committed reports.
+        member a.Total with get() = lock a (fun () -> a.total)
+
+        /// Run one pass in the foreground. Returns the report if the
+        /// pass was committed and made any changes.
+        member a.RunOnce() : Report option =
+            let d = a.read()
+            // maintain our index incrementally across passes
+            a.rlu <- DictRLU.applyDiff (a.rlu) (Dict.diff (a.last) d)
+            a.last <- d
+            let p = pass (a.simplify) (a.load) (a.rlu) d
+            if (0 = p.writes.Length) || not (a.commit p) then None else
+            lock a (fun () ->
+                let t = a.total
+                a.total <- { deleted = t.deleted + p.report.deleted
+                             inlined = t.inlined + p.report.inlined
+                             rewritten = t.rewritten + p.report.rewritten
+                             reclaimed = t.reclaimed + p.report.reclaimed })
+            Some (p.report)
+
+        member private a.Loop() : unit =
+            let rec loop () =
+                a.RunOnce() |> ignore<Report option>
+                let halt = lock a (fun () ->
+                    if not a.stop then
+                        Monitor.Wait(a, a.interval) |> ignore<bool>
+                    a.stop)
+                if not halt then loop ()
+            loop ()
+
+        /// Start the agent on a background thread.
+        member a.Start() : unit =
+            lock a (fun () ->
+                if Option.isSome (a.thread) then invalidOp "agent already running"
+                a.stop <- false
+                let t = new Thread(fun () -> a.Loop())
+                t.IsBackground <- true
+                t.Priority <- ThreadPriority.BelowNormal
+                a.thread <- Some t
+                t.Start())
+
+        /// Stop the agent, waiting for a pass in progress.
+        member a.Stop() : unit =
+            let tOpt = lock a (fun () ->
+                a.stop <- true
+                Monitor.PulseAll(a)
+                let t = a.thread
+                a.thread <- None
+                t)
+            Option.iter (fun (t:Thread) -> t.Join()) tOpt
+
+        interface System.IDisposable with
+            member a.Dispose() = a.Stop()
+
+    /// Create an agent over a dictionary variable, read and committed
+    /// via the given functions. Opaque definitions are rewritten by the
+    /// given Simplify, and code for `$secureHash` references is loaded
+    /// from the given Stowage.
+    let agent (db:Stowage) (simplify:Simplify) (read:unit -> Dict) (commit:Pass -> bool) (interval:System.TimeSpan) : Agent =
+        new Agent(read, commit, simplify, loadFrom db, interval)
+
@@ -1,5 +1,6 @@
 namespace Awelon
 open Data.ByteString
+open Stowage
 
 // The DictRLU module augments a dictionary with a reverse lookup
 // index, such that we can find the clients for each word in the 
@@ -35,8 +36,9 @@ open Data.ByteString
 // words whose definitions fail to parse. Secure hash resources are also
 // tracked as dependencies, but are not locally indexed as clients.
 //
-// Note: I should table this for now - priority is relatively low. And
-// it might be necessary to support lazy indexing.
+// For now, we maintain the index in memory as a companion to a Dict,
+// updated incrementally from Dict.diff. Only words and parse errors
+// are indexed. Code within `$secureHash` resources is not inspected.
 module DictRLU =
 
     let parseErrorDep = BS.fromString "ERROR"
@@ -63,8 +65,95 @@ module DictRLU =
     let private seqTokDeps (p:Parser.Program) : seq<TokDep> =
         Seq.unfold stepTokDep (struct([],p)::[])
 
+    type Symbol = Dict.Symbol
 
-    
+    /// Hierarchical dictionary of a symbol, e.g. `foo/bar/` for `foo/bar/baz`.
+    let dictOf (sym:Symbol) : Dict.Prefix =
+        BS.dropWhileEnd ((<>) Dict.cDir) sym
 
+    /// Symbol for a word within dictionary `d`, under a namespace given
+    /// innermost first, e.g. `d/a/b/w` for `a/b/w` has ns `[b;a]`.
+    let qualify (d:Dict.Prefix) (ns:Parser.Word list) (w:Parser.Word) : Symbol =
+        let nsp = List.fold (fun p n -> BS.append n (BS.cons Dict.cDir p)) (BS.empty) ns
+        BS.concat [d; nsp; w]
 
+    /// Direct dependencies of a definition, in order of first use.
+    ///
+    /// Words are qualified by the client's hierarchical dictionary, so
+    /// in `foo/bar` the word `baz` refers to `foo/baz`. A definition we
+    /// cannot parse depends on `ERROR`.
+    let defDeps (client:Symbol) (def:Dict.Def) : Symbol list =
+        match Parser.parse (def.Data) with
+        | Parser.ParseFail _ -> [parseErrorDep]
+        | Parser.ParseOK p ->
+            let d = dictOf client
+            let addDep l (struct(ns,struct(tt,s))) =
+                if (tt <> Parser.TT.Word) then l else
+                (qualify d ns s) :: l
+            Seq.fold addDep [] (seqTokDeps p) |> List.rev |> List.distinct
+
+    /// An in-memory reverse lookup index for a dictionary. We record
+    /// the dependencies for each defined word and the clients for
+    /// every dependency, including undefined words.
+    type RLU =
+        { deps    : Map<Symbol, Symbol list>
+          clients : Map<Symbol, Set<Symbol>>
+        }
+
+    let empty : RLU = { deps = Map.empty; clients = Map.empty }
+
+    let private addClient (c:Symbol) (m:Map<Symbol,Set<Symbol>>) (d:Symbol) =
+        let cs = defaultArg (Map.tryFind d m) (Set.empty)
+        Map.add d (Set.add c cs) m
+
+    let private remClient (c:Symbol) (m:Map<Symbol,Set<Symbol>>) (d:Symbol) =
+        match Map.tryFind d m with
+        | Some cs ->
+            let cs' = Set.remove c cs
+            if Set.isEmpty cs' then Map.remove d m else Map.add d cs' m
+        | None -> m
+
+    /// Direct dependencies of a word, if defined.
+    let deps (sym:Symbol) (rlu:RLU) : Symbol list =
+        defaultArg (Map.tryFind sym (rlu.deps)) []
+
+    /// Direct clients of a symbol.
+    let clients (sym:Symbol) (rlu:RLU) : Set<Symbol> =
+        defaultArg (Map.tryFind sym (rlu.clients)) (Set.empty)
+
+    /// Update the index for a symbol's new definition (None if deleted).
+    let update (sym:Symbol) (defOpt:Dict.Def option) (rlu:RLU) : RLU =
+        let cs = List.fold (remClient sym) (rlu.clients) (deps sym rlu)
+        match defOpt with
+        | None -> { deps = Map.remove sym (rlu.deps); clients = cs }
+        | Some def ->
+            let ds = defDeps sym def
+            { deps = Map.add sym ds (rlu.deps)
+              clients = List.fold (addClient sym) cs ds
+            }
+
+    /// Update the index from a dictionary diff (see Dict.diff).
+    let applyDiff (rlu:RLU) (diffs:seq<Symbol * VDiff<Dict.Def>>) : RLU =
+        let step r (sym,vdiff) =
+            match vdiff with
+            | InL _ -> update sym None r
+            | InR def | InB (_,def) -> update sym (Some def) r
+        Seq.fold step rlu diffs
+
+    /// Index every definition in a dictionary.
+    let ofDict (d:Dict) : RLU =
+        Seq.fold (fun r (sym,def) -> update sym (Some def) r) empty (Dict.toSeq d)
+
+    /// Transitive clients for a set of symbols, including the symbols.
+    /// This is the set of words whose deep version may be affected by
+    /// an update to the given symbols.
+    let clientsClosure (syms:seq<Symbol>) (rlu:RLU) : Set<Symbol> =
+        let rec loop acc work =
+            match work with
+            | (s::work') ->
+                if Set.contains s acc then loop acc work' else
+                let work'' = Set.fold (fun l c -> (c::l)) work' (clients s rlu)
+                loop (Set.add s acc) work''
+            | [] -> acc
+        loop (Set.empty) (List.ofSeq syms)
 
@@ -0,0 +1,144 @@
+namespace Awelon
+open Data.ByteString
+open Stowage
+
+// Operations such as Dict.toSeq, selectPrefix and extractPrefix merge
+// prototype chains (see Dict.mergeProto), which loads and rebuilds whole
+// nodes in memory. For a huge dictionary where we want only a handful
+// of symbols, this is wasteful.
+//
+// A view is a read-only reference to the symbols under a prefix of a
+// dictionary. Lookups and listings descend only into nodes on the query
+// path, and remote nodes are loaded via LVRef so parsed nodes are shared
+// through the cache. Listings are lazy and sorted, and they hold only
+// the nodes along the current path, so memory is proportional to the
+// result we actually consume.
+module DictView =
+
+    type Symbol = Dict.Symbol
+    type Prefix = Dict.Prefix
+    type Def = Dict.Def
+
+    /// A read-only view of symbols under a prefix of a dictionary.
+    /// Symbols in the view are relative to the prefix.
+    type View =
+        { root   : Dict
+          prefix : Prefix
+        }
+
+    let ofDict (d:Dict) : View = { root = d; prefix = BS.empty }
+
+    /// View a dictionary in Stowage, without loading it.
+    let ofDir (dir:Dict.Dir) : View = ofDict (Dict.fromProto dir)
+
+    /// Narrow a view to symbols under a prefix.
+    let under (p:Prefix) (v:View) : View = { v with prefix = BS.append (v.prefix) p }
+
+    /// Find a definition, loading only nodes on the path to the symbol.
+    let tryFind (k:Symbol) (v:View) : Def option =
+        Dict.tryFind (BS.append (v.prefix) k) (v.root)
+
+    let inline contains (k:Symbol) (v:View) : bool =
+        Option.isSome (tryFind k v)
+
+    let inline private isPrefix p s = (p = (BS.take (BS.length p) s))
+
+    // merge sorted sequences with disjoint symbols
+    let private merge (a:seq<Symbol * Def>) (b:seq<Symbol * Def>) : seq<Symbol * Def> =
+        seq {
+            use ea = a.GetEnumerator()
+            use eb = b.GetEnumerator()
+            let ha = ref (ea.MoveNext())
+            let hb = ref (eb.MoveNext())
+            while (!ha || !hb) do
+                let takeA = !ha && (not !hb || (ByteString.Compare (fst ea.Current) (fst eb.Current) < 0))
+                if takeA then
+                    yield ea.Current
+                    ha := ea.MoveNext()
+                else
+                    yield eb.Current
+                    hb := eb.MoveNext()
+        }
+
+    // The directory in effect for a node: a remote node, and the prefix
+    // within it that corresponds to our node. Loaded only when needed.
+    type private Inh = (struct(LVRef<Dict> * Prefix)) option
+
+    let private enter (d:Dict) (inh:Inh) : Inh =
+        match d.pd with
+        | None -> inh
+        | Some None -> None
+        | Some (Some ref) -> Some (struct(ref, BS.empty))
+
+    let private extend (ext:ByteString) (inh:Inh) : Inh =
+        match inh with
+        | Some (struct(ref, rel)) -> Some (struct(ref, BS.append rel ext))
+        | None -> None
+
+    // Definitions in `d` for symbols starting with `q`, sorted.
+    let rec private defsAt (q:Prefix) (d:Dict) : seq<Symbol * Def> =
+        walk (BS.empty) q d None
+
+    // Definitions under `path + q` for a node `d` at `path`, with full
+    // symbols. Local definitions and child nodes shadow the directory.
+    and private walk (path:Prefix) (q:Prefix) (d:Dict) (inh0:Inh) : seq<Symbol * Def> =
+        let inh = enter d inh0
+        let remote (q':Prefix) (shadowed:Symbol -> bool) =
+            match inh with
+            | None -> Seq.empty
+            | Some (struct(ref, rel)) ->
+                // delay the load until the sequence is consumed
+                seq { yield! defsAt (BS.append rel q') (LVRef.load ref) }
+                |> Seq.map (fun (s,def) -> (BS.drop (rel.Length) s, def))
+                |> Seq.filter (fun (s,_) -> not (shadowed s))
+                |> Seq.map (fun (s,def) -> (BS.append path s, def))
+        let child ix p c =
+            let ext = BS.cons ix p
+            walk (BS.append path ext) (BS.empty) c (extend ext inh)
+        if not (BS.isEmpty q) then
+            let ix = BS.unsafeHead q
+            let qt = BS.unsafeTail q
+            match Map.tryFind ix (d.cs) with
+            | Some (struct(p,c)) when isPrefix p qt ->
+                let ext = BS.cons ix p
+                walk (BS.append path ext) (BS.drop (p.Length) qt) c (extend ext inh)
+            | Some (struct(p,c)) when isPrefix qt p ->
+                // child is within q, but remote symbols may fall outside it
+                let ext = BS.cons ix p
+                merge (child ix p c) (remote q (isPrefix ext))
+            | _ -> remote q (fun _ -> false)
+        else
+            let own =
+                match d.vu with
+                | Some (Some def) -> Seq.singleton (path, def)
+                | _ -> Seq.empty
+            let local (s:Symbol) =
+                if BS.isEmpty s then Option.isSome (d.vu) else
+                match Map.tryFind (BS.unsafeHead s) (d.cs) with
+                | Some (struct(p,_)) -> isPrefix p (BS.unsafeTail s)
+                | None -> false
+            let children = d.cs |> Map.toSeq |> Seq.collect (fun (ix, struct(p,c)) -> child ix p c)
+            Seq.append own (merge children (remote (BS.empty) local))
+
+    /// Lazily list definitions in a view, sorted by symbol.
+    let toSeq (v:View) : seq<Symbol * Def> =
+        let n = v.prefix.Length
+        defsAt (v.prefix) (v.root) |> Seq.map (fun (s,def) -> (BS.drop n s, def))
+
+    /// Lazily list symbols in a view, sorted.
+    let keys (v:View) : seq<Symbol> = Seq.map fst (toSeq v)
+
+    /// List up to `n` definitions with symbols at or after `start`, for
+    /// indexed browsing.
+    let page (start:Symbol) (n:int) (v:View) : (Symbol * Def)[] =
+        toSeq v |> Seq.skipWhile (fun (s,_) -> (ByteString.Compare s start < 0))
+                |> Seq.truncate n |> Array.ofSeq
+
+    /// Test whether a view has no definitions.
+    let isEmpty (v:View) : bool = Seq.isEmpty (toSeq v)
+
+    /// Materialize a view as a dictionary, with symbols relative to
+    /// the view's prefix.
+    let toDict (v:View) : Dict =
+        toSeq v |> Seq.map (fun (s,def) -> Dict.Define(s, Some def)) |> Dict.fromSeqEnt
+
@@ -367,6 +367,108 @@ module Dict =
     /// Compute dictionary from sequence of entries.
     let inline fromSeqEnt s = applySeqEnt empty s
 
+    let private entKey (e:DictEnt) : ByteString =
+        match e with
+        | Direct (p,_) -> p
+        | Define (s,_) -> s
+
+    let inline private isDirect (e:DictEnt) : bool =
+        match e with
+        | Direct _ -> true
+        | Define _ -> false
+
+    // sort by key, with directories before definitions at equal keys
+    let private cmpEnt (struct(ka:ByteString,ea)) (struct(kb:ByteString,eb)) : int =
+        let c = ByteString.Compare ka kb
+        if (0 <> c) then c else
+        compare (not (isDirect ea)) (not (isDirect eb))
+
+    let inline private fst' (struct(k:Symbol,_:DictEnt)) = k
+
+    // below this many entries, we won't bother with parallel rewrites
+    let private parBatchThresh = 4096
+
+    // Apply sorted entries with keys relative to node `d`. Here `hr`
+    // tracks whether the directory in effect above this node is remote,
+    // as for matchDir', so we can drop unnecessary deletion entries.
+    let rec private applyBatchAt (hr:bool) (d0:Dict) (ents:struct(Symbol * DictEnt)[]) : Dict =
+        let hrAt (d:Dict) =
+            match d.pd with
+            | Some dir -> Option.isSome dir
+            | None -> hr
+        // entries for this node, i.e. with empty keys, are sorted first
+        let rec applyHere (d:Dict) ix =
+            if (ix = ents.Length) then struct(d,ix) else
+            let struct(k,e) = ents.[ix]
+            if not (BS.isEmpty k) then struct(d,ix) else
+            match e with
+            | Direct (_,dir) ->
+                let pdu = if Option.isNone dir && not hr then None else Some dir
+                applyHere (mkDict pdu None (Map.empty)) (ix + 1)
+            | Define (_,du) ->
+                let vu = if Option.isNone du && not (hrAt d) then None else Some du
+                applyHere (mkDict (d.pd) vu (d.cs)) (ix + 1)
+        let struct(d,ix0) = applyHere d0 0
+        let hrC = hrAt d
+        // remaining entries are grouped by first byte
+        let groups = new ResizeArray<struct(int * int)>()
+        let mutable ix = ix0
+        while (ix < ents.Length) do
+            let b = BS.unsafeHead (fst' ents.[ix])
+            let mutable j = ix + 1
+            while (j < ents.Length) && (b = BS.unsafeHead (fst' ents.[j])) do
+                j <- j + 1
+            groups.Add(struct(ix,j))
+            ix <- j
+        let rewriteChild (struct(lo,hi)) =
+            let b = BS.unsafeHead (fst' ents.[lo])
+            let tl i = BS.unsafeTail (fst' ents.[i])
+            let struct(p,c) =
+                match Map.tryFind b (d.cs) with
+                | Some pc -> pc
+                | None -> // new child, under the common prefix of its keys
+                    let k0 = tl lo
+                    let n = Seq.fold (fun n i -> min n (bytesShared k0 (tl i))) (k0.Length) (seq { lo .. (hi - 1) })
+                    struct(BS.take n k0, empty)
+            let n = Seq.fold (fun n i -> min n (bytesShared p (tl i))) (p.Length) (seq { lo .. (hi - 1) })
+            let pc = prependChildPrefix (BS.drop n p) c
+            let sub = Array.init (hi - lo) (fun i ->
+                let struct(_,e) = ents.[lo + i]
+                struct(BS.drop n (tl (lo + i)), e))
+            struct(b, BS.take n p, applyBatchAt hrC pc sub)
+        let rewritten =
+            let gs = groups.ToArray()
+            if ((ents.Length - ix0) < parBatchThresh) || (gs.Length < 2)
+                then Array.map rewriteChild gs
+                else Array.Parallel.map rewriteChild gs
+        let cs' = Array.fold (fun cs (struct(b,p,c)) -> updChild b p c cs) (d.cs) rewritten
+        mkDict (d.pd) (d.vu) cs'
+
+    /// Apply a batch of entries to a dictionary. Equivalent to applying
+    /// the entries in order (see applySeqEnt), but every touched node is
+    /// rewritten only once, and independent children of large batches
+    /// are rewritten in parallel. Does not load remote nodes, nor does
+    /// it compact. For large commits, apply a batch then compact once.
+    let applyBatch (d:Dict) (ents:seq<DictEnt>) : Dict =
+        // Keep only the last update per key, and drop updates erased by
+        // a later directory entry. Afterwards, order of application only
+        // matters for a directory and the entries it covers, which our
+        // sort respects. Assumes few directory entries per batch.
+        let a = Array.ofSeq ents
+        let seen = new System.Collections.Generic.HashSet<struct(bool * ByteString)>()
+        let dirs = new ResizeArray<Prefix>()
+        let keep = new ResizeArray<struct(Symbol * DictEnt)>()
+        for i = (a.Length - 1) downto 0 do
+            let e = a.[i]
+            let k = entKey e
+            let isNew = seen.Add(struct(isDirect e, k))
+            if isNew && not (dirs.Exists(fun p -> isPrefix p k)) then
+                keep.Add(struct(k,e))
+            if isDirect e then dirs.Add(k)
+        let sorted = keep.ToArray()
+        Array.sortInPlaceWith cmpEnt sorted
+        applyBatchAt false d sorted
+
     // here `hr` tracks the `has remote entries` context from the parent.
     // When false, we can often eliminate deletion entries from `b`.
     let rec private flushUpdates' (hr:bool) (a:Dict) (b:Dict) : Dict =
@@ -487,10 +589,6 @@ module Dict =
         | None, Some b -> Some (InR b)
         | None, None -> None
 
-    // trivial sequence 0uy .. 255uy
-    let private seqBytes : seq<byte> = 
-        Seq.ofArray [|0uy..255uy|]
-    
     // helper for diff
     let inline private getDefFB p d d0 =
         match d.vu with
@@ -506,7 +604,10 @@ module Dict =
     /// does not check for a latest common ancestor. 
     let diff (a0:Dict) (b0:Dict) : seq<Symbol * VDiff<Def>> =
         let rec diffP p a b =
-            if System.Object.ReferenceEquals(a,b) then Seq.empty else
+            // Dict is a struct, so we test for a shared children map
+            let same = System.Object.ReferenceEquals(a.cs, b.cs) 
+                    && (a.vu = b.vu) && (a.pd = b.pd)
+            if same then Seq.empty else
             if (a.pd = b.pd) then diffV p a b else
             diffV p (mergeProto a) (mergeProto b)
         and diffV p a b =
@@ -519,9 +620,11 @@ module Dict =
                 | None -> Seq.empty
                 | Some vdiff -> Seq.singleton (p,vdiff)
             Seq.append sv (diffCS p a b)
-        and diffCS p a b = // diff all possible indexes 
+        and diffCS p a b = // diff indexes present in either node
             // this is the only lazy part of our sequence...
-            Seq.concat (Seq.map (diffIX p (a.cs) (b.cs)) seqBytes)
+            let ixs = Map.fold (fun s ix _ -> Set.add ix s) (Set.empty) (a.cs)
+                   |> fun s -> Map.fold (fun s ix _ -> Set.add ix s) s (b.cs)
+            Seq.concat (Seq.map (diffIX p (a.cs) (b.cs)) ixs)
         and diffIX p acs bcs ix = // diff specific index
             match Map.tryFind ix acs, Map.tryFind ix bcs with
             | None,None -> Seq.empty // no differences
@@ -721,6 +824,12 @@ module Dict =
                 struct(d',sz')
         }
 
+    /// Parse a dictionary node as written by `write`, e.g. to import
+    /// a dictionary. May raise ByteStream.ReadError.
+    let parse (db:Stowage) (s:ByteString) : Dict =
+        let mkDir h = LVRef.wrap (VRef.wrap node_codec db h)
+        parseDict (autoDef db) mkDir s
+
     /// Compact a dictionary via the default codec. 
     let inline compact (db:Stowage) (d:Dict) : Dict =
         Codec.compact node_codec db d
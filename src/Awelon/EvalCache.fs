@@ -0,0 +1,163 @@
+namespace Awelon
+open System.Collections.Generic
+open System.Threading.Tasks
+open Data.ByteString
+open Stowage
+
+// Per docs/Indexing.md, a word's deep version (see WordVersion) fully
+// determines its evaluated definition, in any dictionary that shares
+// the word's transitive closure. Our dictionaries are mostly forks of
+// one another, so we cache evaluations by version, and each fork can
+// reuse evaluations from every other.
+//
+// The evaluator consults the cache whenever it links a word. Results
+// are normal-form programs, held as CVRef: small results are inline,
+// larger results are stowed and loaded through the Stowage cache. The
+// index is a memory cache, so entries may be dropped under memory
+// pressure. This only costs us some evaluation.
+//
+// Evaluation is pluggable, as for Command and LiveTest.
+module EvalCache =
+
+    type Symbol = Dict.Symbol
+    type Version = WordVersion.Version
+
+    /// Evaluated definition of a word, or None if undefined.
+    type Link = Symbol -> ByteString option
+
+    /// Evaluate a program to normal form, linking words via Link.
+    type Eval = Link -> ByteString -> ByteString
+
+    /// Identifies a fork of a dictionary, for statistics.
+    type Fork = ByteString
+
+    // results larger than this are stowed
+    let private thresh = 600UL
+
+    // we track popularity for at most this many words
+    let private maxUsage = 100000
+
+    type private Entry = (struct(Fork * CVRef<ByteString>))
+
+    /// Statistics since the cache was created.
+    ///
+    /// links: words linked via the cache
+    /// hits: links with a cached evaluation
+    /// crossForkHits: hits on evaluations made for another fork
+    /// evals: words evaluated and added to the cache
+    type Stats =
+        { links         : int
+          hits          : int
+          crossForkHits : int
+          evals         : int
+        }
+
+    let private noStats = { links = 0; hits = 0; crossForkHits = 0; evals = 0 }
+
+    /// Fraction of links with a cached evaluation.
+    let hitRate (s:Stats) : float =
+        if (0 = s.links) then 0.0 else (float s.hits / float s.links)
+
+    /// Fraction of links served by evaluations from another fork.
+    let crossForkRate (s:Stats) : float =
+        if (0 = s.links) then 0.0 else (float s.crossForkHits / float s.links)
+
+    /// A cache of evaluated words, shared by forks of a dictionary.
+    type Cache =
+        val private db : Stowage
+        val private eval : Eval
+        val private table : MCache<Version, Entry>
+        val private usage : Dictionary<Symbol, int>
+        val mutable private stats : Stats
+        new(db:Stowage, eval:Eval) =
+            { db = db
+              eval = eval
+              table = new MCache<Version, Entry>()
+              usage = new Dictionary<Symbol, int>()
+              stats = noStats
+            }
+
+        /// Statistics since the cache was created.
+        member c.Stats with get() = lock c (fun () -> c.stats)
+
+        member private c.Count (fn:Stats -> Stats) : unit =
+            lock c (fun () -> c.stats <- fn (c.stats))
+
+        // Popularity is approximate. When we track too many words, we
+        // halve the counts and drop words that fall to zero.
+        member private c.Used (sym:Symbol) : unit =
+            lock (c.usage) (fun () ->
+                match c.usage.TryGetValue(sym) with
+                | true, n -> c.usage.[sym] <- (n + 1)
+                | _ ->
+                    if (c.usage.Count >= maxUsage) then
+                        let kvs = Array.ofSeq (c.usage)
+                        c.usage.Clear()
+                        for kv in kvs do
+                            if (kv.Value > 1) then c.usage.[kv.Key] <- (kv.Value / 2)
+                    c.usage.[sym] <- 1)
+
+        /// Find an evaluation for a deep version.
+        member c.TryFind (v:Version) : ByteString option =
+            match MCache.tryFind v (c.table) with
+            | Some (struct(_,ref)) -> Some (CVRef.load ref)
+            | None -> None
+
+        member private c.Linker (fork:Fork) (d:Dict) (counted:bool) : Link =
+            let versions = new Dictionary<Symbol, Version>()
+            let active = new HashSet<Symbol>()
+            let find sym = Dict.tryFind sym d
+            let rec link sym =
+                match WordVersion.version find versions sym with
+                | None -> None
+                | Some v ->
+                if counted then c.Used sym
+                match MCache.tryFind v (c.table) with
+                | Some (struct(origin,ref)) ->
+                    if counted then
+                        let cross = if (origin = fork) then 0 else 1
+                        c.Count (fun s -> { s with links = s.links + 1; hits = s.hits + 1
+                                                   crossForkHits = s.crossForkHits + cross })
+                    Some (CVRef.load ref)
+                | None ->
+                    if not (active.Add(sym)) then
+                        invalidOp (sprintf "cyclic definition: %s" (BS.toString sym))
+                    let def = Option.get (find sym)
+                    let r = try c.eval link (def.Data)
+                            finally active.Remove(sym) |> ignore<bool>
+                    let ref = CVRef.stow thresh (EncBytes.codec) (c.db) r
+                    let szV = if CVRef.isRemote ref then RscHash.size else r.Length
+                    let sz = uint64 (v.Length + szV)
+                    MCache.tryAdd v (struct(fork, ref)) sz (c.table) |> ignore<Entry>
+                    if counted then
+                        c.Count (fun s -> { s with links = s.links + 1; evals = s.evals + 1 })
+                    Some r
+            link
+
+        /// Link words of a dictionary via the cache, on behalf of a fork.
+        /// Versions are memoized for the dictionary, so use a new Link
+        /// after each update. A Link is not thread-safe. Cyclic words
+        /// raise an exception.
+        member c.Link (fork:Fork) (d:Dict) : Link = c.Linker fork d true
+
+        /// The most frequently linked words, across forks.
+        member c.Popular (n:int) : Symbol[] =
+            lock (c.usage) (fun () ->
+                c.usage |> Seq.sortByDescending (fun kv -> kv.Value)
+                        |> Seq.truncate n |> Seq.map (fun kv -> kv.Key) |> Array.ofSeq)
+
+        /// Evaluate up to `n` popular words for a fork in the background,
+        /// so they're cached before the fork links them. This does not
+        /// affect statistics. Words that fail to evaluate are skipped.
+        member c.Populate (fork:Fork) (d:Dict) (n:int) : Task =
+            let ws = c.Popular n
+            Task.Run(fun () ->
+                let link = c.Linker fork d false
+                for w in ws do
+                    try link w |> ignore<ByteString option>
+                    with _ -> ())
+
+    /// Create an evaluation cache.
+    let create (db:Stowage) (eval:Eval) : Cache = new Cache(db, eval)
+
+type EvalCache = EvalCache.Cache
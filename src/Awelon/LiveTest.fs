@@ -0,0 +1,237 @@
+namespace Awelon
+open System.Threading
+open System.Threading.Tasks
+open System.Collections.Generic
+open Data.ByteString
+
+// Continuous, zero-button testing per docs/Todo.md. By convention, a
+// word whose name ends in `-test` is a test. After each update to a
+// dictionary, we should quickly report which tests fail.
+//
+// Running every test after each edit doesn't scale. So, like Sheet, we
+// keep a reverse lookup index and deep versions. The dirty tests are
+// those among transitive clients of changed words. Results are memoized
+// by deep version, so reverting an edit or switching between forks of
+// a dictionary costs only lookups. Tests run in parallel, and a test
+// that exceeds its time quota fails. Timeouts depend on load rather than
+// on the version, so they aren't memoized and are retried next update.
+//
+// Running a test is pluggable, because we don't yet have a full Awelon
+// evaluator. A test should raise an exception or return Fail to report
+// failure. Type errors may be reported the same way.
+module LiveTest =
+
+    type Symbol = Dict.Symbol
+
+    let testSuffix = BS.fromString "-test"
+
+    let isTestWord (sym:Symbol) : bool =
+        (testSuffix = BS.takeLast (testSuffix.Length) sym)
+
+    /// Result of a test, with a message on failure.
+    type Result =
+        | Pass
+        | Fail of string
+
+    /// Run a test word in context of a dictionary.
+    type Run = Dict -> Symbol -> Result
+
+    /// Quotas for running tests.
+    ///
+    /// threads: tests run concurrently
+    /// timeout: time before a test is reported as failed. The test is
+    ///   abandoned but may continue to use a thread until it finishes,
+    ///   and counts against `threads` until then.
+    type Quota =
+        { threads  : int
+          timeout  : System.TimeSpan
+        }
+
+    let defaultQuota =
+        { threads = System.Environment.ProcessorCount
+          timeout = System.TimeSpan.FromSeconds(10.0)
+        }
+
+    /// Summary of tests for a dictionary.
+    ///
+    /// tests: test words in the dictionary
+    /// failed: failing tests, sorted
+    /// runs: tests run for the most recent update
+    /// memoHits: dirty tests whose version was already tested
+    type Summary =
+        { tests    : int
+          failed   : Symbol list
+          runs     : int
+          memoHits : int
+        }
+
+    let private noSummary = { tests = 0; failed = []; runs = 0; memoHits = 0 }
+
+    let private timedOut = Fail "timeout"
+    let private noThread = Fail "timeout waiting for a thread"
+    let private isTimeout (res:Result) = (res = timedOut) || (res = noThread)
+
+    // fail a test that doesn't finish within the timeout
+    let private withTimeout (timeout:System.TimeSpan) (t:Task<Result>) : Task<Result> =
+        Task.WhenAny(t :> Task, Task.Delay(timeout)).ContinueWith(fun (w:Task<Task>) ->
+            if obj.ReferenceEquals(w.Result, t) then t.Result else timedOut)
+
+    /// Tests for a dictionary, updated incrementally.
+    ///
+    /// Update may be called directly, or by a background thread that
+    /// reads the dictionary periodically (see Start). Not thread-safe
+    /// for concurrent updates. Subscribers are called from the updating
+    /// thread with the new summary.
+    type Runner =
+        val private run : Run
+        val Quota : Quota
+        val private slots : SemaphoreSlim // held until a test finishes
+        val mutable private lastError : exn option
+        val mutable private dict : Dict
+        val mutable private rlu : DictRLU.RLU
+        val private versions : Dictionary<Symbol, WordVersion.Version>
+        val private results : Dictionary<Symbol, Result>
+        val private memo : Dictionary<WordVersion.Version, Result>
+        val private retry : HashSet<Symbol> // timed out, not memoized
+        val mutable private summary : Summary
+        val mutable private subs : (Summary -> unit) list
+        val mutable private stop : bool
+        val mutable private thread : Thread option
+        new(run:Run, quota:Quota) =
+            { run = run
+              Quota = quota
+              slots = new SemaphoreSlim(max 1 (quota.threads))
+              lastError = None
+              dict = Dict.empty
+              rlu = DictRLU.empty
+              versions = new Dictionary<Symbol, WordVersion.Version>()
+              results = new Dictionary<Symbol, Result>()
+              memo = new Dictionary<WordVersion.Version, Result>()
+              retry = new HashSet<Symbol>()
+              summary = noSummary
+              subs = []
+              stop = false
+              thread = None
+            }
+
+        /// Summary for the most recent update.
+        member r.Summary with get() = lock r (fun () -> r.summary)
+
+        /// Error from the most recent background update, if it failed.
+        member r.LastError with get() = lock r (fun () -> r.lastError)
+
+        // Start a test when a slot is free. The slot is released when the
+        // test finishes, even if it was abandoned after a timeout. If no
+        // slot frees up within the timeout, the test fails without running.
+        member private r.RunTest (d:Dict) (sym:Symbol) : Task<Result> =
+            if not (r.slots.Wait(r.Quota.timeout)) 
+                then Task.FromResult(noThread) else
+            let t = Task.Run(fun () ->
+                try try r.run d sym
+                    with e -> Fail (e.Message)
+                finally r.slots.Release() |> ignore<int>)
+            withTimeout (r.Quota.timeout) t
+
+        /// Result for a test word, if tested.
+        member r.Result (sym:Symbol) : Result option =
+            lock r (fun () ->
+                match r.results.TryGetValue(sym) with
+                | true, v -> Some v
+                | _ -> None)
+
+        /// Receive summaries after each update.
+        member r.Subscribe (fn:Summary -> unit) : System.IDisposable =
+            lock r (fun () -> r.subs <- (fn :: r.subs))
+            { new System.IDisposable with
+                member __.Dispose() =
+                    lock r (fun () ->
+                        r.subs <- List.filter (fun f -> not (obj.ReferenceEquals(f,fn))) r.subs) }
+
+        /// Replace the dictionary and re-run dirty tests.
+        member r.Update (d':Dict) : Summary =
+            let changes = Dict.diff (r.dict) d' |> Array.ofSeq
+            r.dict <- d'
+            r.rlu <- DictRLU.applyDiff (r.rlu) changes
+            let dirty = DictRLU.clientsClosure (Seq.map fst changes) (r.rlu)
+            for w in dirty do r.versions.Remove(w) |> ignore<bool>
+            let find sym = Dict.tryFind sym d'
+            let tests = Seq.append (Seq.filter isTestWord dirty) (r.retry)
+                        |> Seq.distinct |> Array.ofSeq
+            let versioned = tests |> Array.choose (fun sym ->
+                match WordVersion.version find (r.versions) sym with
+                | Some v -> Some (struct(sym,v))
+                | None -> None)
+            let hits = versioned |> Array.filter (fun (struct(_,v)) -> r.memo.ContainsKey(v))
+            let todo = versioned |> Array.filter (fun (struct(_,v)) -> not (r.memo.ContainsKey(v)))
+            let ran = todo |> Array.map (fun (struct(sym,_)) -> r.RunTest d' sym)
+                           |> Array.map (fun t -> t.Result)
+            lock r (fun () ->
+                r.retry.Clear()
+                for sym in tests do r.results.Remove(sym) |> ignore<bool>
+                for struct(sym,v) in hits do r.results.[sym] <- r.memo.[v]
+                Array.iteri (fun ix (struct(sym,v)) ->
+                    let res = ran.[ix]
+                    r.results.[sym] <- res
+                    if isTimeout res
+                        then r.retry.Add(sym) |> ignore<bool>
+                        else r.memo.[v] <- res) todo
+                // memo is only for recent versions; reset when it grows large
+                if (r.memo.Count > (4 * r.results.Count + 1000)) then
+                    r.memo.Clear()
+                    for kv in r.results do
+                        match r.versions.TryGetValue(kv.Key) with
+                        | true, v when not (isTimeout kv.Value) -> r.memo.[v] <- kv.Value
+                        | _ -> ()
+                let failed =
+                    r.results |> Seq.filter (fun kv -> kv.Value <> Pass)
+                              |> Seq.map (fun kv -> kv.Key) |> Seq.sort |> List.ofSeq
+                r.summary <- { tests = r.results.Count; failed = failed
+                               runs = todo.Length; memoHits = hits.Length })
+            let s = r.Summary
+            if (changes.Length > 0) || (todo.Length > 0) then
+                for fn in lock r (fun () -> r.subs) do fn s
+            s
+
+        /// Start a background thread that reads the dictionary and
+        /// updates tests at the given interval.
+        member r.Start (read:unit -> Dict) (interval:System.TimeSpan) : unit =
+            let rec loop () =
+                // report errors (e.g. from read or a subscriber) and retry
+                // at the next interval, rather than killing the process.
+                let err = 
+                    try r.Update (read ()) |> ignore<Summary>; None
+                    with e -> Some e
+                lock r (fun () -> r.lastError <- err)
+                let halt = lock r (fun () ->
+                    if not r.stop then
+                        Monitor.Wait(r, interval) |> ignore<bool>
+                    r.stop)
+                if not halt then loop ()
+            lock r (fun () ->
+                if Option.isSome (r.thread) then invalidOp "test runner already running"
+                r.stop <- false
+                let t = new Thread(loop)
+                t.IsBackground <- true
+                t.Priority <- ThreadPriority.BelowNormal
+                r.thread <- Some t
+                t.Start())
+
+        /// Stop the background thread, waiting for an update in progress.
+        member r.Stop() : unit =
+            let tOpt = lock r (fun () ->
+                r.stop <- true
+                Monitor.PulseAll(r)
+                let t = r.thread
+                r.thread <- None
+                t)
+            Option.iter (fun (t:Thread) -> t.Join()) tOpt
+
+        interface System.IDisposable with
+            member r.Dispose() = r.Stop()
+
+    /// Create a test runner and test every test word in a dictionary.
+    let create (run:Run) (d:Dict) : Runner =
+        let r = new Runner(run, defaultQuota)
+        r.Update d |> ignore<Summary>
+        r
+
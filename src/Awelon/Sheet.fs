@@ -0,0 +1,208 @@
+namespace Awelon
+open System.Collections.Generic
+open Data.ByteString
+open Stowage
+
+// Spreadsheets as described in docs/ApplicationModel.md use a word
+// per cell under a common prefix, like `:foo-4-a foo-3-a foo-2-a concat`.
+// Every cell may be evaluated independently, but re-evaluating every
+// cell after each edit doesn't scale to large sheets.
+//
+// The Sheet service keeps a reverse lookup index and a deep version
+// per word. After an update, we diff the dictionaries, find the dirty
+// words as the transitive clients of changed words, and re-evaluate
+// only the dirty cells. Evaluation proceeds in topological waves, and
+// cells within a wave are evaluated in parallel. Results are memoized
+// by deep version, so undo or reverting a cell costs a lookup. Cells
+// whose values change are pushed to subscribers.
+//
+// Evaluation itself is pluggable, because we don't yet have a full
+// Awelon evaluator. The evaluator receives the values of cells that
+// were evaluated earlier, which for a topological order includes all
+// cells a cell depends upon (barring cycles).
+module Sheet =
+
+    type Symbol = Dict.Symbol
+
+    /// Evaluate a cell. Receives the dictionary, a lookup for values of
+    /// cells already evaluated, and the cell to evaluate. Evaluation
+    /// errors should be represented in the resulting value.
+    type Eval = Dict -> (Symbol -> ByteString option) -> Symbol -> ByteString
+
+    /// A changed cell value, None if the cell was removed.
+    type Update = (struct(Symbol * ByteString option))
+
+    /// Statistics for the most recent recalculation.
+    ///
+    /// dirty: dirty cells, i.e. changed or with changed dependencies
+    /// evals: cells evaluated
+    /// memoHits: dirty cells whose version was already evaluated
+    /// waves: topological waves (sequential steps) for evaluation
+    /// elapsed: time to recalculate, excluding subscribers
+    type Stats =
+        { dirty    : int
+          evals    : int
+          memoHits : int
+          waves    : int
+          elapsed  : System.TimeSpan
+        }
+
+    let private noStats =
+        { dirty = 0; evals = 0; memoHits = 0; waves = 0; elapsed = System.TimeSpan.Zero }
+
+    // below this wave size, we won't bother with parallel evaluation
+    let private parThresh = 4
+
+    /// A live spreadsheet over cells in a dictionary with a given prefix.
+    ///
+    /// Not thread-safe for concurrent updates. Subscribers are called
+    /// from the updating thread, after values are updated.
+    type Sheet =
+        val Prefix : Dict.Prefix
+        val private eval : Eval
+        val mutable private dict : Dict
+        val mutable private rlu : DictRLU.RLU
+        val private versions : Dictionary<Symbol, WordVersion.Version>
+        val private values : Dictionary<Symbol, ByteString>
+        val private memo : Dictionary<WordVersion.Version, ByteString>
+        val mutable private subs : (Update[] -> unit) list
+        val mutable private stats : Stats
+        new(eval:Eval, prefix:Dict.Prefix, d:Dict) as s =
+            { Prefix = prefix
+              eval = eval
+              dict = Dict.empty
+              rlu = DictRLU.empty
+              versions = new Dictionary<Symbol, WordVersion.Version>()
+              values = new Dictionary<Symbol, ByteString>()
+              memo = new Dictionary<WordVersion.Version, ByteString>()
+              subs = []
+              stats = noStats
+            } then s.Update(d) |> ignore<Update[]>
+
+        member private s.IsCell (sym:Symbol) : bool =
+            (s.Prefix = BS.take (s.Prefix.Length) sym)
+
+        /// Current dictionary.
+        member s.Dict with get() = s.dict
+
+        /// Statistics for the most recent update.
+        member s.Stats with get() = s.stats
+
+        /// Number of evaluated cells.
+        member s.Count with get() = s.values.Count
+
+        /// Current value of a cell, if defined.
+        member s.Value (sym:Symbol) : ByteString option =
+            match s.values.TryGetValue(sym) with
+            | true, v -> Some v
+            | _ -> None
+
+        /// Current values of all cells, in no particular order.
+        member s.Values : seq<Symbol * ByteString> =
+            s.values |> Seq.map (fun kv -> (kv.Key, kv.Value)) |> Array.ofSeq :> seq<_>
+
+        /// Receive batches of changed values after each update.
+        member s.Subscribe (fn:Update[] -> unit) : System.IDisposable =
+            lock s (fun () -> s.subs <- (fn :: s.subs))
+            { new System.IDisposable with
+                member __.Dispose() =
+                    lock s (fun () ->
+                        s.subs <- List.filter (fun f -> not (obj.ReferenceEquals(f,fn))) s.subs) }
+
+        /// Define or delete a single cell or word.
+        member s.Edit (sym:Symbol) (du:Dict.DefUpd) : Update[] =
+            s.Update(Dict.updSym sym du (s.dict))
+
+        // Kahn's algorithm over dirty words; cells in each wave are
+        // independent. Words stuck in cycles end up in a final wave.
+        member private s.Waves (dirty:Set<Symbol>) : Symbol[] list =
+            let indeg = new Dictionary<Symbol,int>()
+            for w in dirty do
+                let n = DictRLU.deps w (s.rlu) |> List.filter (fun d -> Set.contains d dirty) |> List.length
+                indeg.[w] <- n
+            let rec loop acc (ready:Symbol[]) =
+                if (0 = ready.Length) then List.rev acc else
+                let next = new ResizeArray<Symbol>()
+                for w in ready do
+                    indeg.Remove(w) |> ignore<bool>
+                    for c in DictRLU.clients w (s.rlu) do
+                        match indeg.TryGetValue(c) with
+                        | true, n ->
+                            indeg.[c] <- (n - 1)
+                            if (1 = n) then next.Add(c)
+                        | _ -> ()
+                loop (ready :: acc) (next.ToArray())
+            let ready0 = indeg |> Seq.filter (fun kv -> (0 = kv.Value)) |> Seq.map (fun kv -> kv.Key) |> Array.ofSeq
+            let waves = loop [] ready0
+            if (0 = indeg.Count) then waves else
+            waves @ [Array.ofSeq indeg.Keys]
+
+        /// Replace the dictionary, recalculate dirty cells, and notify
+        /// subscribers. Returns the changed cell values.
+        member s.Update (d':Dict) : Update[] =
+            let sw = System.Diagnostics.Stopwatch.StartNew()
+            let changes = Dict.diff (s.dict) d' |> Array.ofSeq
+            s.dict <- d'
+            s.rlu <- DictRLU.applyDiff (s.rlu) changes
+            let dirty = DictRLU.clientsClosure (Seq.map fst changes) (s.rlu)
+            for w in dirty do s.versions.Remove(w) |> ignore<bool>
+            let find sym = Dict.tryFind sym d'
+            let updates = new ResizeArray<Update>()
+            let mutable ctDirty = 0
+            let mutable ctEval = 0
+            let mutable ctMemo = 0
+            let waves = s.Waves dirty
+            for wave in waves do
+                let cells =
+                    wave |> Array.choose (fun sym ->
+                        if not (s.IsCell sym) then None else
+                        match WordVersion.version find (s.versions) sym with
+                        | Some v -> Some (struct(sym,v))
+                        | None -> None)
+                let get sym =
+                    match s.values.TryGetValue(sym) with
+                    | true, v -> Some v
+                    | _ -> None
+                let evalCell (struct(sym,v)) =
+                    match s.memo.TryGetValue(v) with
+                    | true, r -> struct(sym, v, r, true)
+                    | _ -> struct(sym, v, s.eval d' get sym, false)
+                let results =
+                    if (cells.Length < parThresh)
+                        then Array.map evalCell cells
+                        else Array.Parallel.map evalCell cells
+                for struct(sym,v,r,hit) in results do
+                    ctDirty <- ctDirty + 1
+                    if hit then ctMemo <- ctMemo + 1
+                    else
+                        ctEval <- ctEval + 1
+                        s.memo.[v] <- r
+                    match s.values.TryGetValue(sym) with
+                    | true, r0 when (r0 = r) -> ()
+                    | _ ->
+                        s.values.[sym] <- r
+                        updates.Add(struct(sym, Some r))
+                for sym in wave do
+                    if (s.IsCell sym) && Option.isNone (find sym) && s.values.Remove(sym)
+                        then updates.Add(struct(sym, None))
+            // memo is only for recent versions; reset when it grows large
+            if (s.memo.Count > (4 * s.values.Count + 1000)) then
+                s.memo.Clear()
+                for kv in s.values do
+                    match s.versions.TryGetValue(kv.Key) with
+                    | true, v -> s.memo.[v] <- kv.Value
+                    | _ -> ()
+            sw.Stop()
+            s.stats <- { dirty = ctDirty; evals = ctEval; memoHits = ctMemo
+                         waves = List.length waves; elapsed = sw.Elapsed }
+            let result = updates.ToArray()
+            if (result.Length > 0) then
+                for fn in lock s (fun () -> s.subs) do fn result
+            result
+
+    /// Create a sheet for cells with the given prefix, e.g. `foo-`.
+    /// All cells are evaluated initially.
+    let create (eval:Eval) (prefix:Dict.Prefix) (d:Dict) : Sheet =
+        new Sheet(eval, prefix, d)
+
+type Sheet = Sheet.Sheet
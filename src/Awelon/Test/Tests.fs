@@ -2,6 +2,7 @@ module Tests
 
 open System
 open System.IO
+open System.Threading
 open Xunit
 open Stowage
 open Awelon
@@ -102,6 +103,408 @@ let ``simple dict tests`` () =
     Assert.False(has 200 d30)
     Assert.Equal(11, Seq.length (Dict.toSeq d30)) // 30,300,301,302,..309
 
+// a toy evaluator for sheets: sum of numbers, cells, and helper words.
+let sumEval (ct:int ref) (d:Dict) (get:ByteString -> ByteString option) (sym:ByteString) =
+    System.Threading.Interlocked.Increment(&ct.contents) |> ignore<int>
+    let def = (Option.get (Dict.tryFind sym d)).Data
+    let words = (BS.toString def).Split([|' '|], StringSplitOptions.RemoveEmptyEntries)
+    let value (w:string) =
+        if Char.IsDigit(w.[0]) then int w else
+        match get (BS.fromString w) with
+        | Some v -> readNat v
+        | None ->
+            match Dict.tryFind (BS.fromString w) d with
+            | Some def -> readNat (def.Data) // helper words are numbers
+            | None -> 0
+    bs (Array.sumBy value words)
+
+[<Fact>]
+let ``sheet recalculates dirty cells`` () =
+    let cell r c = sprintf "s-%d-%c" r c
+    let def (s:string) d =
+        let ix = s.IndexOf(':')
+        Dict.add (BS.fromString (s.Substring(0,ix))) (Dict.Def(BS.fromString (s.Substring(ix + 1)))) d
+    let d0 =
+        seq { for r in 1 .. 1000 do
+                yield (cell r 'a' + ":" + (if (r = 1) then "1" else cell (r - 1) 'a' + " 1"))
+                yield (cell r 'b' + ":" + cell r 'a' + " 2 helper") }
+        |> Seq.fold (flip def) (Dict.empty |> def "helper:10")
+    let ct = ref 0
+    let sheet = Sheet.create (sumEval ct) (BS.fromString "s-") d0
+    Assert.Equal(2000, !ct)
+    Assert.Equal(Some (bs 1012), sheet.Value (BS.fromString (cell 1000 'b')))
+    let pushed = ref 0
+    use sub = sheet.Subscribe(fun us -> pushed := !pushed + us.Length)
+
+    // edit near the end of the chain: only cells below are dirty
+    ct := 0
+    let upd = sheet.Edit (BS.fromString (cell 990 'a')) (Some (Dict.Def(BS.fromString (cell 989 'a' + " 2"))))
+    Assert.Equal(22, !ct)
+    Assert.Equal(22, upd.Length)
+    Assert.Equal(22, !pushed)
+    Assert.Equal(Some (bs 1013), sheet.Value (BS.fromString (cell 1000 'b')))
+
+    // a non-cell dependency invalidates its clients only
+    ct := 0
+    sheet.Edit (BS.fromString "helper") (Some (Dict.Def(BS.fromString "11"))) |> ignore
+    Assert.Equal(1000, !ct)
+    Assert.Equal(Some (bs 1014), sheet.Value (BS.fromString (cell 1000 'b')))
+
+    // undo is served from memo by deep version
+    ct := 0
+    sheet.Update d0 |> ignore
+    Assert.Equal(0, !ct)
+    Assert.Equal(1011, sheet.Stats.memoHits)
+    Assert.Equal(Some (bs 1012), sheet.Value (BS.fromString (cell 1000 'b')))
+
+    // removing a cell pushes None; clients see the missing value
+    let upd' = sheet.Edit (BS.fromString (cell 1 'b')) None
+    Assert.True(Array.contains (struct(BS.fromString (cell 1 'b'), None)) upd')
+    Assert.Equal(1999, sheet.Count)
+
+// a simple in-memory Stowage for tests without a database
+type MemStowage() =
+    let d = new System.Collections.Generic.Dictionary<ByteString,ByteString>()
+    member __.Count with get() = lock d (fun () -> d.Count)
+    interface Stowage with
+        member db.Stow v =
+            let h = RscHash.hash v
+            lock d (fun () -> d.[h] <- v)
+            h
+        member db.Load h =
+            match lock d (fun () -> d.TryGetValue(h)) with
+            | true, v -> v
+            | _ -> raise (MissingRsc (db :> Stowage, h))
+        member __.Incref _ = ()
+        member __.Decref _ = ()
+
+[<Fact>]
+let ``lazy views agree with dictionary`` () =
+    let mem = new MemStowage()
+    let rng = new System.Random(3)
+    let step d i =
+        let k = rng.Next(20000)
+        if (0 = i % 7) then remN k d else addN k d
+    // updates layered over compacted remote nodes
+    let d1 = Seq.fold step Dict.empty (seq { 1 .. 20000 }) |> Dict.compact mem
+    let d2 = Seq.fold step d1 (seq { 1 .. 2000 })
+    let d3 = Seq.fold step (Dict.compact mem d2) (seq { 1 .. 200 })
+    for d in [d1; d2; d3] do
+        let v = DictView.ofDict d
+        Assert.Equal<(ByteString * Dict.Def) list>(List.ofSeq (Dict.toSeq d), List.ofSeq (DictView.toSeq v))
+        for p in ["1"; "12"; "123"; "1234"; "9"; "99999"; "x"] do
+            let expect = Dict.extractPrefix (BS.fromString p) d |> Dict.toSeq |> List.ofSeq
+            Assert.Equal<(ByteString * Dict.Def) list>(expect, List.ofSeq (DictView.toSeq (DictView.under (BS.fromString p) v)))
+        for k in 0 .. 200 do
+            Assert.Equal(Dict.tryFind (bs k) d, DictView.tryFind (bs k) v)
+    let v3 = DictView.ofDict d3
+    let pg = DictView.page (bs 5000) 10 v3
+    Assert.Equal(10, pg.Length)
+    Assert.True(ByteString.Compare (fst pg.[0]) (bs 5000) >= 0)
+
+[<Fact>]
+let ``batch updates agree with sequential updates`` () =
+    let mem = new MemStowage()
+    let rng = new System.Random(5)
+    let d0 = Seq.fold (fun d k -> addN k d) Dict.empty (seq { 1 .. 5000 }) |> Dict.compact mem
+    let dir = match d0.pd with Some dir -> dir | None -> None
+    let ent i =
+        let k = rng.Next(10000)
+        match i % 50 with
+        | 0 -> Dict.Direct(BS.fromString (string (k % 100)), None)
+        | 1 -> Dict.Direct(BS.fromString (string (k % 100)), dir)
+        | n when (n < 15) -> Dict.Define(bs k, None)
+        | _ -> Dict.Define(bs k, Some (Dict.Def(testDefStr i)))
+    for d in [Dict.empty; d0; addN 7 d0 |> remN 123] do
+        for n in [1; 10; 100; 5000] do
+            let batch = Array.init n ent
+            let expect = Dict.applySeqEnt d batch
+            let actual = Dict.applyBatch d batch
+            Assert.Equal(Dict.write expect, Dict.write actual)
+            Assert.Equal<(ByteString * Dict.Def) list>(List.ofSeq (Dict.toSeq expect), List.ofSeq (Dict.toSeq actual))
+
+[<Fact>]
+let ``command chains resume from checkpoints`` () =
+    let mem = new MemStowage()
+    // toy evaluator: a number followed by `inc` commands.
+    let eval (_:Dict) (p:ByteString) =
+        let ws = (BS.toString p).Split([|' '|], StringSplitOptions.RemoveEmptyEntries)
+        let n = int ws.[0] + (ws |> Array.filter ((=) "inc") |> Array.length)
+        bs n
+    let cmd k = Dict.Def(BS.fromString (sprintf "foo-%d inc" (k - 1)))
+    let sym (s:string) = BS.fromString s
+    let d0 =
+        seq { 1 .. 999 }
+        |> Seq.fold (fun d k -> Dict.add (sym (sprintf "foo-%d" k)) (cmd k) d)
+            (Dict.empty |> Dict.add (sym "foo-0") (Dict.Def(BS.fromString "0")))
+        |> Dict.add (sym "foo-hd") (Dict.Def(BS.fromString "foo-999"))
+    let cp = Command.checkpoints mem eval
+    Assert.Equal(1001, (Command.chain d0 (sym "foo-hd")).Length)
+    Assert.Equal(bs 999, cp.Eval d0 (sym "foo-hd"))
+    Assert.Equal(1001, cp.Stats.steps)
+    Assert.Equal(31, cp.Stats.stowed)
+
+    // edit in the middle; resume from checkpoint before the edit
+    let d1 = Dict.add (sym "foo-500") (Dict.Def(BS.fromString "foo-499 inc inc")) d0
+    Assert.Equal(bs 1000, cp.Eval d1 (sym "foo-hd"))
+    Assert.Equal(479, cp.Stats.resumedAt)
+    Assert.Equal(521, cp.Stats.steps)
+    cp.Eval d1 (sym "foo-hd") |> ignore
+    Assert.True(cp.Stats.steps < 32)
+
+    // a fork of the original shares its checkpoints
+    let d2 = Dict.add (sym "foo-700") (Dict.Def(BS.fromString "foo-699")) d0
+    Assert.Equal(bs 998, cp.Eval d2 (sym "foo-hd"))
+    Assert.Equal(671, cp.Stats.resumedAt)
+
+let noCode : DictGC.LoadCode = fun _ -> None
+
+[<Fact>]
+let ``managed dictionary gc pass`` () =
+    let defs =
+        [ "meta-gc", "(frozen)"
+          "tmp-meta-gc", "(hidden)"
+          "x/tmp-meta-gc", "(hidden)"
+          "app-meta-gc", "(opaque)"
+          "app-main", "tmp-a [tmp-b] x/tmp-c"
+          "tmp-a", "1 2"
+          "tmp-b", "tmp-d"
+          "tmp-d", "3"
+          "x/tmp-c", "tmp-d"
+          "x/tmp-d", "4"
+          "tmp-dead", "tmp-deader"
+          "tmp-deader", "5"
+          "tmp-used", "6"
+          "other", "tmp-used" ]
+    let d = defs |> List.fold (fun d (k,v) -> Dict.add (BS.fromString k) (Dict.Def(BS.fromString v)) d) Dict.empty
+    let p = DictGC.pass DictGC.noSimplify noCode (DictRLU.ofDict d) d
+    Assert.True(DictGC.isValid d p)
+    let d' = DictGC.apply d p
+    let def s = Dict.tryFind (BS.fromString s) d' |> Option.map (fun def -> BS.toString def.Data)
+    Assert.Equal(Some "1 2 [tmp-d] x/tmp-d", def "app-main")
+    Assert.Equal(Some "6", def "tmp-used")
+    Assert.Equal(Some "3", def "tmp-d")   // still used by app-main
+    Assert.Equal(None, def "tmp-a")
+    Assert.Equal(None, def "tmp-dead")
+    Assert.Equal(None, def "tmp-deader")
+    Assert.Equal(None, def "x/tmp-c")
+    Assert.Equal(3, p.report.inlined)
+    Assert.Equal(5, p.report.deleted)
+    // a concurrent edit to a word we read invalidates the pass
+    Assert.False(DictGC.isValid (Dict.add (BS.fromString "tmp-a") (Dict.Def(BS.fromString "7")) d) p)
+    // as does a concurrent edit that adds a client of a deleted word
+    let edit k v = Dict.add (BS.fromString k) (Dict.Def(BS.fromString v)) d
+    Assert.False(DictGC.isValid (edit "other2" "tmp-deader") p)
+    Assert.False(DictGC.isValid (edit "other2" "[x/tmp-c]") p)
+    Assert.True(DictGC.isValid (edit "other2" "tmp-used") p)
+    // the next pass continues inlining
+    let p2 = DictGC.pass DictGC.noSimplify noCode (DictRLU.ofDict d') d'
+    let d'' = DictGC.apply d' p2
+    Assert.Equal(Some "1 2 [3] x/4", Dict.tryFind (BS.fromString "app-main") d'' |> Option.map (fun def -> BS.toString def.Data))
+    Assert.Equal(None, Dict.tryFind (BS.fromString "tmp-d") d'')
+
+[<Fact>]
+let ``gc keeps words used from secure hash code`` () =
+    let code = BS.fromString "tmp-x 1"
+    let h = RscHash.hash code
+    let load k = if (k = h) then Some code else None
+    let defs =
+        [ "tmp-meta-gc", "(hidden)"
+          "app", "$" + BS.toString h
+          "tmp-x", "2"
+          "tmp-y", "3"
+          "lib/tmp-meta-gc", "(hidden)"
+          "lib/app", "$" + BS.toString (RscHash.hash (BS.fromString "missing"))
+          "lib/tmp-z", "4" ]
+    let d = defs |> List.fold (fun d (k,v) -> Dict.add (BS.fromString k) (Dict.Def(BS.fromString v)) d) Dict.empty
+    let d' = DictGC.apply d (DictGC.pass DictGC.noSimplify load (DictRLU.ofDict d) d)
+    let has s = Dict.contains (BS.fromString s) d'
+    Assert.True(has "tmp-x")     // used only from $secureHash code
+    Assert.False(has "tmp-y")
+    Assert.True(has "lib/tmp-z") // code could not be loaded
+
+[<Fact>]
+let ``conformance corpus round trips`` () =
+    let dir = "conform-test"
+    clearTestDir dir
+    Conformance.generate dir 1 2000
+    Conformance.run (new MemStowage()) dir
+    let results f = File.ReadAllLines(Path.Combine(dir, "fs", f))
+    // written programs are a fixpoint for parse and write
+    let parsed = results "parse.txt"
+    Assert.Equal(2000, parsed.Length)
+    Assert.True(parsed |> Array.exists ((=) "?"))
+    for p in parsed do
+        if (p <> "?") then Assert.Equal(p, ps p)
+    Assert.Equal<string[]>(results "hash.txt", results "stow.txt") // loaded bytes match
+    // a copy of our own results agrees, barring timing
+    Directory.CreateDirectory(Path.Combine(dir, "hs")) |> ignore
+    for f in ["hash.txt"; "parse.txt"; "dict.txt"; "stow.txt"] do
+        File.Copy(Path.Combine(dir, "fs", f), Path.Combine(dir, "hs", f))
+    let rs = Conformance.compareDir dir
+    Assert.True(rs |> List.forall (fun r -> r.agree))
+    Assert.True(rs |> List.forall (fun r -> Option.isNone r.hs))
+
+[<Fact>]
+let ``code cache survives restart`` () =
+    let path = "codeCacheDB"
+    clearTestDir path
+    let kind = BS.fromString "opt"
+    let ck = BS.fromString "code"
+    let d = Dict.empty |> Dict.add (BS.fromString "foo") (Dict.Def(BS.fromString "1 2 add"))
+                       |> Dict.add (BS.fromString "bar") (Dict.Def(BS.fromString "foo foo mul"))
+    // large enough to be stowed apart from the cache index
+    let artifact (sym:ByteString) = BS.fromString ("compiled " + BS.toString sym + String('x', 1000))
+    let mutable compiles = 0
+    let compile (_:Dict) (sym:ByteString) =
+        compiles <- compiles + 1
+        artifact sym
+    let withCache compiler fn =
+        use s = new LMDB.Storage(path, 100)
+        let db = DB.fromStorage (s :> DB.Storage)
+        let c = CodeCache.load db ck (BS.fromString compiler) 10_000_000UL
+        fn c
+        c.Sync()
+    withCache "v1" (fun c ->
+        Assert.True(Option.isSome (CodeCache.compileWord c kind compile d (BS.fromString "bar")))
+        Assert.True(Option.isNone (CodeCache.compileWord c kind compile d (BS.fromString "baz")))
+        CodeCache.compileWord c kind compile d (BS.fromString "bar") |> ignore
+        Assert.Equal(1, compiles)
+        Assert.Equal(1, c.Stats.hits))
+    // after a restart, artifacts load from the durable cache
+    withCache "v1" (fun c ->
+        let a = CodeCache.compileWord c kind compile d (BS.fromString "bar")
+        Assert.Equal(1, compiles)
+        Assert.Equal(1, c.Stats.durableHits)
+        Assert.Equal(Some (artifact (BS.fromString "bar")), a))
+    // a new compiler rejects them
+    withCache "v2" (fun c ->
+        CodeCache.compileWord c kind compile d (BS.fromString "bar") |> ignore
+        Assert.Equal(2, compiles)
+        Assert.Equal(1, c.Stats.rejected))
+
+[<Fact>]
+let ``live tests rerun by version`` () =
+    let ct = ref 0
+    // toy tests: pass if the definition's numbers sum to an even value
+    let run (d:Dict) (sym:ByteString) =
+        Interlocked.Increment(&ct.contents) |> ignore<int>
+        let def = (Option.get (Dict.tryFind sym d)).Data
+        let words = (BS.toString def).Split([|' '|], StringSplitOptions.RemoveEmptyEntries)
+        let value (w:string) =
+            if Char.IsDigit(w.[0]) then int w else
+            if (w = "slow") then Thread.Sleep(1000); 0 else
+            match Dict.tryFind (BS.fromString w) d with
+            | Some def -> readNat (def.Data)
+            | None -> failwith ("undefined " + w)
+        if (0 = (Array.sumBy value words) % 2) then LiveTest.Pass else LiveTest.Fail "odd"
+    let sym (s:string) = BS.fromString s
+    let def (k:string) (v:string) d = Dict.add (sym k) (Dict.Def(BS.fromString v)) d
+    let d0 =
+        seq { 1 .. 200 }
+        |> Seq.fold (fun d i -> def (sprintf "t%d-test" i) (sprintf "x%d 2" (i % 10)) d) Dict.empty
+        |> fun d -> seq { 0 .. 9 } |> Seq.fold (fun d i -> def (sprintf "x%d" i) (string i) d) d
+    let r = new LiveTest.Runner(run, { LiveTest.defaultQuota with timeout = TimeSpan.FromMilliseconds(200.0) })
+    let s0 = r.Update d0
+    Assert.Equal(200, s0.tests)
+    Assert.Equal(100, s0.failed.Length)
+    Assert.Equal(200, !ct)
+
+    // only clients of the changed word rerun
+    ct := 0
+    let s1 = r.Update (def "x1" "2" d0)
+    Assert.Equal(20, !ct)
+    Assert.Equal(80, s1.failed.Length)
+
+    // reverting is served from memo
+    ct := 0
+    let s2 = r.Update d0
+    Assert.Equal(0, !ct)
+    Assert.Equal(20, s2.memoHits)
+    Assert.Equal(s0.failed, s2.failed)
+
+    // errors, timeouts, and deleted tests
+    let d3 = d0 |> def "bad-test" "y" |> def "slow-test" "slow" |> Dict.remove (sym "t1-test")
+    let s3 = r.Update d3
+    Assert.Equal(201, s3.tests)
+    Assert.Equal(Some (LiveTest.Fail "undefined y"), r.Result (sym "bad-test"))
+    Assert.Equal(Some (LiveTest.Fail "timeout"), r.Result (sym "slow-test"))
+    Assert.Equal(None, r.Result (sym "t1-test"))
+
+[<Fact>]
+let ``abandoned live tests count against threads`` () =
+    let gate = new ManualResetEventSlim(false)
+    let running = ref 0
+    let maxRunning = ref 0
+    let run (d:Dict) (sym:ByteString) =
+        let n = Interlocked.Increment(&running.contents)
+        lock maxRunning (fun () -> maxRunning := max n !maxRunning)
+        if (BS.toString sym).StartsWith("hang") then gate.Wait()
+        Interlocked.Decrement(&running.contents) |> ignore<int>
+        LiveTest.Pass
+    let def (k:string) d = Dict.add (BS.fromString k) (Dict.Def(BS.fromString k)) d
+    let d0 = Dict.empty |> def "hang1-test" |> def "hang2-test" |> def "hang3-test" |> def "ok-test"
+    let quota = { LiveTest.threads = 2; LiveTest.timeout = TimeSpan.FromMilliseconds(100.0) }
+    let r = new LiveTest.Runner(run, quota)
+    let s0 = r.Update d0
+    Assert.Equal(2, !maxRunning)
+    Assert.True(s0.failed.Length >= 3)
+    gate.Set()
+    SpinWait.SpinUntil((fun () -> (0 = !running)), 1000) |> ignore<bool>
+    let s1 = r.Update (def "ok2-test" d0)
+    Assert.Equal(Some LiveTest.Pass, r.Result (BS.fromString "ok2-test"))
+    Assert.Equal(Some LiveTest.Pass, r.Result (BS.fromString "hang1-test"))
+    Assert.Equal(s0.failed.Length + 1, s1.runs) // timeouts are retried
+    Assert.True(List.isEmpty s1.failed)
+    let s2 = r.Update (def "ok2-test" d0)
+    Assert.Equal(0, s2.runs)
+
+    // errors in the background loop are reported, not fatal
+    r.Start (fun () -> failwith "read failed") (TimeSpan.FromMilliseconds(10.0))
+    SpinWait.SpinUntil((fun () -> Option.isSome r.LastError), 1000) |> ignore<bool>
+    r.Stop()
+    Assert.Equal("read failed", (Option.get r.LastError).Message)
+
+[<Fact>]
+let ``evaluations are shared across forks`` () =
+    // toy evaluator: sum of numbers and linked words
+    let eval (link:EvalCache.Link) (p:ByteString) =
+        let ws = (BS.toString p).Split([|' '|], StringSplitOptions.RemoveEmptyEntries)
+        let value (w:string) =
+            if Char.IsDigit(w.[0]) then int w else
+            readNat (Option.get (link (BS.fromString w)))
+        bs (Array.sumBy value ws)
+    let sym (s:string) = BS.fromString s
+    let def (k:string) (v:string) d = Dict.add (sym k) (Dict.Def(BS.fromString v)) d
+    let chain w0 = seq { 1 .. 100 } |> Seq.fold (fun d k -> def (sprintf "w%d" k) (sprintf "w%d 1" (k - 1)) d) (def "w0" w0 Dict.empty)
+    let dA = chain "1"
+    let dB = def "w50" "w49 2" dA
+    let c = EvalCache.create (new MemStowage()) eval
+    Assert.Equal(Some (bs 101), c.Link (sym "a") dA (sym "w100"))
+    Assert.Equal(101, c.Stats.evals)
+    Assert.Equal(None, c.Link (sym "a") dA (sym "undefined"))
+
+    // the fork evaluates only the changed word and its clients
+    Assert.Equal(Some (bs 102), c.Link (sym "b") dB (sym "w100"))
+    Assert.Equal(152, c.Stats.evals)
+    Assert.Equal(1, c.Stats.crossForkHits)
+    Assert.Equal(Some (bs 101), c.Link (sym "a") dA (sym "w100"))
+    Assert.Equal(2, c.Stats.hits)
+    Assert.Equal(1, c.Stats.crossForkHits)
+    Assert.True(EvalCache.crossForkRate c.Stats > 0.0)
+
+    // background population for popular words
+    let dC = chain "5"
+    (c.Populate (sym "c") dC 200).Wait()
+    let s = c.Stats
+    Assert.Equal(Some (bs 105), c.Link (sym "c") dC (sym "w100"))
+    Assert.Equal(s.evals, c.Stats.evals)
+    Assert.Equal(s.hits + 1, c.Stats.hits)
+
+    // cycles are errors
+    let dE = def "w0" "w100" dA
+    Assert.Throws<InvalidOperationException>(fun () -> c.Link (sym "e") dE (sym "w5") |> ignore) |> ignore
+
 // a fixture is needed to load the database
 type TestDB =
     val s : LMDB.Storage
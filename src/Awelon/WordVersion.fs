@@ -10,3 +10,73 @@ namespace Awelon
 // simpler to recompute versions as needed. The cost is predictable and
 // we can still benefit from temporary caching. 
 
+//
+// Here, a version is the secure hash of a definition followed by the
+// versions of its dependencies, in order of first use. The symbol is
+// not included, so two words with the same definition in the same
+// context share a version. Undefined dependencies are written as `~`.
+//
+// Cyclic definitions are errors in Awelon, but we still need a stable
+// answer. A dependency found while its own version is in progress is
+// written as `?`. The resulting versions for words in a cycle depend
+// on where we entered the cycle.
+module WordVersion =
+    open Stowage
+    open Data.ByteString
+    open System.Collections.Generic
+
+    type Symbol = Dict.Symbol
+    type Version = RscHash
+
+    let private cUndef = byte '~'
+    let private cCycle = byte '?'
+
+    /// Compute deep version of a word, or None if undefined.
+    ///
+    /// The cache holds versions already computed for the same dictionary
+    /// and is updated with every version computed. After a dictionary
+    /// update, remove the changed words and their transitive clients
+    /// (see DictRLU.clientsClosure). Uses an explicit stack, so long
+    /// dependency chains such as command patterns are okay.
+    let version (find:Symbol -> Dict.Def option) (cache:Dictionary<Symbol,Version>) (sym:Symbol) : Version option =
+        match cache.TryGetValue(sym) with
+        | true, v -> Some v
+        | _ ->
+        match find sym with
+        | None -> None
+        | Some def0 ->
+        let active = new HashSet<Symbol>()
+        let frames = new Stack<struct(Symbol * Dict.Def * Symbol list * Symbol list)>()
+        let push s def =
+            let ds = DictRLU.defDeps s def
+            active.Add(s) |> ignore<bool>
+            frames.Push(struct(s, def, ds, ds))
+        let writeDep dst d =
+            match cache.TryGetValue(d) with
+            | true, v -> ByteStream.writeBytes v dst
+            | _ -> ByteStream.writeByte (if active.Contains(d) then cCycle else cUndef) dst
+            ByteStream.writeByte Dict.cLF dst
+        let finish s (def:Dict.Def) ds =
+            let bytes = ByteStream.write (fun dst ->
+                ByteStream.writeBytes (def.Data) dst
+                ByteStream.writeByte Dict.cLF dst
+                List.iter (writeDep dst) ds)
+            cache.[s] <- RscHash.hash bytes
+            active.Remove(s) |> ignore<bool>
+        push sym def0
+        while (frames.Count > 0) do
+            let struct(s,def,ds,pending) = frames.Pop()
+            match pending with
+            | (d::pending') ->
+                frames.Push(struct(s,def,ds,pending'))
+                if not (cache.ContainsKey(d) || active.Contains(d)) then
+                    match find d with
+                    | Some defD -> push d defD
+                    | None -> ()
+            | [] -> finish s def ds
+        Some (cache.[sym])
+
+    /// Deep version of a word in a dictionary, without a shared cache.
+    let ofDict (d:Dict) (sym:Symbol) : Version option =
+        version (fun s -> Dict.tryFind s d) (new Dictionary<Symbol,Version>()) sym
+
@@ -16,9 +16,10 @@ starts a local web server, which is mostly configured online. Arguments:
     [-p Port] bind specified port (default 3000)
     [-ip IP]  bind IP or DNS (default 127.0.0.1)
     [-dir Dir] where to store data (default wiki)
-    [-size GB] maximum database size (default 100)
+    [-size GB] initial database size, grows as needed (default 100)
     [-cache MB] space-speed tradeoff (default 100)
     [-admin]  print a temporary admin password
+    [-conform Dir] check F# against the Haskell runtime (see hs/conform)
 
 Configuration of Wikilon is managed online. Requesting an `-admin` password
 makes the admin account available until process reset. The admin can create
@@ -36,6 +37,7 @@ type Args = {
   size : int;
   cache : int;
   admin : bool;
+  conform : string option;
   bad : string list;
 }
 
@@ -47,6 +49,7 @@ let defaultArgs : Args = {
   size = 100
   cache = 100
   admin = false;
+  conform = None;
   bad = [];
 }
 
@@ -66,6 +69,7 @@ let rec procArgs xs (a : Args) : Args =
     | "-size"::(Nat n)::xs' -> procArgs xs' { a with size = n }
     | "-cache"::(Nat n)::xs' -> procArgs xs' { a with cache = n }
     | "-admin"::xs' -> procArgs xs' { a with admin = true }
+    | "-conform"::dir::xs' -> procArgs xs' { a with conform = Some dir }
     | x::xs' -> procArgs xs' {a with bad = x :: a.bad }
 
 let getEntropy (n : int) : ByteString = 
@@ -75,6 +79,22 @@ let getEntropy (n : int) : ByteString =
 
 let hashStr = Stowage.RscHash.hash >> BS.toString
 
+// Generate a corpus if necessary, run the F# side of the conformance
+// checks, and compare with the Haskell side if it has run.
+let conform (dir : string) : int =
+    let corpus = Path.Combine(dir, "programs.txt")
+    if not (File.Exists(corpus)) then Awelon.Conformance.generate dir 1 20000
+    use store = new Stowage.LMDB.Storage(Path.Combine(dir, "fs-db"), 1024)
+    Awelon.Conformance.run (store :> Stowage) dir
+    if not (Directory.Exists(Path.Combine(dir, "hs"))) then
+        printfn "Run `wikilon-conform run %s` for the Haskell side." dir
+        0
+    else
+    let results = Awelon.Conformance.compareDir dir
+    Awelon.Conformance.report results |> List.iter (printfn "%s")
+    let ok (r : Awelon.Conformance.Result) = r.agree
+    if List.forall ok results then 0 else 1
+
 let setAppWorkingDir fp =
     do Directory.CreateDirectory(fp) |> ignore
     Directory.SetCurrentDirectory(fp)
@@ -89,6 +109,7 @@ let main argv =
     if args.help then printfn "%s" helpMsg; 0 else 
     let bad = not (List.isEmpty args.bad)
     if bad then printfn "Unrecognized args (try -help): %A" args.bad; (-1) else
+    if Option.isSome args.conform then conform (Option.get args.conform) else
     do setAppWorkingDir args.home
     let adminPass =
         if not args.admin then None else
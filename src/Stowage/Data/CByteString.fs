@@ -1,4 +1,5 @@
 namespace Stowage
+open System.Runtime.CompilerServices
 open Data.ByteString
 
 /// A "compacting" ByteString.
@@ -11,25 +12,282 @@ open Data.ByteString
 /// a specialized encoder to reduce overheads and ensure the "raw"
 /// encoding is used for remote binaries (no size prefix), making
 /// structure sharing with equivalent binaries a little easier.
+///
+/// Very large binaries may instead be stowed as a rope of chunks, with
+/// content-defined boundaries, via `CByteString.stowChunked`. This is
+/// opt-in. See `Rope`.
 type CByteString = CVRef<ByteString>
 
+/// Content-Defined Chunking
+///
+/// Splits a binary at boundaries determined by a rolling hash of the
+/// content (a 'gear' hash, as in FastCDC). Boundaries depend only on
+/// nearby bytes, so an edit affects only chunks near the edit, and an
+/// edited binary will share most of its chunks with the original.
+module CDC =
+
+    /// Chunks are at least this size, except the last.
+    let minChunk = 4 * 1024
+
+    /// Chunks are at most this size.
+    let maxChunk = 256 * 1024
+
+    // a boundary where the top 16 bits are zero, so chunks average
+    // about 64kB past the minimum.
+    let private mask = 0xFFFF000000000000UL
+
+    // Fixed pseudo-random table (splitmix64). Don't change this, or
+    // new chunks won't share structure with old ones.
+    let private gear : uint64[] =
+        let arr = Array.zeroCreate 256
+        let mutable x = 0x2545F4914F6CDD1DUL
+        for ix = 0 to 255 do
+            x <- x + 0x9E3779B97F4A7C15UL
+            let z = (x ^^^ (x >>> 30)) * 0xBF58476D1CE4E5B9UL
+            let z = (z ^^^ (z >>> 27)) * 0x94D049BB133111EBUL
+            arr.[ix] <- z ^^^ (z >>> 31)
+        arr
+
+    // size of the first chunk in s
+    let private cut (s:ByteString) : int =
+        if (s.Length <= minChunk) then s.Length else
+        let lim = min (s.Length) maxChunk
+        let arr = s.UnsafeArray
+        let mutable h = 0UL
+        let mutable ix = minChunk
+        let mutable found = false
+        while (not found) && (ix < lim) do
+            h <- (h <<< 1) + gear.[int arr.[s.Offset + ix]]
+            ix <- ix + 1
+            found <- (0UL = (h &&& mask))
+        ix
+
+    /// Split a binary into content-defined chunks.
+    let chunks (s:ByteString) : ByteString[] =
+        let acc = new ResizeArray<ByteString>()
+        let mutable rem = s
+        while not (BS.isEmpty rem) do
+            let n = cut rem
+            acc.Add(BS.take n rem)
+            rem <- BS.drop n rem
+        acc.ToArray()
+
+/// A node in a chunked binary, with sizes and hashes of children. At
+/// height 1, children are chunks (raw binaries). Otherwise, children
+/// are nodes of height - 1.
+type RopeNode =
+    { height : int
+      sizes  : uint64[]
+      hashes : RscHash[]
+    }
+
+/// The root node of a rope in memory, with references that hold its
+/// children. A root is built once by `Rope.build`, which stows every
+/// chunk and inner node, or read from Stowage, so writing it only
+/// emits the node.
+type RopeRoot =
+    val Node : RopeNode
+    val private held : VRef<ByteString>[] // children, while in memory
+    new(node, held) = { Node = node; held = held }
+
+module EncRopeNode =
+    // height, count, then (size, {hash}) per child. Hashes are wrapped
+    // so they're recognized by conservative GC.
+
+    // a rope of 2^64 bytes needs fewer levels, since nodes have two or
+    // more children.
+    let private maxHeight = 64
+    let private minChildSize = int (1UL + EncRscHash.size)
+
+    let write (n:RopeNode) (dst:ByteDst) : unit =
+        EncVarNat.write (uint64 n.height) dst
+        EncVarNat.write (uint64 n.sizes.Length) dst
+        for ix = 0 to (n.sizes.Length - 1) do
+            EncVarNat.write (n.sizes.[ix]) dst
+            EncRscHash.write (n.hashes.[ix]) dst
+
+    let read (src:ByteSrc) : RopeNode =
+        let height = EncVarNat.read src
+        if ((height < 1UL) || (height > uint64 maxHeight)) then raise ByteStream.ReadError
+        // bound the count by bytes remaining before we allocate
+        let ct = EncVarNat.read src
+        if ((ct < 1UL) || (ct > uint64 (ByteStream.bytesRem src / minChildSize))) 
+            then raise ByteStream.ReadError
+        let height = int height
+        let ct = int ct
+        let sizes = Array.zeroCreate ct
+        let hashes = Array.zeroCreate ct
+        for ix = 0 to (ct - 1) do
+            sizes.[ix] <- EncVarNat.read src
+            hashes.[ix] <- EncRscHash.read src
+        { height = height; sizes = sizes; hashes = hashes }
+
+    let size (n:RopeNode) : SizeEst =
+        let szChildren = Array.sumBy (fun sz -> EncVarNat.size sz + EncRscHash.size) (n.sizes)
+        EncVarNat.size (uint64 n.height) + EncVarNat.size (uint64 n.sizes.Length) + szChildren
+
+    let codec =
+        { new Codec<RopeNode> with
+            member __.Write n dst = write n dst
+            member __.Read _ src = read src
+            member __.Compact _ n = struct(n, size n)
+        }
+
+    /// Codec for a root node. Read holds the children via VRef.
+    let rootCodec =
+        { new Codec<RopeRoot> with
+            member __.Write r dst = write (r.Node) dst
+            member __.Read db src = 
+                let n = read src
+                new RopeRoot(n, Array.map (VRef.wrap (EncBytesRaw.codec) db) (n.hashes))
+            member __.Compact _ r = struct(r, size (r.Node))
+        }
+
+/// Large binaries as a balanced tree of content-defined chunks.
+///
+/// Nodes are also split at content-defined boundaries (by hash of the
+/// child), so the tree is history independent and an edit will only
+/// rewrite the nodes on the path to its chunks. Random access reads
+/// via `slice` only load the chunks they touch.
+module Rope =
+
+    // boundary after a child with hash matching this mask, so nodes
+    // average about 32 children. Nodes are limited to 128 children.
+    let private nodeMask = 31UL
+    let private maxFanout = 128
+
+    /// Total size of the binary under a node.
+    let length (n:RopeNode) : uint64 = Array.sum (n.sizes)
+
+    let inline private loadNode (db:Stowage) (h:RscHash) : RopeNode =
+        ParseCache.load (EncRopeNode.codec) db h
+
+    let inline private copyTo (dst:byte[]) (pos:int) (s:ByteString) : unit =
+        System.Buffer.BlockCopy(s.UnsafeArray, s.Offset, dst, pos, s.Length)
+
+    /// Read `len` bytes from `offset` within the binary under a node.
+    /// Reads past the end are truncated. Loads only the chunks touched.
+    let slice (db:Stowage) (root:RopeNode) (offset:uint64) (len:int) : ByteString =
+        let total = length root
+        if (offset >= total) || (len < 1) then BS.empty else
+        let len = int (min (uint64 len) (total - offset))
+        let dst = Array.zeroCreate len
+        let stop = offset + uint64 len
+        // n starts at nodeOff within the binary
+        let rec walk (n:RopeNode) (nodeOff:uint64) : unit =
+            let mutable start = nodeOff
+            for ix = 0 to (n.sizes.Length - 1) do
+                let fin = start + n.sizes.[ix]
+                if (fin > offset) && (start < stop) then
+                    if (1 = n.height) then
+                        let c = db.Load (n.hashes.[ix])
+                        let lo = max start offset
+                        let hi = min fin stop
+                        let part = BS.take (int (hi - lo)) (BS.drop (int (lo - start)) c)
+                        copyTo dst (int (lo - offset)) part
+                    else walk (loadNode db (n.hashes.[ix])) start
+                start <- fin
+        walk root 0UL
+        BS.unsafeCreateA dst
+
+    /// Load the entire binary under a node.
+    let toBytes (db:Stowage) (root:RopeNode) : ByteString =
+        let total = length root
+        if (total > uint64 System.Int32.MaxValue)
+            then invalidOp "binary is too large to load whole; use slice"
+        slice db root 0UL (int total)
+
+    // group children into nodes at content-defined boundaries. Groups
+    // have at least two children, so each level is smaller.
+    let private group (hs:RscHash[]) : (int * int) list =
+        let mutable acc = []
+        let mutable start = 0
+        for ix = 0 to (hs.Length - 1) do
+            let ct = (ix + 1) - start
+            let cut = (ct >= maxFanout)
+                   || ((ct >= 2) && (0UL = (ByteString.Hash64 (hs.[ix]) &&& nodeMask)))
+            if cut || (ix = (hs.Length - 1)) then
+                acc <- (start, ct) :: acc
+                start <- ix + 1
+        List.rev acc
+
+    /// Stow the chunks and inner nodes of a binary, returning its root
+    /// without stowing it. This is the only step that stows chunks.
+    let build (db:Stowage) (s:ByteString) : RopeRoot =
+        let chunks = if BS.isEmpty s then [| s |] else CDC.chunks s
+        let mutable sizes = Array.map (fun (c:ByteString) -> uint64 c.Length) chunks
+        let mutable hashes = Array.map (fun c -> db.Stow c) chunks
+        let mutable height = 1
+        let mutable root = None
+        while Option.isNone root do
+            let nodes = group hashes |> Array.ofList |> Array.map (fun (ix,ct) ->
+                { height = height
+                  sizes = Array.sub sizes ix ct
+                  hashes = Array.sub hashes ix ct })
+            if (1 = nodes.Length) then root <- Some (nodes.[0]) else
+            let hs' = nodes |> Array.map (fun n -> Codec.stow (EncRopeNode.codec) db n)
+            for h in hashes do db.Decref h // now held by parent nodes
+            sizes <- Array.map length nodes
+            hashes <- hs'
+            height <- height + 1
+        let n = Option.get root
+        // the root's children keep the implicit incref from Stow
+        new RopeRoot(n, Array.map (VRef.wrap' (EncBytesRaw.codec) db) (n.hashes))
+
+    type private RopeCodec(db:Stowage) =
+        interface Codec<ByteString> with
+            member __.Write _ _ = 
+                invalidOp "a rope binary is written once, via Rope.stow"
+            member __.Read db' src = toBytes db' (EncRopeNode.read src)
+            member __.Compact _ b = struct(b, uint64 b.Length)
+        interface ParsedSize<ByteString> with
+            member __.ParsedSize b = b.Length
+
+    let private codecs = new ConditionalWeakTable<Stowage, Codec<ByteString>>()
+
+    /// Codec to load a stowed rope as its entire binary.
+    ///
+    /// Read loads the whole binary, and reports its full length to
+    /// ParseCache and LVRef caching. There is one codec per Stowage,
+    /// so parses are shared. A binary isn't rewritten as a rope on
+    /// Write, which is invalid; use `stow` or `rootCodec`.
+    let codec (db:Stowage) : Codec<ByteString> =
+        codecs.GetValue(db, fun db -> (new RopeCodec(db) :> Codec<ByteString>))
+
+    /// Stow a binary as a rope of content-defined chunks.
+    ///
+    /// Chunks shared with other stowed binaries are not duplicated in
+    /// storage, e.g. chunks of an earlier version of an edited binary.
+    let stow (db:Stowage) (s:ByteString) : VRef<ByteString> =
+        let root = build db s
+        let h = Codec.stow (EncRopeNode.rootCodec) db root
+        System.GC.KeepAlive root // children are held until root is stowed
+        VRef.wrap' (codec db) db h
+
+    /// Test whether a VRef is a rope root.
+    let isRope (vref:VRef<ByteString>) : bool =
+        match vref.Codec with
+        | :? RopeCodec -> true
+        | _ -> false
+
 module EncCByteString =
 
     // Prefix is:
     //  0 for remote
     //  EncVarNat (1 + Length) for local.
     //
-    // Suffix is: 0 for remote, nothing for local.
+    // Suffix is: 0 for remote, 1 for remote rope, nothing for local.
 
     let write (ref:CByteString) (dst:ByteDst) : unit =
         match ref with
         | Local (s,_) ->
             EncVarNat.write (1UL + uint64 s.Length) dst
             ByteStream.writeBytes s dst
-        | Remote vref -> 
+        | Remote lvref -> 
+            let vref = lvref.VRef
             EncVarNat.write (0UL) dst
             ByteStream.writeBytes (vref.ID) dst
-            ByteStream.writeByte 0uy dst
+            ByteStream.writeByte (if Rope.isRope vref then 1uy else 0uy) dst
 
     let read (db:Stowage) (src:ByteSrc) : CByteString =
         let s0 = ByteStream.bytesRem src
@@ -37,8 +295,12 @@ module EncCByteString =
         if (0UL = len) then // Remote
             let h = ByteStream.readBytes (RscHash.size) src
             let bSuffix = ByteStream.readByte src
-            if (bSuffix <> 0uy) then raise ByteStream.ReadError
-            Remote (LVRef.wrap (VRef.wrap (EncBytesRaw.codec) db h))
+            let c = 
+                match bSuffix with
+                | 0uy -> EncBytesRaw.codec
+                | 1uy -> Rope.codec db
+                | _ -> raise ByteStream.ReadError
+            Remote (LVRef.wrap (VRef.wrap c db h))
         else // Local
             let bs = ByteStream.readBytes (int (len - 1UL)) src
             let sf = ByteStream.bytesRem src
@@ -91,3 +353,40 @@ module CByteString =
         let struct(ref,_) = EncCByteString.compact thresh db (local s)
         ref
 
+    /// Construct a chunked binary directly, regardless of size. Binaries
+    /// are never chunked by `stow` or compaction; use this for binaries
+    /// that are edited or read by slice.
+    let stowChunked (db:Stowage) (s:ByteString) : CByteString =
+        Remote (LVRef.wrap (Rope.stow db s))
+
+    /// Test whether a binary is stowed as a rope of chunks.
+    let isChunked (ref:CByteString) : bool =
+        match ref with
+        | Remote lvref -> Rope.isRope (lvref.VRef)
+        | Local _ -> false
+
+    // root node of a rope
+    let private ropeRoot (vref:VRef<ByteString>) : RopeNode =
+        let n = ParseCache.load (EncRopeNode.codec) (vref.DB) (vref.ID)
+        System.GC.KeepAlive vref
+        n
+
+    /// Length of a binary. For a rope, this loads only the root node.
+    let length (ref:CByteString) : uint64 =
+        match ref with
+        | Remote lvref when Rope.isRope (lvref.VRef) -> Rope.length (ropeRoot (lvref.VRef))
+        | _ -> uint64 (BS.length (load ref))
+
+    /// Read `len` bytes from `offset`, truncated at the end. For a rope,
+    /// this loads only the chunks touched by the slice.
+    let slice (offset:uint64) (len:int) (ref:CByteString) : ByteString =
+        match ref with
+        | Remote lvref when Rope.isRope (lvref.VRef) -> 
+            let vref = lvref.VRef
+            let result = Rope.slice (vref.DB) (ropeRoot vref) offset len
+            System.GC.KeepAlive vref
+            result
+        | _ ->
+            let s = load ref
+            if (offset >= uint64 s.Length) then BS.empty else
+            BS.take len (BS.drop (int offset) s)
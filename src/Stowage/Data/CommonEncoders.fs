@@ -294,6 +294,124 @@ module EncOpt =
             member __.Compact db vOpt = compact cV db vOpt
         }
 
+/// Record codecs built directly from field accessors.
+///
+/// The encoding is a simple concatenation of fields, so it's wire
+/// compatible with EncPair, EncTriple, or EncQuad over the same field
+/// codecs. But we avoid constructing an intermediate tuple and the
+/// extra `Codec.view` indirection per field. Being inline, the field
+/// accessors and constructor are also specialized at each use site.
+///
+/// There is no codec generator for .Net records and unions. This is
+/// the closest thing: a few lines per type, with `EncUnion` below.
+module EncRecord =
+
+    /// Record of two fields.
+    let inline codec2 (cA:Codec<'A>) (getA:'R -> 'A) 
+                      (cB:Codec<'B>) (getB:'R -> 'B) 
+                      (mk:'A -> 'B -> 'R) =
+        { new Codec<'R> with
+            member __.Write r dst =
+                cA.Write (getA r) dst
+                cB.Write (getB r) dst
+            member __.Read db src =
+                let a = cA.Read db src
+                let b = cB.Read db src
+                mk a b
+            member __.Compact db r =
+                let struct(a',szA) = cA.Compact db (getA r)
+                let struct(b',szB) = cB.Compact db (getB r)
+                struct(mk a' b', (szA + szB))
+        }
+
+    /// Record of three fields.
+    let inline codec3 (cA:Codec<'A>) (getA:'R -> 'A)
+                      (cB:Codec<'B>) (getB:'R -> 'B)
+                      (cC:Codec<'C>) (getC:'R -> 'C)
+                      (mk:'A -> 'B -> 'C -> 'R) =
+        { new Codec<'R> with
+            member __.Write r dst =
+                cA.Write (getA r) dst
+                cB.Write (getB r) dst
+                cC.Write (getC r) dst
+            member __.Read db src =
+                let a = cA.Read db src
+                let b = cB.Read db src
+                let c = cC.Read db src
+                mk a b c
+            member __.Compact db r =
+                let struct(a',szA) = cA.Compact db (getA r)
+                let struct(b',szB) = cB.Compact db (getB r)
+                let struct(c',szC) = cC.Compact db (getC r)
+                struct(mk a' b' c', (szA + szB + szC))
+        }
+
+    /// Record of four fields.
+    let inline codec4 (cA:Codec<'A>) (getA:'R -> 'A)
+                      (cB:Codec<'B>) (getB:'R -> 'B)
+                      (cC:Codec<'C>) (getC:'R -> 'C)
+                      (cD:Codec<'D>) (getD:'R -> 'D)
+                      (mk:'A -> 'B -> 'C -> 'D -> 'R) =
+        { new Codec<'R> with
+            member __.Write r dst =
+                cA.Write (getA r) dst
+                cB.Write (getB r) dst
+                cC.Write (getC r) dst
+                cD.Write (getD r) dst
+            member __.Read db src =
+                let a = cA.Read db src
+                let b = cB.Read db src
+                let c = cC.Read db src
+                let d = cD.Read db src
+                mk a b c d
+            member __.Compact db r =
+                let struct(a',szA) = cA.Compact db (getA r)
+                let struct(b',szB) = cB.Compact db (getB r)
+                let struct(c',szC) = cC.Compact db (getC r)
+                let struct(d',szD) = cD.Compact db (getD r)
+                struct(mk a' b' c' d', (szA + szB + szC + szD))
+        }
+
+/// Tagged unions, encoded as a tag byte followed by the case data.
+///
+/// Each case is given as a codec for the full union type, selected
+/// by tag index. With tags 0 and 1 for None and Some, this is wire
+/// compatible with EncOpt. A case codec may assume it only sees
+/// values that `tagOf` maps to its own index.
+module EncUnion =
+
+    /// Codec for a case without data, e.g. `None`. 
+    let unit (v:'U) =
+        { new Codec<'U> with
+            member __.Write _ _ = ()
+            member __.Read _ _ = v
+            member __.Compact _ u = struct(u, 0UL)
+        }
+
+    /// Codec for a union type from a tag function and case codecs.
+    let codec (tagOf:'U -> int) (cases:Codec<'U> array) =
+        if (cases.Length > 256) then invalidArg "cases" "too many cases for a tag byte" 
+        let inline select ix = 
+            if (ix >= cases.Length) then raise ByteStream.ReadError
+            cases.[ix]
+        let tagCase u =
+            let ix = tagOf u
+            if (ix < 0) || (ix >= cases.Length) then 
+                invalidArg "u" (sprintf "union tag %d out of range for %d cases" ix cases.Length)
+            ix
+        { new Codec<'U> with
+            member __.Write u dst =
+                let ix = tagCase u
+                ByteStream.writeByte (byte ix) dst
+                cases.[ix].Write u dst
+            member __.Read db src =
+                let ix = int (ByteStream.readByte src)
+                (select ix).Read db src
+            member __.Compact db u =
+                let struct(u',szU) = cases.[tagCase u].Compact db u
+                struct(u', 1UL + szU)
+        }
+
 /// Arrays are encoded with size (as varnat) followed by every element
 /// in sequence without separators. It's assumed that the elements are
 /// distinguishable on parse and protect their own RscHash references. 
@@ -66,20 +66,160 @@ module DCache =
         }
 
 
+    let private emptyRep : StowageRep<'V> =
+        { data = LSMTrie.empty; size = 0UL; count = 0UL }
+
+    /// A durable cache of type 'V, under a key of a DB.
+    ///
+    /// The cache is rooted in a durable TVar, but we don't sync every
+    /// update with other durable DB updates. Instead, updates buffer
+    /// in memory until `Sync`, or until enough updates accumulate and
+    /// a background sync starts. Loss of recent updates is acceptable
+    /// for a cache.
+    ///
+    /// Loading is lazy: after a restart, we read only the root node,
+    /// and other nodes are loaded from Stowage as keys are accessed.
+    /// If a codec has changed or a resource is missing, the affected
+    /// keys are treated as misses and erased.
+    ///
+    /// When size exceeds quota, we erase keys matching a few random
+    /// prefixes of the mangled keys until we're below 90% of quota.
+    /// Mangled keys are base32 (see RscHash.alphabet) and uniformly
+    /// distributed, so each two-character prefix holds about 1/1024 of
+    /// our keys, and every key decays at the same rate.
+    type Cache<'V> =
+        val private db : DB
+        val private tv : TVar<StowageRep<'V> option>
+        val private cR : Codec<StowageRep<'V>>
+        val private rng : System.Random
+        val Quota : SizeEst
+        val SyncThresh : int
+        val mutable private rep : StowageRep<'V>
+        val mutable private pending : int
+        val mutable private syncing : bool
+        val private syncLock : obj
+        new(db:DB, k:ByteString, cV:Codec<'V>, quota:SizeEst) =
+            let cR = cRep cV
+            let tv = db.Register k cR
+            { db = db
+              tv = tv
+              cR = cR
+              rng = new System.Random()
+              Quota = quota
+              SyncThresh = 1000
+              rep = try defaultArg (db.Read tv) emptyRep
+                    with | ByteStream.ReadError | MissingRsc _ -> emptyRep
+              pending = 0
+              syncing = false
+              syncLock = new obj()
+            }
+
+        /// Number of keys.
+        member c.Count with get() = lock c (fun () -> c.rep.count)
+
+        /// Total of size estimates for cached values.
+        member c.Size with get() = lock c (fun () -> c.rep.size)
+
+        member private c.Erase (mk:ByteString) (sz:SizeEst) : unit =
+            c.rep <- { data = LSMTrie.remove mk (c.rep.data)
+                       size = (c.rep.size - (min sz (c.rep.size)))
+                       count = (c.rep.count - (min 1UL (c.rep.count))) }
+            c.pending <- c.pending + 1
+
+        // find, removing keys we cannot read. We don't know whether
+        // an unreadable key is present or its size, so the counters
+        // are unchanged. They're corrected if Decay resets the cache.
+        member private c.Find (mk:ByteString) : E<'V> option =
+            try LSMTrie.tryFind mk (c.rep.data)
+            with
+                | ByteStream.ReadError | MissingRsc _ ->
+                    c.rep <- { c.rep with data = LSMTrie.remove mk (c.rep.data) }
+                    c.pending <- c.pending + 1
+                    None
+
+        /// Find a cached value.
+        member c.TryFind (k:Key) : 'V option =
+            let mk = mangleKey k
+            lock c (fun () ->
+                match c.Find mk with
+                | Some (struct(_,v)) -> Some v
+                | None -> None)
+
+        /// Remove a key from the cache.
+        member c.Remove (k:Key) : unit =
+            let mk = mangleKey k
+            lock c (fun () ->
+                match c.Find mk with
+                | Some (struct(sz,_)) -> c.Erase mk sz
+                | None -> ())
+            c.SyncIfPending()
+
+        /// Add or replace a value with a memory size estimate.
+        member c.Add (k:Key) (v:'V) (sz:SizeEst) : unit =
+            let mk = mangleKey k
+            lock c (fun () ->
+                match c.Find mk with
+                | Some (struct(sz0,_)) -> c.Erase mk sz0
+                | None -> ()
+                c.rep <- { data = LSMTrie.add mk (struct(sz,v)) (c.rep.data)
+                           size = (c.rep.size + sz)
+                           count = (c.rep.count + 1UL) }
+                c.pending <- c.pending + 1
+                if (c.rep.size > c.Quota) then c.Decay())
+            c.SyncIfPending()
+
+        member private c.Decay () : unit =
+            let target = (c.Quota / 10UL) * 9UL
+            let a = RscHash.alphabet
+            let randomChar () = byte (a.[c.rng.Next(a.Length)])
+            let rec loop n =
+                if (c.rep.size <= target) || (n >= (a.Length * a.Length)) then () else
+                let p = BS.unsafeCreateA [| randomChar (); randomChar () |]
+                let ks = LSMTrie.selectPrefix p (c.rep.data) |> LSMTrie.toArray
+                for (mk, struct(sz,_)) in ks do c.Erase mk sz
+                loop (n + 1)
+            try loop 0
+            with
+                | ByteStream.ReadError | MissingRsc _ ->
+                    // an unreadable cache is simply reset
+                    c.rep <- emptyRep
+
+        // start a background sync, unless one is running. A failed
+        // sync leaves updates pending, to retry at the next update.
+        member private c.SyncIfPending () : unit =
+            let start = lock c (fun () ->
+                if c.syncing || (c.pending < c.SyncThresh) then false else
+                c.syncing <- true
+                true)
+            if start then
+                let task = System.Threading.Tasks.Task.Run(fun () ->
+                    try c.Sync()
+                    finally lock c (fun () -> c.syncing <- false))
+                ignore<System.Threading.Tasks.Task> task
+
+        /// Compact buffered updates into Stowage and write them to the
+        /// durable root, flushing the DB.
+        ///
+        /// Compaction doesn't hold the cache lock, so concurrent updates
+        /// are not blocked. Those updates remain pending for a later sync.
+        member c.Sync () : unit =
+            lock (c.syncLock) (fun () ->
+                let struct(rep,n) = lock c (fun () -> struct(c.rep, c.pending))
+                let rep' = Codec.compact (c.cR) (c.db) rep
+                lock c (fun () ->
+                    if obj.ReferenceEquals(rep, c.rep) then c.rep <- rep'
+                    c.pending <- max 0 (c.pending - n)
+                    c.db.Write (c.tv) (Some rep'))
+                c.db.Flush())
+
+    /// Open a durable cache at a DB key, with a quota in bytes.
+    let load (db:DB) (k:ByteString) (cV:Codec<'V>) (quota:SizeEst) : Cache<'V> =
+        new Cache<'V>(db, k, cV, quota)
+
     // thoughts: should I favor an LSM trie or a plain trie? A plain
     // trie has advantages of more precise size estimates, but for a
     // cache the update performance and working sets from LSM may be
     // more valuable.  
     // 
     // If I don't secure-hash keys, an IntMap based hashmap may be wise.
-    //
-    // I don't want to use a DB TVar directly because I don't want to
-    // sync every update with other durable DB updates. Instead, I might
-    // want to write after some threshold is buffered in memory, or after
-    // several seconds delay. Or some other heuristic. Loss is acceptable.
-    //
-    // An interesting point: if Codec changes, I can presumably handle
-    // this by simply erasing the keys that raised ByteStream.ReadError.
-    // So cache is highly resilient to changes in type or codec. Similar
-    // for missing a hash resource.
 
@@ -299,10 +299,12 @@ module IntMap =
         let seqInL kp n = toSeq kp n |> Seq.map (fun (k,v) -> (k, InL v))
         let seqInR kp n = toSeq kp n |> Seq.map (fun (k,v) -> (k, InR v))
 
+        // compare remote nodes by secure hash, without forcing stowage
+        // of pending nodes or loading either node.
         let inline private refEq npa npb =
             if System.Object.ReferenceEquals(npa,npb) then true else
             match (npa,npb) with
-            | (Remote ra, Remote rb) -> (ra = rb)
+            | (Remote ra, Remote rb) -> LVRef.sameRef ra rb
             | _ -> false
 
         let keyRange kp node =
@@ -316,6 +318,24 @@ module IntMap =
                 let kmax = kmin ||| cb ||| (cb - 1UL)
                 struct(kmin,kmax)
 
+        // keys from k0, skipping subtrees below k0 without loading them
+        let rec toSeqFrom k0 kp node =
+            seq {
+                let struct(kmin,kmax) = keyRange kp node
+                if (kmax < k0) then () else
+                if (kmin >= k0) then yield! toSeq kp node else
+                match node with
+                | Leaf _ -> () // kmin = kmax < k0
+                | Inner (p, b, np) ->
+                    let struct(kl,kr) = keyPrefixes kp p b
+                    let struct(l,r) = load' np
+                    yield! toSeqFrom k0 kl l
+                    yield! toSeqFrom k0 kr r
+            }
+
+        let private seqFromL k0 kp n = toSeqFrom k0 kp n |> Seq.map (fun (k,v) -> (k, InL v))
+        let private seqFromR k0 kp n = toSeqFrom k0 kp n |> Seq.map (fun (k,v) -> (k, InR v))
+
         let private nodeInRight kp node cb =
             match node with
             | Leaf (kf,_) -> testCritbit (kp ||| kf) cb
@@ -326,7 +346,8 @@ module IntMap =
 
         // reference-equality based diff, including equality for
         // stowage resources, intended to minimize observation of nodes.
-        let rec diffRef kpa na kpb nb =
+        // Only keys from k0 are observed, so we can resume a diff.
+        let rec diffRefFrom k0 kpa na kpb nb =
             // filter the most obviously equivalent nodes
             let eq = (kpa = kpb) && System.Object.ReferenceEquals(na,nb)
             if eq then Seq.empty else
@@ -334,54 +355,58 @@ module IntMap =
                 // detect non-overlapping keys to simplify code
                 let struct(ka_min,ka_max) = keyRange kpa na
                 let struct(kb_min,kb_max) = keyRange kpb nb
-                if (ka_max < kb_min) then
-                    yield! seqInL kpa na 
-                    yield! seqInR kpb nb
+                if (ka_max < k0) && (kb_max < k0) then ()
+                else if (ka_max < kb_min) then
+                    yield! seqFromL k0 kpa na 
+                    yield! seqFromR k0 kpb nb
                 else if(kb_max < ka_min) then
-                    yield! seqInR kpb nb
-                    yield! seqInL kpa na
+                    yield! seqFromR k0 kpb nb
+                    yield! seqFromL k0 kpa na
                 // otherwise handle overlapping keys
                 else 
                     match na with
                     | Leaf (_,va) ->
                         match nb with
                         | Leaf (ksb,vb) ->
-                            yield ((kpb ||| ksb), InB (va,vb))
+                            let k = (kpb ||| ksb)
+                            if (k >= k0) then yield (k, InB (va,vb))
                         | Inner (pb,bb,npb) -> 
-                            yield! diffRefSplitB kpa na kpb pb bb npb
+                            yield! diffRefSplitB k0 kpa na kpb pb bb npb
                     | Inner (pa,ba,npa) ->
                         match nb with 
                         | Leaf _ -> 
-                            yield! diffRefSplitA kpa pa ba npa kpb nb 
+                            yield! diffRefSplitA k0 kpa pa ba npa kpb nb 
                         | Inner (pb,bb,npb) ->
                             // split node with larger critbit
                             if (ba < bb) then
-                                yield! diffRefSplitB kpa na kpb pb bb npb
+                                yield! diffRefSplitB k0 kpa na kpb pb bb npb
                             else if(bb < ba) then
-                                yield! diffRefSplitA kpa pa ba npa kpb nb 
+                                yield! diffRefSplitA k0 kpa pa ba npa kpb nb 
                             else // overlap keys with same critbit.
                                 // The two paths have identical keys. 
                                 if refEq npa npb then () else
                                 let struct(kpl,kpr) = keyPrefixes kpa pa ba
                                 let struct(nal,nar) = load' npa
                                 let struct(nbl,nbr) = load' npb
-                                yield! diffRef kpl nal kpl nbl
-                                yield! diffRef kpr nar kpr nbr
+                                yield! diffRefFrom k0 kpl nal kpl nbl
+                                yield! diffRefFrom k0 kpr nar kpr nbr
             }
 
-        and private diffRefSplitB kpa na kpb pb bb npb =
+        and private diffRefSplitB k0 kpa na kpb pb bb npb =
             let struct(kbl,kbr) = keyPrefixes kpb pb bb
             let struct(nbl,nbr) = load' npb
             if nodeInRight kpa na bb
-                then Seq.append (seqInR kbl nbl) (diffRef kpa na kbr nbr)
-                else Seq.append (diffRef kpa na kbl nbl) (seqInR kbr nbr)
+                then Seq.append (seqFromR k0 kbl nbl) (diffRefFrom k0 kpa na kbr nbr)
+                else Seq.append (diffRefFrom k0 kpa na kbl nbl) (seqFromR k0 kbr nbr)
 
-        and private diffRefSplitA kpa pa ba npa kpb nb =
+        and private diffRefSplitA k0 kpa pa ba npa kpb nb =
             let struct(kal,kar) = keyPrefixes kpa pa ba
             let struct(nal,nar) = load' npa
             if nodeInRight kpb nb ba
-                then Seq.append (seqInL kal nal) (diffRef kar nar kpb nb)
-                else Seq.append (diffRef kal nal kpb nb) (seqInL kar nar)
+                then Seq.append (seqFromL k0 kal nal) (diffRefFrom k0 kar nar kpb nb)
+                else Seq.append (diffRefFrom k0 kal nal kpb nb) (seqFromL k0 kar nar)
+
+        let inline diffRef kpa na kpb nb = diffRefFrom 0UL kpa na kpb nb
 
         // monotonic key suffixes
         let private validKeySuffix b node =
@@ -521,6 +546,13 @@ module IntMap =
         | Some n -> Node.toSeq 0UL n
         | None -> Seq.empty
 
+    /// Sequence of key-value pairs with keys from k0 (ordered by key).
+    /// Subtrees with only lesser keys are not loaded.
+    let toSeqFrom (k0:Key) (t:Tree<'V>) : seq<(Key * 'V)> =
+        match t with
+        | Some n -> Node.toSeqFrom k0 0UL n
+        | None -> Seq.empty
+
     /// Sequence of key-value pairs (reverse-ordered by key)
     let toSeqR (t:Tree<'V>) : seq<(Key * 'V)> =
         match t with
@@ -545,17 +577,25 @@ module IntMap =
     ///
     /// Note: The precision for this comparison is relatively low. You will
     /// need additional filters on the resulting sequence.
-    let diffRef (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> =
+    ///
+    /// Remote nodes are compared by secure hash before loading, so equal
+    /// subtrees are skipped without loading them. The diff is limited to
+    /// keys from k0, and subtrees with only lesser keys are not loaded.
+    let diffRefFrom (k0:Key) (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> =
         match a with
         | Some na ->
             match b with
-            | Some nb -> Node.diffRef 0UL na 0UL nb
-            | None    -> Node.seqInL 0UL na 
+            | Some nb -> Node.diffRefFrom k0 0UL na 0UL nb
+            | None    -> toSeqFrom k0 a |> Seq.map (fun (k,v) -> (k, InL v))
         | None ->
             match b with
-            | Some nb -> Node.seqInR 0UL nb
+            | Some nb -> toSeqFrom k0 b |> Seq.map (fun (k,v) -> (k, InR v))
             | None    -> Seq.empty
 
+    /// Conservative diff for all keys. See diffRefFrom.
+    let diffRef (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> = 
+        diffRefFrom 0UL a b
+
     /// Diff with given equality function.
     let inline diffEq eq a b =
         let trueDiff ((ix,vdif)) =
@@ -567,6 +607,20 @@ module IntMap =
     /// Diff with value equality comparisons.
     let diff a b = diffEq (=) a b
 
+    /// Resumable diff with given equality function, continuing after
+    /// the position of an earlier cursor (or from the start for None).
+    let diffCursor (eq:'V -> 'V -> bool) (pos:Key option) (a:Tree<'V>) (b:Tree<'V>) : DiffCursor<Key,'V> =
+        let trueDiff ((_,vdif)) =
+            match vdif with
+            | InB (l,r) -> not (eq l r)
+            | _ -> true
+        let s = 
+            match pos with
+            | None -> diffRef a b
+            | Some k when (k = System.UInt64.MaxValue) -> Seq.empty
+            | Some k -> diffRefFrom (k + 1UL) a b
+        new DiffCursor<Key,'V>(Seq.filter trueDiff s, pos)
+
     // TODO: effective support for union-merge. Ideally something better
     // than just folding over a diff.
    
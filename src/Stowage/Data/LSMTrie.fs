@@ -411,9 +411,6 @@ module LSMTrie =
         }
 
 
-    let inline private seqInL t = toSeq t |> Seq.map (fun (k,v) -> (k, InL v))
-    let inline private seqInR t = toSeq t |> Seq.map (fun (k,v) -> (k, InR v))
-
     let inline private updatesAt ix (t:Tree<'V>) : Trie<'V option> =
         match IntMap.tryFind ix (t.updates) with
         | Some t -> t
@@ -427,6 +424,42 @@ module LSMTrie =
     let inline private fullChildrenAt ix (t:Tree<'V>) : Tree<'V> =
         flushUpd (updatesAt ix t) (childrenAt ix t)
 
+    // relation of keys with prefix k to a lower bound k0: all keys are
+    // below k0 (-1), all are at or above k0 (1), or k is a proper prefix
+    // of k0 (0), in which case keys with prefix k are on both sides.
+    let private boundRel (k0:Key) (k:Key) : int =
+        let n = bytesShared k k0
+        if (n = k0.Length) then 1 else
+        if (n = k.Length) then 0 else
+        if (k.[n] < k0.[n]) then -1 else 1
+
+    // child indices from ix0, from children or updates, in order. This 
+    // avoids flushing updates to children below ix0.
+    let private indicesFrom (ix0:uint64) (t:Tree<'V>) : uint64 list =
+        let cs = IntMap.toSeqFrom ix0 (t.children) |> Seq.map fst
+        let us = IntMap.toSeqFrom ix0 (t.updates) |> Seq.map fst
+        Seq.append cs us |> Seq.distinct |> Seq.sort |> List.ofSeq
+
+    // toSeq' limited to keys from k0. Skips subtrees below k0.
+    let rec private toSeqFrom' (k0:Key) (k:Key) (t:Tree<'V>) : seq<Key * 'V> =
+        match boundRel k0 k with
+        | 1 -> toSeq' k t
+        | -1 -> Seq.empty
+        | _ ->
+            seq { // value at k is below k0
+                for ix in indicesFrom (uint64 (k0.[k.Length])) t do
+                    let c = fullChildrenAt ix t
+                    if isEmpty c then () else
+                    let kc = joinBytes k (byte ix) (c.prefix)
+                    yield! toSeqFrom' k0 kc c
+            }
+
+    /// Iteration through an LSM Trie from a given key, lexicographic order.
+    let toSeqFrom (k0:Key) (t:Tree<'V>) : seq<Key * 'V> = toSeqFrom' k0 (t.prefix) t
+
+    let inline private seqFromL k0 t = toSeqFrom k0 t |> Seq.map (fun (k,v) -> (k, InL v))
+    let inline private seqFromR k0 t = toSeqFrom k0 t |> Seq.map (fun (k,v) -> (k, InR v))
+
     let private eqref a b = System.Object.ReferenceEquals(a,b)
     let private eqOpt eq a b =
         match a with
@@ -443,7 +476,8 @@ module LSMTrie =
         | _ -> true
 
     // Differences in updates are filtered aggressively, if feasible.
-    let rec diffEq' (eq : 'V -> 'V -> bool) (p:ByteString) (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> =
+    // Only keys from k0 are observed, so a diff may be resumed.
+    let rec diffEq' (eq : 'V -> 'V -> bool) (k0:Key) (p:ByteString) (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> =
         seq {
             let n = bytesShared (a.prefix) (b.prefix)
             if (n < (BS.length a.prefix)) then
@@ -452,44 +486,49 @@ module LSMTrie =
                     let a' = addPrefix p a
                     let b' = addPrefix p b
                     if (a.prefix.[n] < b.prefix.[n]) 
-                        then yield! Seq.append (seqInL a') (seqInR b')
-                        else yield! Seq.append (seqInR b') (seqInL a')
-                else yield! diffEq' eq p (splitPrefixAt n a) b // realign a
+                        then yield! Seq.append (seqFromL k0 a') (seqFromR k0 b')
+                        else yield! Seq.append (seqFromR k0 b') (seqFromL k0 a')
+                else yield! diffEq' eq k0 p (splitPrefixAt n a) b // realign a
             else if (n < (BS.length b.prefix)) then
-                yield! diffEq' eq p a (splitPrefixAt n b) // realign b
+                yield! diffEq' eq k0 p a (splitPrefixAt n b) // realign b
             else // tree keys match at current node
                 let k = BS.append p (a.prefix) 
+                let rel = boundRel k0 k
+                if (rel < 0) then () else
                 // potentially yield value at this node.
-                match a.value with
-                | None ->
-                    match b.value with
-                    | None -> ()
-                    | Some vb -> yield (k, InR vb)
-                | Some va ->
-                    match b.value with 
-                    | None -> yield (k, InL va)
-                    | Some vb ->
-                        // final memory reference comparison on Option type
-                        // final value comparison if required
-                        let skip = (eqref (a.value) (b.value)) || (eq va vb)
-                        if skip then () else
-                        yield (k, InB (va,vb))
-
-                // prescan for potential differences in child nodes.
+                if (rel > 0) then
+                    match a.value with
+                    | None ->
+                        match b.value with
+                        | None -> ()
+                        | Some vb -> yield (k, InR vb)
+                    | Some va ->
+                        match b.value with 
+                        | None -> yield (k, InL va)
+                        | Some vb ->
+                            // final memory reference comparison on Option type
+                            // final value comparison if required
+                            let skip = (eqref (a.value) (b.value)) || (eq va vb)
+                            if skip then () else
+                            yield (k, InB (va,vb))
+
+                // prescan for potential differences in child nodes. Remote
+                // IntMap nodes with equal hashes are skipped without loading.
+                let ix0 = if (rel > 0) then 0UL else uint64 (k0.[k.Length])
                 let diffAt : bool[] = Array.create 256 false
-                for ((ix,vd)) in IntMap.diffRef (a.children) (b.children) do
+                for ((ix,vd)) in IntMap.diffRefFrom ix0 (a.children) (b.children) do
                     diffAt.[int ix] <- (* diffAt.[int ix] || *) trueDiff eqref vd
-                for ((ix,vd)) in IntMap.diffRef (a.updates) (b.updates) do
+                for ((ix,vd)) in IntMap.diffRefFrom ix0 (a.updates) (b.updates) do
                     // don't compare updates if children are different
                     diffAt.[int ix] <- diffAt.[int ix] || trueDiff (eqUpd eq) vd
 
                 // yield differences
-                for ix = 0UL to 255UL do
+                for ix = ix0 to 255UL do
                     if not (diffAt.[int ix]) then () else
                     let p' = BS.snoc k (byte ix)
                     let ca = fullChildrenAt ix a
                     let cb = fullChildrenAt ix b
-                    yield! diffEq' eq p' ca cb
+                    yield! diffEq' eq k0 p' ca cb
                    
         } // end seq
 
@@ -500,9 +539,24 @@ module LSMTrie =
     /// more than once when processing pending update buffers.
     let diffEq eq a b = 
         if eqref a b then Seq.empty else
-        if isEmpty a then seqInR b else
-        if isEmpty b then seqInL a else
-        diffEq' eq (BS.empty) a b
+        if isEmpty a then toSeq b |> Seq.map (fun (k,v) -> (k, InR v)) else
+        if isEmpty b then toSeq a |> Seq.map (fun (k,v) -> (k, InL v)) else
+        diffEq' eq (BS.empty) (BS.empty) a b
+
+    /// Resumable diff with given equality function, continuing after
+    /// the position of an earlier cursor (or from the start for None).
+    /// Subtrees with only keys before the position are not loaded.
+    let diffCursor (eq:'V -> 'V -> bool) (pos:Key option) (a:Tree<'V>) (b:Tree<'V>) : DiffCursor<Key,'V> =
+        let k0 =
+            match pos with
+            | Some k -> BS.snoc k 0uy // least key after k
+            | None -> BS.empty
+        let s = 
+            if eqref a b then Seq.empty else
+            if isEmpty a then seqFromR k0 b else
+            if isEmpty b then seqFromL k0 a else
+            diffEq' eq k0 (BS.empty) a b
+        new DiffCursor<Key,'V>(s, pos)
 
     /// Difference of LSM trees based only on reference equality.
     let diffRef a b = diffEq (fun _ _ -> true) a b
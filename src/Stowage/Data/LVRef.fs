@@ -1,6 +1,14 @@
 namespace Stowage
 open Data.ByteString
 
+// forcing stowage of LVRefs without knowing their value type.
+type internal Deferred =
+    abstract member Force : unit -> unit
+
+// binaries hashed within a batch but not yet written to Stowage.
+type internal Pending =
+    abstract member TryFind : RscHash -> ByteString option
+
 /// Latent Value References
 /// 
 /// Stowage represents access to high-latency data that may be on
@@ -17,13 +25,13 @@ open Data.ByteString
 /// In context of LVRefs, the `IDisposable` interface only clears
 /// the cached data. I contemplated creating a generic interface.
 ///
-/// Note: to improve structure sharing between LVRefs, it may be
-/// useful to create a MemCache with LVRefs that are shared upon
-/// read. 
+/// Parsed values are shared between LVRefs with the same hash via
+/// ParseCache, which improves structure sharing between forks.
 type LVRef<'V> =
     val internal lvref : Lazy<VRef<'V>>
     val mutable internal cache : 'V option
     val mutable internal tc : int
+    val mutable internal batch : Pending option
     member r.VRef with get() = r.lvref.Force()
     member inline r.ID with get() = r.VRef.ID
     override r.ToString() = r.VRef.ToString()
@@ -44,7 +52,131 @@ type LVRef<'V> =
         member r.Clear() = 
             r.lvref.Force() |> ignore<VRef<'V>>
             r.cache <- None
-    internal new (lvref,cache) = { lvref = lvref; cache = cache; tc = 0 }
+    interface Deferred with
+        member r.Force() = r.lvref.Force() |> ignore<VRef<'V>>
+    internal new (lvref,cache) = { lvref = lvref; cache = cache; tc = 0; batch = None }
+
+/// Stow Batch
+///
+/// Within a batch, LVRef.stow will defer hashing and serialization
+/// until the batch is closed. LVRefs that become garbage before then
+/// are never serialized at all, and survivors are handed to Stowage
+/// as one bulk stow (see BulkStowage). This is useful for compaction
+/// of short-lived, intermediate trees.
+///
+/// The batch is associated with the current thread, via `start`, and
+/// is closed by Dispose. If an LVRef's ID is requested within the 
+/// batch, e.g. for serialization of a parent node, it's hashed but
+/// not stowed until close. So it isn't valid to Load the hash from
+/// Stowage before the batch closes. LVRef.load is fine, even if the
+/// cached value was cleared, because it reads pending binaries from
+/// the batch.
+type StowBatch =
+    val private refs    : ResizeArray<System.WeakReference>
+    val private pending : ResizeArray<struct(Stowage * ByteString * obj)>
+    val private byHash  : System.Collections.Generic.Dictionary<RscHash, ByteString>
+    val private prior   : StowBatch option
+    val mutable private closed : bool
+    val mutable private dropped : int
+    val mutable private stowed : int
+    internal new(prior) = 
+        { refs = new ResizeArray<System.WeakReference>()
+          pending = new ResizeArray<struct(Stowage * ByteString * obj)>()
+          byHash = new System.Collections.Generic.Dictionary<RscHash, ByteString>()
+          prior = prior
+          closed = false
+          dropped = 0
+          stowed = 0
+        }
+
+    /// Number of deferred LVRefs collected before the batch closed.
+    member b.Dropped with get() = b.dropped
+
+    /// Number of values written to Stowage when the batch closed.
+    member b.Stowed with get() = b.stowed
+
+    member internal b.Prior with get() = b.prior
+    member internal b.IsClosed with get() = b.closed
+
+    // track an LVRef created within the batch.
+    member internal b.Defer (r:Deferred) : unit =
+        lock b (fun () -> b.refs.Add(new System.WeakReference(r)))
+
+    // hash and serialize a value, but delay the Stowage write.
+    member internal b.Stow (c:Codec<'V>) (db:Stowage) (v:'V) : VRef<'V> =
+        let bytes = Codec.writeBytes c v
+        let ref = lock b (fun () ->
+            if b.closed then None else
+            let h = RscHash.hash bytes
+            let ref = VRef.wrap' c db h
+            b.pending.Add(struct(db, bytes, box ref))
+            b.byHash.[h] <- bytes
+            Some ref)
+        match ref with
+        | Some ref -> ref
+        | None -> VRef.wrap' c db (db.Stow bytes) // batch closed
+        
+    /// Close the batch, writing all surviving LVRefs to Stowage.
+    member b.Close() : unit =
+        let refs = lock b (fun () -> 
+            if b.closed then Array.empty else
+            b.refs.ToArray())
+        // creation order: children are hashed before their parents.
+        for w in refs do
+            match w.Target with
+            | :? Deferred as r -> r.Force()
+            | _ -> b.dropped <- (b.dropped + 1)
+        let pending = lock b (fun () ->
+            b.closed <- true
+            b.refs.Clear()
+            let p = b.pending.ToArray()
+            b.pending.Clear()
+            p)
+        let byDB = Array.groupBy (fun (struct(db,_,_)) -> db) pending
+        for (db, items) in byDB do
+            let vs = Array.map (fun (struct(_,v,_)) -> v) items
+            let hs = Stowage.stowMany db vs
+            assert(hs.Length = vs.Length)
+            b.stowed <- (b.stowed + hs.Length)
+        // pending binaries remain readable until written
+        lock b (fun () -> b.byHash.Clear())
+        // VRefs in pending are held until after the write, so their
+        // finalizers cannot Decref a resource before it's added.
+        System.GC.KeepAlive(pending)
+
+    interface System.IDisposable with
+        member b.Dispose() = b.Close()
+
+    interface Pending with
+        member b.TryFind h =
+            lock b (fun () ->
+                match b.byHash.TryGetValue(h) with
+                | true, bytes -> Some bytes
+                | _ -> None)
+
+module StowBatch =
+
+    let private active = new System.Threading.ThreadLocal<StowBatch option>(fun () -> None)
+
+    let rec private openBatch (bOpt:StowBatch option) =
+        match bOpt with
+        | Some b when b.IsClosed -> openBatch (b.Prior)
+        | _ -> bOpt
+
+    /// The innermost open batch for the current thread, if any.
+    let current () : StowBatch option = 
+        let bOpt = openBatch (active.Value)
+        active.Value <- bOpt
+        bOpt
+
+    /// Open a new batch for the current thread. Dispose to close it.
+    ///
+    /// Batches may be nested. Closing a batch returns the thread to the
+    /// prior open batch, if any.
+    let start () : StowBatch =
+        let b = new StowBatch(current ())
+        active.Value <- Some b
+        b
 
 module LVRef =
 
@@ -55,10 +187,35 @@ module LVRef =
         new LVRef<'V>(lvref, None)
         
 
+    /// The secure hash, if the value has already been stowed. Unlike
+    /// `ref.ID`, this does not force a pending stow.
+    let tryID (ref:LVRef<'V>) : RscHash option =
+        if ref.lvref.IsValueCreated then Some (ref.ID) else None
+
+    /// Test whether two LVRefs certainly refer to the same value,
+    /// without forcing stowage or loading either value. This may
+    /// return false for a pending stow with the same content.
+    let sameRef (a:LVRef<'V>) (b:LVRef<'V>) : bool =
+        if System.Object.ReferenceEquals(a,b) then true else
+        match tryID a, tryID b with
+        | Some ha, Some hb -> (ha = hb)
+        | _ -> false
+
     /// Non-buffered, immediate stowage.
     let inline stow' (cV:Codec<'V>) (db:Stowage) (v:'V) : LVRef<'V> = 
         wrap (VRef.stow cV db v)
 
+    // A batch may not have written our binary yet. Once it has, we
+    // forget the batch.
+    let private tryPending (ref:LVRef<'V>) : ByteString option =
+        match ref.batch with
+        | None -> None
+        | Some b ->
+            let h = ref.VRef.ID
+            let r = b.TryFind h
+            if Option.isNone r then ref.batch <- None
+            r
+
     /// Non-caching Load. 
     ///
     /// Will use cache opportunistically, but does not cause data
@@ -67,8 +224,11 @@ module LVRef =
     /// updated value and won't be holding onto the Ref.
     let load' (ref:LVRef<'V>) : 'V =
         match ref.cache with
-        | None -> VRef.load (ref.VRef)
         | Some v -> v
+        | None ->
+            match tryPending ref with
+            | Some bytes -> Codec.readBytes (ref.VRef.Codec) (ref.VRef.DB) bytes
+            | None -> VRef.load (ref.VRef)
 
     /// Stow a value, eventually. 
     ///
@@ -79,8 +239,17 @@ module LVRef =
     ///
     /// Any request for the VRef or ID (for serialization, comparison,
     /// or hash) will prematurely force stowage. So try to avoid that.
+    ///
+    /// Within a StowBatch, stowage is further deferred to the batch.
     let stow (c:Codec<'V>) (db:Stowage) (v:'V) (sz:SizeEst) : LVRef<'V> =
-        let ref = new LVRef<'V>(lazy (VRef.stow c db v), Some v)
+        let ref = 
+            match StowBatch.current () with
+            | None -> new LVRef<'V>(lazy (VRef.stow c db v), Some v)
+            | Some b ->
+                let ref = new LVRef<'V>(lazy (b.Stow c db v), Some v)
+                ref.batch <- Some (b :> Pending)
+                b.Defer (ref :> Deferred)
+                ref
         Cache.receive (ref :> Cached) sz
         ref
 
@@ -89,11 +258,12 @@ module LVRef =
         lock ref (fun () ->
             match ref.cache with
             | None ->
-                let bytes = vref.DB.Load (vref.ID)
-                let v = Codec.readBytes (vref.Codec) (vref.DB) bytes
+                let struct(v,sz) =
+                    match tryPending ref with
+                    | Some bytes -> struct(Codec.readBytes (vref.Codec) (vref.DB) bytes, BS.length bytes)
+                    | None -> ParseCache.load' (vref.Codec) (vref.DB) (vref.ID)
                 ref.cache <- Some v
-                let szEst = 80UL + uint64 (BS.length bytes)
-                Cache.receive (ref :> Cached) (80UL + uint64 (BS.length bytes)) 
+                Cache.receive (ref :> Cached) (80UL + uint64 sz) 
                 v
             | Some v -> v
         )
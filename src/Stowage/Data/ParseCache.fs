@@ -0,0 +1,149 @@
+namespace Stowage
+open System.Threading
+open System.Collections.Generic
+open System.Runtime.CompilerServices
+open Data.ByteString
+
+/// A codec whose parsed values are much larger than their encoding,
+/// e.g. Rope.codec, may report their size for cache accounting.
+type ParsedSize<'V> =
+    abstract member ParsedSize : 'V -> int
+
+/// Shared Parsed Value Cache
+///
+/// Two VRefs or LVRefs to the same RscHash are common for persistent
+/// data structures with structure sharing, e.g. forks of a database
+/// that share most of their nodes. Without sharing, each reference
+/// would load and parse its own copy of the value.
+///
+/// This module shares parsed values by secure hash. Values are held
+/// weakly, so the cache only tracks values that are held elsewhere,
+/// e.g. by an LVRef's cache. Tables are specific to a Codec and a
+/// Stowage instance (by object identity), since parsed values may
+/// contain VRefs bound to the Stowage, and different codecs would
+/// interpret the same binary differently.
+///
+/// Parsing is single-flight: concurrent loads for the same hash will
+/// wait on a single parse rather than racing to parse the data.
+///
+/// Note: struct values are boxed for the weak reference, so they are
+/// effectively not shared. Values shared this way must be treated as
+/// immutable, which is normal for values in Stowage.
+module ParseCache =
+
+    // A completed parse, held weakly.
+    [<AllowNullLiteral>]
+    type private Parsed =
+        val Value : System.WeakReference
+        val Size : int
+        new(v:obj,sz:int) = { Value = System.WeakReference(v); Size = sz }
+
+    // Per codec and stowage table. Entries are either a Parsed value
+    // or a Lazy parse in progress (held strongly until complete).
+    type private Table =
+        val D : Dictionary<RscHash,obj>
+        val mutable SweepAt : int
+        val mutable Hits : int64
+        val mutable Parses : int64
+        new() = { D = new Dictionary<RscHash,obj>(); SweepAt = 1000; Hits = 0L; Parses = 0L }
+
+    let private tables = new ConditionalWeakTable<obj, ConditionalWeakTable<obj,Table>>()
+
+    let private getTable (c:obj) (db:obj) : Table =
+        let byDB = tables.GetValue(c, fun _ -> new ConditionalWeakTable<obj,Table>())
+        byDB.GetValue(db, fun _ -> new Table())
+
+    // remove collected entries, amortized by doubling the threshold.
+    let private sweep (t:Table) : unit =
+        if (t.D.Count < t.SweepAt) then () else
+        let dead = new ResizeArray<RscHash>()
+        for kv in t.D do
+            match kv.Value with
+            | :? Parsed as p when not p.Value.IsAlive -> dead.Add(kv.Key)
+            | _ -> ()
+        for h in dead do
+            t.D.Remove(h) |> ignore<bool>
+        t.SweepAt <- max 1000 (2 * t.D.Count)
+
+    let mutable private hitCt : int64 = 0L
+    let mutable private parseCt : int64 = 0L
+
+    /// Cache statistics.
+    ///
+    /// hits: loads served by a value already parsed (or in progress)
+    /// parses: loads that had to read and parse the binary
+    [<Struct>]
+    type Stats =
+        { hits   : int64
+          parses : int64
+        }
+
+    /// Global statistics for the parse cache.
+    let stats () : Stats =
+        { hits = Interlocked.Read(&hitCt)
+          parses = Interlocked.Read(&parseCt)
+        }
+
+    /// Statistics for one codec and stowage. Unlike the global stats,
+    /// these aren't affected by concurrent use of other codecs.
+    let tableStats (c:Codec<'V>) (db:Stowage) : Stats =
+        let t = getTable (box c) (box db)
+        { hits = Interlocked.Read(&t.Hits)
+          parses = Interlocked.Read(&t.Parses)
+        }
+
+    /// Load and parse a value, or share a value parsed earlier.
+    ///
+    /// Returns the value with the size of its serialized binary.
+    let load' (c:Codec<'V>) (db:Stowage) (h:RscHash) : struct('V * int) =
+        let t = getTable (box c) (box db)
+        let h = BS.trimBytes h // don't hold a larger buffer in our keys
+        let inline hit v sz =
+            Interlocked.Increment(&hitCt) |> ignore<int64>
+            Interlocked.Increment(&t.Hits) |> ignore<int64>
+            Choice1Of2 (struct(v,sz))
+        let inline parse () =
+            let lz = lazy (
+                let bytes = db.Load h
+                Interlocked.Increment(&parseCt) |> ignore<int64>
+                Interlocked.Increment(&t.Parses) |> ignore<int64>
+                let v = Codec.readBytes c db bytes
+                let sz = 
+                    match box c with
+                    | :? ParsedSize<'V> as p -> p.ParsedSize v
+                    | _ -> BS.length bytes
+                struct(v, sz))
+            t.D.[h] <- box lz
+            Choice2Of2 (struct(lz,true))
+        let r = lock t (fun () ->
+            match t.D.TryGetValue(h) with
+            | true, (:? Parsed as p) ->
+                match p.Value.Target with
+                | :? 'V as v -> hit v (p.Size)
+                | _ -> parse ()
+            | true, (:? Lazy<struct('V * int)> as lz) ->
+                Interlocked.Increment(&hitCt) |> ignore<int64>
+                Interlocked.Increment(&t.Hits) |> ignore<int64>
+                Choice2Of2 (struct(lz,false))
+            | _ ->
+                sweep t
+                parse ())
+        match r with
+        | Choice1Of2 result -> result
+        | Choice2Of2 (struct(lz,owner)) ->
+            if not owner then lz.Force() else
+            try
+                let struct(v,sz) = lz.Force()
+                lock t (fun () -> t.D.[h] <- box (new Parsed(box v, sz)))
+                struct(v,sz)
+            with
+            | _ ->
+                // don't cache failures, e.g. MissingRsc
+                lock t (fun () -> t.D.Remove(h) |> ignore<bool>)
+                reraise ()
+
+    /// Load and parse a value, or share a value parsed earlier.
+    let inline load (c:Codec<'V>) (db:Stowage) (h:RscHash) : 'V =
+        let struct(v,_) = load' c db h
+        v
+
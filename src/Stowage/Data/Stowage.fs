@@ -60,8 +60,22 @@ type Stowage =
 /// Exception on Load failure.
 exception MissingRsc of Stowage * RscHash 
 
-// TODO: Develop a useful set of Stowage combinators. (Low Priority.)
-//  layered, cached, mirrored, distributed hashtables...
+/// Optional interface for Stowage that can add many values at once.
+///
+/// This should be equivalent to a Stow per value, in order, but may
+/// amortize synchronization overheads over the batch.
+type BulkStowage =
+    inherit Stowage
+    abstract member StowMany : ByteString[] -> RscHash[]
+
+/// Optional interface for Stowage that can test whether a resource is
+/// present without loading it.
+type ContainsStowage =
+    inherit Stowage
+    abstract member Contains : RscHash -> bool
+
+// Note: layered and cached Stowage combinators are in StowageLayer.
+// TODO: mirrored, distributed hashtables... (Low Priority.)
 
 module Stowage =
 
@@ -86,6 +100,22 @@ module Stowage =
             Some((rsc,data),struct(hist',rs'))
         | [] -> None
 
+    /// Stow many values, in bulk if the Stowage supports it.
+    let stowMany (db:Stowage) (vs:ByteString[]) : RscHash[] =
+        match db with
+        | :? BulkStowage as bulk -> bulk.StowMany vs
+        | _ -> Array.map (fun v -> db.Stow v) vs
+
+    /// Test whether a resource is present, without loading it if the
+    /// Stowage supports that.
+    let contains (db:Stowage) (h:RscHash) : bool =
+        match db with
+        | :? ContainsStowage as c -> c.Contains h
+        | _ ->
+            try db.Load h |> ignore<ByteString>; true
+            with
+            | MissingRsc _ -> false
+
     /// Stream all Stowage data from a given set of roots. This is
     /// mostly intended for import/export operations. Missing entries
     /// are possible due to Stowage state or false positives (we use
@@ -0,0 +1,340 @@
+namespace Stowage
+open System.Threading
+open System.Collections.Generic
+open Data.ByteString
+
+/// Layered Stowage
+///
+/// Composable Stowage implementations, for keeping hot resources in
+/// memory or a fast database and archiving cold resources to cheaper
+/// storage without changing client code. Each layer has counters for
+/// hits, misses, and the time spent loading from lower layers.
+module StowageLayer =
+
+    /// Snapshot of a layer's counters.
+    ///
+    /// hits: loads served by this layer or its fast tier
+    /// misses: loads passed to the lower (or slower) tier
+    /// missTime: total time spent loading from the lower tier
+    /// untracked: decrefs of resources the layer doesn't track
+    [<Struct>]
+    type Stats =
+        { hits      : int64
+          misses    : int64
+          missTime  : System.TimeSpan
+          untracked : int64
+        }
+
+    /// Thread-safe hit and latency counters for a layer.
+    type Counters =
+        val mutable private hitCt  : int64
+        val mutable private missCt : int64
+        val mutable private ticks  : int64
+        val mutable private untrackedCt : int64
+        new() = { hitCt = 0L; missCt = 0L; ticks = 0L; untrackedCt = 0L }
+        member c.Hit() = Interlocked.Increment(&c.hitCt) |> ignore<int64>
+        member c.Miss (sw:System.Diagnostics.Stopwatch) =
+            Interlocked.Increment(&c.missCt) |> ignore<int64>
+            Interlocked.Add(&c.ticks, sw.Elapsed.Ticks) |> ignore<int64>
+        member c.Untracked() = Interlocked.Increment(&c.untrackedCt) |> ignore<int64>
+        member c.Stats() : Stats =
+            { hits = Interlocked.Read(&c.hitCt)
+              misses = Interlocked.Read(&c.missCt)
+              missTime = System.TimeSpan.FromTicks(Interlocked.Read(&c.ticks))
+              untracked = Interlocked.Read(&c.untrackedCt)
+            }
+
+    // load from a lower layer, recording a miss and its latency.
+    let inline private timedLoad (c:Counters) (db:Stowage) (h:RscHash) : ByteString =
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        try db.Load h
+        finally c.Miss sw
+
+    /// In-memory LRU cache of resource bytes, in front of another
+    /// Stowage. Stow writes through to the lower layer, but the new
+    /// resource is also held in memory because it is likely to be
+    /// loaded again soon. Reference counts are simply forwarded.
+    type LRU =
+        val private back  : Stowage
+        val private quota : int64
+        val mutable private size : int64
+        val private order : LinkedList<struct(RscHash * ByteString)>
+        val private table : Dictionary<RscHash, LinkedListNode<struct(RscHash * ByteString)>>
+        val Counters : Counters
+        new(back:Stowage, quotaBytes:int64) =
+            { back = back
+              quota = quotaBytes
+              size = 0L
+              order = new LinkedList<struct(RscHash * ByteString)>()
+              table = new Dictionary<RscHash, LinkedListNode<struct(RscHash * ByteString)>>()
+              Counters = new Counters()
+            }
+
+        // assumes lock is held
+        member private m.Evict() : unit =
+            while ((m.size > m.quota) && (m.order.Count > 0)) do
+                let struct(h,v) = m.order.Last.Value
+                m.order.RemoveLast()
+                m.table.Remove(h) |> ignore<bool>
+                m.size <- m.size - int64 (RscHash.size + v.Length)
+
+        member private m.Add (h:RscHash) (v:ByteString) : unit =
+            let h = BS.trimBytes h
+            let v = BS.trimBytes v
+            lock m (fun () ->
+                if m.table.ContainsKey(h) then () else
+                m.table.Add(h, m.order.AddFirst(struct(h,v)))
+                m.size <- m.size + int64 (RscHash.size + v.Length)
+                m.Evict())
+
+        member private m.TryFind (h:RscHash) : ByteString option =
+            lock m (fun () ->
+                match m.table.TryGetValue(h) with
+                | true, node ->
+                    m.order.Remove(node)
+                    m.order.AddFirst(node)
+                    let struct(_,v) = node.Value
+                    Some v
+                | _ -> None)
+
+        /// Current bytes held in memory, including hashes.
+        member m.Size with get() = lock m (fun () -> m.size)
+
+        /// Drop all cached resources.
+        member m.Clear() : unit =
+            lock m (fun () ->
+                m.order.Clear()
+                m.table.Clear()
+                m.size <- 0L)
+
+        interface Stowage with
+            member m.Stow v =
+                let h = m.back.Stow v
+                m.Add h v
+                h
+            member m.Load h =
+                match m.TryFind h with
+                | Some v -> m.Counters.Hit(); v
+                | None ->
+                    let v = timedLoad (m.Counters) (m.back) h
+                    m.Add h v
+                    v
+            member m.Incref h = m.back.Incref h
+            member m.Decref h = m.back.Decref h
+
+        interface ContainsStowage with
+            member m.Contains h =
+                lock m (fun () -> m.table.ContainsKey(h)) || Stowage.contains (m.back) h
+
+    /// Read-through to a read-only archive, e.g. a pack store.
+    ///
+    /// All writes and reference counts go to the primary Stowage. If
+    /// a resource is missing from the primary, we'll try the archive.
+    /// The archive is never written and is assumed to hold its data
+    /// independently from our reference counts.
+    type ReadThrough =
+        val private primary : Stowage
+        val private archive : Stowage
+        val Counters : Counters
+        new(primary:Stowage, archive:Stowage) =
+            { primary = primary
+              archive = archive
+              Counters = new Counters()
+            }
+        interface Stowage with
+            member s.Stow v = s.primary.Stow v
+            member s.Load h =
+                let vOpt =
+                    try Some (s.primary.Load h)
+                    with
+                    | MissingRsc _ -> None
+                match vOpt with
+                | Some v -> s.Counters.Hit(); v
+                | None ->
+                    try timedLoad (s.Counters) (s.archive) h
+                    with
+                    | MissingRsc _ -> raise (MissingRsc (s :> Stowage, h))
+            member s.Incref h = s.primary.Incref h
+            member s.Decref h = s.primary.Decref h
+
+    // A resource tracked by the write-behind layer. The layer holds
+    // exactly one reference in the 'home' tier while rc > 0.
+    type private Rsc =
+        val mutable rc   : int
+        val mutable fast : bool    // home tier
+        val mutable used : int64   // last stow or load (ticks)
+        new(fast,used) = { rc = 0; fast = fast; used = used }
+
+    /// Write-behind tiered Stowage.
+    ///
+    /// New resources are written to a fast tier. Resources that have
+    /// not been stowed or loaded for a while are migrated to the slow
+    /// tier via `Migrate`. Loads search the fast tier first.
+    ///
+    /// Reference counts are held by this layer, such that each tier
+    /// only sees one reference per resource, from its home tier. The
+    /// slow tier should be an archive that keeps data at least while
+    /// referenced, and ideally independently of GC in the fast tier.
+    /// Like other Stowage, it must also keep the dependencies of the
+    /// resources it holds: migration copies every resource reachable
+    /// from a migrated resource that the slow tier doesn't have, then
+    /// leaves them to be held by their parents.
+    type WriteBehind =
+        val private fastTier : Stowage
+        val private slowTier : Stowage
+        val private rscs : Dictionary<RscHash, Rsc>
+        val Counters : Counters
+        new(fast:Stowage, slow:Stowage) =
+            { fastTier = fast
+              slowTier = slow
+              rscs = new Dictionary<RscHash, Rsc>()
+              Counters = new Counters()
+            }
+
+        static member private Now() = System.DateTime.UtcNow.Ticks
+
+        member private s.Touch (h:RscHash) : unit =
+            lock (s.rscs) (fun () ->
+                match s.rscs.TryGetValue(h) with
+                | true, r -> r.used <- WriteBehind.Now()
+                | _ -> ())
+
+        member private s.TryLoad (db:Stowage) (h:RscHash) : ByteString option =
+            try Some (db.Load h)
+            with
+            | MissingRsc _ -> None
+
+        // Copy resources reachable from `v` to the slow tier, skipping
+        // those it already has, whose dependencies are also present.
+        // Children are stowed before parents. Each copy holds a
+        // reference in `copied`, to release after `v` is stowed.
+        //
+        // We use an explicit stack, since dependency chains may be
+        // deep. An entry with data is a pending copy, pushed below
+        // the visits to its dependencies.
+        member private s.CopyDeps (v:ByteString) (copied:ResizeArray<RscHash>) : unit =
+            let visited = new HashSet<RscHash>()
+            let stack = new Stack<struct(RscHash * ByteString option)>()
+            let visit h = stack.Push(struct(BS.trimBytes h, None))
+            RscHash.iterHashDeps visit v
+            while (stack.Count > 0) do
+                match stack.Pop() with
+                | struct(h, Some dv) ->
+                    s.slowTier.Stow dv |> ignore<RscHash>
+                    copied.Add(h)
+                | struct(h, None) ->
+                    if visited.Add(h) && not (Stowage.contains (s.slowTier) h) then
+                        match s.TryLoad (s.fastTier) h with
+                        | None -> () // neither tier has it
+                        | Some dv ->
+                            stack.Push(struct(h, Some dv))
+                            RscHash.iterHashDeps visit dv
+
+        /// Migrate resources unused for the given age to the slow tier,
+        /// with any dependencies the slow tier lacks. Returns number of
+        /// tracked resources migrated.
+        member s.Migrate (age:System.TimeSpan) : int =
+            let tCold = WriteBehind.Now() - age.Ticks
+            let cold = lock (s.rscs) (fun () ->
+                s.rscs
+                    |> Seq.filter (fun kv -> kv.Value.fast && (kv.Value.used < tCold))
+                    |> Seq.map (fun kv -> kv.Key)
+                    |> Array.ofSeq)
+            let mutable ct = 0
+            for h in cold do
+                match s.TryLoad (s.fastTier) h with
+                | None -> ()
+                | Some v ->
+                    let copied = new ResizeArray<RscHash>()
+                    s.CopyDeps v copied
+                    let hSlow = s.slowTier.Stow v // one ref in slow tier
+                    assert(hSlow = h)
+                    for hDep in copied do s.slowTier.Decref hDep
+                    let moved = lock (s.rscs) (fun () ->
+                        match s.rscs.TryGetValue(h) with
+                        | true, r when (r.fast && (r.used < tCold) && (r.rc > 0)) ->
+                            r.fast <- false
+                            true
+                        | _ -> false)
+                    if moved
+                        then s.fastTier.Decref h; ct <- (ct + 1)
+                        else s.slowTier.Decref h
+            ct
+
+        /// Number of resources tracked by the layer (fast, slow).
+        member s.Count with get() =
+            lock (s.rscs) (fun () ->
+                let fast = s.rscs.Values |> Seq.filter (fun r -> r.fast) |> Seq.length
+                struct(fast, s.rscs.Count - fast))
+
+        interface Stowage with
+            member s.Stow v =
+                let h = BS.trimBytes (s.fastTier.Stow v)
+                let extra = lock (s.rscs) (fun () ->
+                    match s.rscs.TryGetValue(h) with
+                    | true, r ->
+                        r.rc <- (r.rc + 1)
+                        r.used <- WriteBehind.Now()
+                        true // tier already holds our reference
+                    | _ ->
+                        let r = new Rsc(true, WriteBehind.Now())
+                        r.rc <- 1
+                        s.rscs.Add(h, r)
+                        false)
+                if extra then s.fastTier.Decref h
+                h
+            member s.Load h =
+                let vOpt =
+                    try Some (s.fastTier.Load h)
+                    with
+                    | MissingRsc _ -> None
+                match vOpt with
+                | Some v -> s.Counters.Hit(); s.Touch h; v
+                | None ->
+                    try timedLoad (s.Counters) (s.slowTier) h
+                    with
+                    | MissingRsc _ -> raise (MissingRsc (s :> Stowage, h))
+            member s.Incref h =
+                let h = BS.trimBytes h
+                let fwd = lock (s.rscs) (fun () ->
+                    match s.rscs.TryGetValue(h) with
+                    | true, r ->
+                        r.rc <- (r.rc + 1)
+                        false
+                    | _ ->
+                        // not stowed via this layer; assume fast tier.
+                        let r = new Rsc(true, WriteBehind.Now())
+                        r.rc <- 1
+                        s.rscs.Add(h, r)
+                        true)
+                if fwd then s.fastTier.Incref h
+            member s.Decref h =
+                let release = lock (s.rscs) (fun () ->
+                    match s.rscs.TryGetValue(h) with
+                    | true, r ->
+                        r.rc <- (r.rc - 1)
+                        if (r.rc > 0) then None else
+                        s.rscs.Remove(h) |> ignore<bool>
+                        Some (r.fast)
+                    | _ -> 
+                        // Decref may run from VRef finalizers, where an
+                        // exception would crash the process. Count it.
+                        s.Counters.Untracked()
+                        None)
+                match release with
+                | Some true -> s.fastTier.Decref h
+                | Some false -> s.slowTier.Decref h
+                | None -> ()
+
+    /// In-memory LRU layer, with quota in bytes.
+    let lru (quotaBytes:int64) (back:Stowage) : LRU =
+        new LRU(back, quotaBytes)
+
+    /// Read-through to a read-only archive.
+    let readThrough (archive:Stowage) (primary:Stowage) : ReadThrough =
+        new ReadThrough(primary, archive)
+
+    /// Write-behind fast tier, migrating to slow tier.
+    let writeBehind (slow:Stowage) (fast:Stowage) : WriteBehind =
+        new WriteBehind(fast, slow)
+
@@ -0,0 +1,264 @@
+namespace Stowage
+open System.IO
+open System.Collections.Generic
+open Data.ByteString
+
+/// Have/Want synchronization of Stowage between two stores.
+///
+/// Because Stowage is content-addressed, we can replicate a value by
+/// its root hashes. The receiver walks the resource graph top-down,
+/// and requests only resources it lacks. If the receiver already has
+/// a resource, it's assumed to have everything reachable from it, so
+/// that entire subtree is pruned. For a dictionary, an unchanged node
+/// such as `/prefix secureHash` is thus never transferred. To keep this
+/// assumption valid when a session is aborted, received resources are
+/// written bottom-up: a resource is stowed only after its children.
+///
+/// The protocol works over any pair of byte streams, e.g. a socket or
+/// pipes. Messages are framed as (tag:1)(size:4)(payload):
+///
+///     'R' roots: count, hashes        (sender to receiver)
+///     'W' want: count, hashes         (receiver to sender)
+///     'D' data: count, (0 | 1 bytes)  (sender to receiver, per want)
+///     'E' end                         (receiver to sender)
+///
+/// Wants are batched, and the receiver will pipeline several batches
+/// before awaiting replies to hide latency. Dependencies are found by
+/// conservative scan for hashes (RscHash.iterHashDeps), so a false
+/// reference is simply reported missing by the sender.
+module Sync =
+
+    let private tRoots = byte 'R'
+    let private tWant = byte 'W'
+    let private tData = byte 'D'
+    let private tEnd = byte 'E'
+
+    /// Hashes per want batch.
+    let defaultBatch = 100
+
+    /// Want batches in flight before awaiting data. The stream from
+    /// receiver to sender should buffer (window * batch * 70) bytes,
+    /// since the receiver writes wants before reading any data.
+    let defaultWindow = 4
+
+    /// Largest frame accepted from the wire. 
+    let maxFrameSize = (1 <<< 28)
+
+    /// Statistics for one side of a sync session.
+    ///
+    /// bytesSent, bytesRecv: bytes written to or read from streams
+    /// rscCount, rscBytes: resources transferred and their total size
+    /// wantCount: hashes requested
+    type Stats =
+        { bytesSent : int64
+          bytesRecv : int64
+          rscCount  : int64
+          rscBytes  : int64
+          wantCount : int64
+        }
+
+    exception ProtocolError of string
+
+    // session state for counting bytes on the streams
+    type private Chan =
+        val Inp : Stream
+        val Out : Stream
+        val mutable Sent : int64
+        val mutable Recv : int64
+        new(inp,out) = { Inp = inp; Out = out; Sent = 0L; Recv = 0L }
+
+    let private writeFrame (c:Chan) (tag:byte) (payload:ByteString) : unit =
+        let hdr = Array.zeroCreate 5
+        hdr.[0] <- tag
+        let len = payload.Length
+        for ix = 0 to 3 do
+            hdr.[1 + ix] <- byte (len >>> (8 * ix))
+        c.Out.Write(hdr, 0, hdr.Length)
+        c.Out.Write(payload.UnsafeArray, payload.Offset, payload.Length)
+        c.Sent <- c.Sent + int64 (hdr.Length + len)
+
+    let private readFully (c:Chan) (len:int) : byte[] =
+        let arr = Array.zeroCreate len
+        let rec loop pos =
+            if (pos = len) then () else
+            let n = c.Inp.Read(arr, pos, len - pos)
+            if (0 = n) then raise (ProtocolError "unexpected end of stream")
+            loop (pos + n)
+        loop 0
+        c.Recv <- c.Recv + int64 len
+        arr
+
+    let private readFrame (c:Chan) : struct(byte * ByteString) =
+        let hdr = readFully c 5
+        let mutable len = 0
+        for ix = 3 downto 0 do
+            len <- (len <<< 8) ||| int (hdr.[1 + ix])
+        if ((len < 0) || (len > maxFrameSize)) then raise ByteStream.ReadError
+        struct(hdr.[0], BS.unsafeCreateA (readFully c len))
+
+    let private expectFrame (c:Chan) (tag:byte) : ByteString =
+        let struct(t,payload) = readFrame c
+        if (t <> tag) then raise (ProtocolError (sprintf "unexpected message %c" (char t)))
+        payload
+
+    let private encHashes (hs:RscHash[]) : ByteString =
+        ByteStream.write (fun dst ->
+            EncVarNat.write (uint64 hs.Length) dst
+            for h in hs do ByteStream.writeBytes h dst)
+
+    // read a count or length, bounded by the bytes remaining given a
+    // minimum size per element.
+    let private readCount (minSize:int) (src:ByteSrc) : int =
+        let n = EncVarNat.read src
+        if (n > uint64 (ByteStream.bytesRem src / minSize)) 
+            then raise ByteStream.ReadError
+        int n
+
+    let private cBytes =
+        { new Codec<ByteString> with
+            member __.Write b dst = EncBytes.write b dst
+            member __.Read _ src = ByteStream.readBytes (readCount 1 src) src
+            member __.Compact _ b = struct(b, EncBytes.size b)
+        }
+
+    let private decHashes (b:ByteString) : RscHash[] =
+        ByteStream.read (fun src ->
+            let ct = readCount (RscHash.size) src
+            Array.init ct (fun _ -> ByteStream.readBytes (RscHash.size) src)) b
+
+    let private encData (vs:ByteString option[]) : ByteString =
+        ByteStream.write (fun dst ->
+            EncVarNat.write (uint64 vs.Length) dst
+            for v in vs do EncOpt.write cBytes v dst)
+
+    let private decData (b:ByteString) : ByteString option[] =
+        ByteStream.read (fun src ->
+            let ct = readCount 1 src
+            Array.init ct (fun _ -> EncOpt.read cBytes Unchecked.defaultof<Stowage> src)) b
+
+    let private tryLoad (db:Stowage) (h:RscHash) : ByteString option =
+        try Some (db.Load h)
+        with
+        | MissingRsc _ -> None
+
+    // A received resource waiting for its dependencies to be present.
+    type private Node =
+        val Hash : RscHash
+        val Data : ByteString
+        val mutable Wait : int
+        new(h,v) = { Hash = h; Data = v; Wait = 0 }
+
+    /// Serve resources from the given roots until the receiver ends
+    /// the session. Roots should be held (increfed) by the caller.
+    let send (db:Stowage) (roots:RscHash list) (inp:Stream) (out:Stream) : Stats =
+        let c = new Chan(inp,out)
+        let mutable rscCount = 0L
+        let mutable rscBytes = 0L
+        let mutable wantCount = 0L
+        writeFrame c tRoots (encHashes (Array.ofList roots))
+        out.Flush()
+        let rec loop () =
+            let struct(t,payload) = readFrame c
+            if (t = tEnd) then () else
+            if (t <> tWant) then raise (ProtocolError "expecting want or end")
+            let hs = decHashes payload
+            wantCount <- wantCount + int64 hs.Length
+            let vs = Array.map (tryLoad db) hs
+            for v in vs do
+                match v with
+                | Some b ->
+                    rscCount <- rscCount + 1L
+                    rscBytes <- rscBytes + int64 b.Length
+                | None -> ()
+            writeFrame c tData (encData vs)
+            out.Flush()
+            loop ()
+        loop ()
+        { bytesSent = c.Sent; bytesRecv = c.Recv
+          rscCount = rscCount; rscBytes = rscBytes; wantCount = wantCount }
+
+    /// Receive resources from a sender until everything reachable from
+    /// the sender's roots is available in the local Stowage.
+    ///
+    /// Resources are held in memory until their dependencies are stowed,
+    /// then stowed themselves. So if the session fails, the local Stowage
+    /// never holds a resource that lacks part of its subtree.
+    ///
+    /// Returns the roots, which are increfed for the caller, e.g. to be
+    /// wrapped by VRef.wrap'. Other received resources are not held, so
+    /// they should be rooted (e.g. by writing the roots to a DB) before
+    /// a storage GC. Resources missing at the sender are skipped.
+    let receive' (batch:int) (window:int) (db:Stowage) (inp:Stream) (out:Stream) : struct(RscHash list * Stats) =
+        let c = new Chan(inp,out)
+        let roots = decHashes (expectFrame c tRoots) |> List.ofArray
+        let seen = new HashSet<RscHash>()
+        let waiting = new Dictionary<RscHash, ResizeArray<Node>>()
+        let wants = new Queue<RscHash>()
+        let inflight = new Queue<RscHash[]>()
+        let stowed = new ResizeArray<RscHash>()
+        let mutable rscCount = 0L
+        let mutable rscBytes = 0L
+        let mutable wantCount = 0L
+        let want (h:RscHash) =
+            if seen.Add(h) && Option.isNone (tryLoad db h) then
+                wants.Enqueue(h)
+                waiting.Add(h, new ResizeArray<Node>())
+        let visit (n:Node) (h:RscHash) =
+            let h = BS.trimBytes h
+            want h
+            match waiting.TryGetValue(h) with
+            | true, ns ->
+                ns.Add(n)
+                n.Wait <- (n.Wait + 1)
+            | _ -> () // present locally or already resolved
+        let rec resolve (h:RscHash) =
+            let ns = waiting.[h]
+            waiting.Remove(h) |> ignore<bool>
+            for n in ns do
+                n.Wait <- (n.Wait - 1)
+                if (0 = n.Wait) then complete n
+        and complete (n:Node) =
+            stowed.Add(db.Stow (n.Data))
+            resolve (n.Hash)
+        List.iter want roots
+        let sendWants () =
+            while ((wants.Count > 0) && (inflight.Count < window)) do
+                let hs = Array.init (min batch wants.Count) (fun _ -> wants.Dequeue())
+                wantCount <- wantCount + int64 hs.Length
+                writeFrame c tWant (encHashes hs)
+                inflight.Enqueue(hs)
+            out.Flush()
+        let recvData () =
+            let hs = inflight.Dequeue()
+            let vs = decData (expectFrame c tData)
+            if (vs.Length <> hs.Length) then raise (ProtocolError "data does not match want")
+            for ix = 0 to (hs.Length - 1) do
+                match vs.[ix] with
+                | None -> resolve hs.[ix] // missing or false reference
+                | Some v ->
+                    if (RscHash.hash v <> hs.[ix]) then raise (ProtocolError "resource hash mismatch")
+                    rscCount <- rscCount + 1L
+                    rscBytes <- rscBytes + int64 v.Length
+                    let n = new Node(hs.[ix], v)
+                    RscHash.iterHashDeps (visit n) v
+                    if (0 = n.Wait) then complete n
+        try 
+            sendWants ()
+            while (inflight.Count > 0) do
+                recvData ()
+                sendWants ()
+            writeFrame c tEnd (BS.empty)
+            out.Flush()
+            assert(0 = waiting.Count)
+            for h in roots do db.Incref h // held for caller
+        finally
+            // release the implicit incref from Stow
+            for h in stowed do db.Decref h
+        let stats = { bytesSent = c.Sent; bytesRecv = c.Recv
+                      rscCount = rscCount; rscBytes = rscBytes; wantCount = wantCount }
+        struct(roots, stats)
+
+    /// Receive with default batch and window sizes.
+    let receive (db:Stowage) (inp:Stream) (out:Stream) : struct(RscHash list * Stats) =
+        receive' defaultBatch defaultWindow db inp out
+
@@ -328,13 +328,38 @@ module Trie =
           children = IntMap.singleton ix c
         }
 
-    let inline private seqInL t = toSeq t |> Seq.map (fun (k,v) -> (k, InL v))
-    let inline private seqInR t = toSeq t |> Seq.map (fun (k,v) -> (k, InR v))
+    // relation of keys with prefix k to a lower bound k0: all keys are
+    // below k0 (-1), all are at or above k0 (1), or k is a proper prefix
+    // of k0 (0), in which case keys with prefix k are on both sides.
+    let private boundRel (k0:Key) (k:Key) : int =
+        let n = bytesShared k k0
+        if (n = k0.Length) then 1 else
+        if (n = k.Length) then 0 else
+        if (k.[n] < k0.[n]) then -1 else 1
+
+    // toSeq' limited to keys from k0. Skips subtrees below k0.
+    let rec private toSeqFrom' (k0:Key) (k:Key) (t:Tree<'V>) : seq<Key * 'V> =
+        match boundRel k0 k with
+        | 1 -> toSeq' k t
+        | -1 -> Seq.empty
+        | _ -> 
+            seq { // value at k is below k0
+                let ix0 = uint64 (k0.[k.Length])
+                for ((ix,c)) in IntMap.toSeqFrom ix0 (t.children) do
+                    let kc = joinBytes k (byte ix) (c.prefix)
+                    yield! toSeqFrom' k0 kc c
+            }
+
+    /// Iteration through a Trie from a given key, lexicographic order.
+    let toSeqFrom (k0:Key) (t:Tree<'V>) : seq<Key * 'V> = toSeqFrom' k0 (t.prefix) t
+
+    let inline private seqFromL k0 t = toSeqFrom k0 t |> Seq.map (fun (k,v) -> (k, InL v))
+    let inline private seqFromR k0 t = toSeqFrom k0 t |> Seq.map (fun (k,v) -> (k, InR v))
 
     // notes: currently I simply use splitPrefixAt to align nodes and
     // retry when one key is fully matched. This means each key fragment
     // might be compared twice.
-    let rec diffRef' (p:ByteString) (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> =
+    let rec diffRef' (k0:Key) (p:ByteString) (a:Tree<'V>) (b:Tree<'V>) : seq<Key * VDiff<'V>> =
         seq {
             let n = bytesShared (a.prefix) (b.prefix)
             if (n < (BS.length a.prefix)) then
@@ -343,38 +368,51 @@ module Trie =
                     let a' = addPrefix p a
                     let b' = addPrefix p b
                     if (a.prefix.[n] < b.prefix.[n]) 
-                        then yield! Seq.append (seqInL a') (seqInR b')
-                        else yield! Seq.append (seqInR b') (seqInL a')
-                else yield! diffRef' p (splitPrefixAt n a) b 
+                        then yield! Seq.append (seqFromL k0 a') (seqFromR k0 b')
+                        else yield! Seq.append (seqFromR k0 b') (seqFromL k0 a')
+                else yield! diffRef' k0 p (splitPrefixAt n a) b 
             else if (n < (BS.length b.prefix)) then
-                yield! diffRef' p a (splitPrefixAt n b)
+                yield! diffRef' k0 p a (splitPrefixAt n b)
             else // tree keys match at current node
                 let k = BS.append p (a.prefix) 
+                let rel = boundRel k0 k
+                if (rel < 0) then () else
                 // potentially yield value at this node.
-                match a.value with
-                | None ->
-                    match b.value with
-                    | None -> ()
-                    | Some vb -> yield (k, InR vb)
-                | Some va ->
-                    match b.value with 
-                    | None -> yield (k, InL va)
-                    | Some vb ->
-                        // leveraging reference comparisons on Option types
-                        let eq = System.Object.ReferenceEquals(a.value, b.value)
-                        if eq then () else 
-                        yield (k, InB (va,vb))
-                // yield diffs for child nodes
-                for (ix,cd) in IntMap.diffRef (a.children) (b.children) do
+                if (rel > 0) then
+                    match a.value with
+                    | None ->
+                        match b.value with
+                        | None -> ()
+                        | Some vb -> yield (k, InR vb)
+                    | Some va ->
+                        match b.value with 
+                        | None -> yield (k, InL va)
+                        | Some vb ->
+                            // leveraging reference comparisons on Option types
+                            let eq = System.Object.ReferenceEquals(a.value, b.value)
+                            if eq then () else 
+                            yield (k, InB (va,vb))
+                // yield diffs for child nodes. Remote IntMap nodes with
+                // equal hashes are skipped without loading.
+                let ix0 = if (rel > 0) then 0UL else uint64 (k0.[k.Length])
+                for (ix,cd) in IntMap.diffRefFrom ix0 (a.children) (b.children) do
                     assert (ix < 256UL)
                     let p' = BS.snoc k (byte ix)
                     match cd with
-                    | InL ca -> yield! seqInL (addPrefix p' ca)
-                    | InR cb -> yield! seqInR (addPrefix p' cb)
+                    | InL ca -> yield! seqFromL k0 (addPrefix p' ca)
+                    | InR cb -> yield! seqFromR k0 (addPrefix p' cb)
                     | InB (ca,cb) ->
                         if System.Object.ReferenceEquals(ca,cb) then () else
-                        yield! diffRef' p' ca cb
+                        yield! diffRef' k0 p' ca cb
         } // end seq
+
+    /// Conservative difference limited to keys from k0. Subtrees with
+    /// only lesser keys are not loaded, so a diff may be resumed.
+    let diffRefFrom (k0:Key) a b =
+        if System.Object.ReferenceEquals(a,b) then Seq.empty else
+        if isEmpty a then seqFromR k0 b else
+        if isEmpty b then seqFromL k0 a else
+        diffRef' k0 (BS.empty) a b 
                         
     /// Conservative difference based on reference equality of nodes.
     /// This does not compare values directly, but will filter subtrees
@@ -382,19 +420,25 @@ module Trie =
     ///
     /// This can help for fast diffs given small persistent updates to
     /// a tree structure.
-    let diffRef a b = 
-        if System.Object.ReferenceEquals(a,b) then Seq.empty else
-        if isEmpty a then seqInR b else
-        if isEmpty b then seqInL a else
-        diffRef' (BS.empty) a b 
+    let diffRef a b = diffRefFrom (BS.empty) a b
+
+    let inline private trueDiff eq ((_,vdif)) =
+        match vdif with
+        | InB (l,r) -> not (eq l r)
+        | _ -> true
 
     /// Diff with given equality function.
     let inline diffEq eq a b = 
-        let trueDiff ((ix,vdif)) =
-            match vdif with
-            | InB (l,r) -> not (eq l r)
-            | _ -> true
-        diffRef a b |> Seq.filter trueDiff
+        diffRef a b |> Seq.filter (trueDiff eq)
+
+    /// Resumable diff with given equality function, continuing after
+    /// the position of an earlier cursor (or from the start for None).
+    let diffCursor (eq:'V -> 'V -> bool) (pos:Key option) (a:Tree<'V>) (b:Tree<'V>) : DiffCursor<Key,'V> =
+        let k0 = 
+            match pos with
+            | Some k -> BS.snoc k 0uy // least key after k
+            | None -> BS.empty
+        new DiffCursor<Key,'V>(diffRefFrom k0 a b |> Seq.filter (trueDiff eq), pos)
 
     /// Diff with value equality comparisons.
     let diff a b = diffEq (=) a b
@@ -6,3 +6,38 @@ type VDiff<'V> =
     | InR of 'V         // value in right
     | InB of 'V * 'V    // two values with equality failure
 
+/// A resumable cursor over an ordered diff.
+///
+/// Diffs of our key-ordered trees are produced in key order. A cursor
+/// remembers the last key taken, so a consumer may process a diff in
+/// batches, and may later create a new cursor at the same position
+/// (e.g. after restart) to continue from there. Construct via the
+/// `diffCursor` function for a tree type.
+type DiffCursor<'K,'V> =
+    val private e : System.Collections.Generic.IEnumerator<'K * VDiff<'V>>
+    val mutable private pos : 'K option
+    val mutable private fin : bool
+    new(s:seq<'K * VDiff<'V>>, pos:'K option) =
+        { e = s.GetEnumerator(); pos = pos; fin = false }
+
+    /// Last key taken, or the initial position if none taken.
+    member c.Position with get() = c.pos
+
+    /// True after all differences have been taken.
+    member c.Done with get() = c.fin
+
+    /// Take up to `n` further differences, in key order.
+    member c.Take (n:int) : ('K * VDiff<'V>)[] =
+        let acc = new ResizeArray<'K * VDiff<'V>>()
+        while (not c.fin) && (acc.Count < n) do
+            if c.e.MoveNext() then
+                let (k,d) = c.e.Current
+                acc.Add((k,d))
+                c.pos <- Some k
+            else 
+                c.fin <- true
+                c.e.Dispose()
+        acc.ToArray()
+
+    interface System.IDisposable with
+        member c.Dispose() = c.e.Dispose()
@@ -59,8 +59,11 @@ module VRef =
         wrap' c db (Codec.stow c db v)
 
     /// load a VRef's data from Stowage
+    ///
+    /// The parsed value is shared with other loads of the same hash
+    /// via ParseCache, so it must be treated as immutable.
     let inline load (ref:VRef<'V>) : 'V =
-        let result = Codec.load (ref.Codec) (ref.DB) (ref.ID)
+        let result = ParseCache.load (ref.Codec) (ref.DB) (ref.ID)
         System.GC.KeepAlive ref
         result
 
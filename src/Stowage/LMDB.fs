@@ -53,6 +53,33 @@ module LMDB =
           rfct_bytes : uint64 // Stowage reference count overhead.
         }
 
+    /// LMDB Space Statistics, for capacity planning.
+    type SpaceStats =
+        { map_bytes  : uint64 // current size of the memory map
+          page_size  : uint64 // bytes per page
+          used_pages : uint64 // pages up to the last page used
+          free_pages : uint64 // approx. reusable pages within used_pages
+          gc_backlog : uint64 // resources with zero refct, pending GC
+          map_growth : uint64 // times the map has grown since open
+          elided_bytes : uint64 // new resources collected before write
+        }
+
+    /// Integrity problems found by the scrubber, by StowKey (the first
+    /// half of the RscHash).
+    type ScrubIssue =
+        | BadHash of ByteString   // stowed data does not match its hash
+        | NoRefct of ByteString   // resource with no reference count
+        | BadRefct of ByteString  // refct in both "#" and "0", or invalid
+        | WrongRefct of ByteString // refct differs from references found
+
+    /// Integrity Scrub Statistics. Counts are since the DB was opened.
+    type ScrubStats =
+        { scrub_count  : uint64 // resources checked
+          scrub_bytes  : uint64 // resource bytes hashed
+          scrub_passes : uint64 // complete passes over the stowage table
+          scrub_issues : uint64 // problems recorded, including earlier runs
+        }
+
     module private I =
         type WriteBatch = CritbitTree<Val>
         
@@ -149,6 +176,7 @@ module LMDB =
             val dbi_rfct : MDB_dbi  // table with positive refcts
             val dbi_zero : MDB_dbi  // table with zero-refct items
             val flock    : FileLock // resist accidental concurrency
+            val path     : string   // directory, for auxiliary files
 
             val ephtbl           : Ephemerons   // track resources in memory
             val mutable rdlock   : ReadLock     // track concurrent readers
@@ -164,6 +192,21 @@ module LMDB =
             // buffer control options for stowage
             val mutable sbsize   : int          // data in stowage buffer
             val mutable sbthresh : int          // limit for stowage buffer
+
+            // cold resources moved out of dbi_stow, and writer tasks
+            val mutable archive  : Pack.Store option
+            val mutable tasks    : (MDB_txn -> unit) list
+            val migrating        : obj          // serializes migrations
+
+            // online growth of the memory map
+            val mutable resizing : bool         // readers wait on resize
+            val mutable mapLimit : int          // max map size in MB, or 0
+            val mutable mapGrown : uint64       // count of growth steps
+            val mutable elided   : uint64       // bytes of garbage not written
+
+            // read transactions, reset and pooled between uses
+            val rtxPool  : Stack<MDB_txn>       // idle read txns
+            val rtxCur   : ThreadLocal<MDB_txn> // active txn per thread
             static member DefaultSBThresh = 2_000_000
             
             new (path:string, maxSizeMB:int) =
@@ -187,6 +230,7 @@ module LMDB =
                   dbi_rfct = dbi_rfct
                   dbi_zero = dbi_zero
                   flock    = flock
+                  path     = path
                   ephtbl   = new Ephemerons()
                   rdlock   = new ReadLock()
                   write    = CritbitTree.empty
@@ -197,21 +241,68 @@ module LMDB =
                   halt     = false
                   sbsize   = 0
                   sbthresh = sbSize (Database.DefaultSBThresh)
+                  archive  = None
+                  tasks    = List.empty
+                  migrating = new obj()
+                  resizing = false
+                  mapLimit = 0
+                  mapGrown = 0UL
+                  elided   = 0UL
+                  rtxPool  = new Stack<MDB_txn>()
+                  rtxCur   = new ThreadLocal<MDB_txn>()
                 }
+            member db.DropReaders () = lock db (fun () ->
+                while (db.rtxPool.Count > 0) do
+                    mdb_txn_abort (db.rtxPool.Pop()))
             member db.Close () =
+                db.DropReaders()
                 mdb_env_sync (db.mdb_env)
                 mdb_env_close (db.mdb_env)
             override db.Finalize() = db.Close()
 
+        // keep a few idle read transactions for reuse
+        let maxPooledRTX = 64
+
+        // Read transactions are pooled. Beginning a txn is relatively
+        // expensive, while renewing a reset txn only takes a snapshot.
+        // A txn in the pool is reset, so it never pins old pages, and
+        // the snapshot is only held under the rdlock for the current
+        // frame (see dbWriteFrame).
+        //
+        // Nested use of withRTX in the same thread reuses the active
+        // txn, so a whole traversal may run in one txn. Readers wait
+        // while the writer grows the map, but nested reads do not.
         let withRTX (db : Database) (action : MDB_txn -> 'x) : 'x =
-            let rdlock = lock db (fun () ->
+            let cur = db.rtxCur.Value
+            if (IntPtr.Zero <> cur) then action cur else
+            let struct(rdlock,pooled) = lock db (fun () ->
+                while db.resizing do
+                    Monitor.Wait(db) |> ignore<bool>
                 db.rdlock.Acquire()
-                db.rdlock)
-            try let tx = mdb_rdonly_txn_begin (db.mdb_env)
+                let pooled = if (db.rtxPool.Count > 0) then db.rtxPool.Pop() else IntPtr.Zero
+                struct(db.rdlock, pooled))
+            try let tx =
+                    if (IntPtr.Zero = pooled) then mdb_rdonly_txn_begin (db.mdb_env) else
+                    try mdb_txn_renew pooled; pooled
+                    with _ -> mdb_txn_abort pooled; reraise()
+                db.rtxCur.Value <- tx
                 try action tx
-                finally mdb_txn_commit tx
+                finally
+                    db.rtxCur.Value <- IntPtr.Zero
+                    mdb_txn_reset tx
+                    lock db (fun () ->
+                        if (db.rtxPool.Count < maxPooledRTX)
+                            then db.rtxPool.Push(tx)
+                            else mdb_txn_abort tx)
             finally rdlock.Release()
 
+        // Run a read session: loads and reads by this thread within the
+        // action share one read txn. The writer waits for the session
+        // to end before it completes a frame, so keep sessions short and
+        // never wait on a flush within one.
+        let readSession (db : Database) (action : unit -> 'x) : 'x =
+            withRTX db (fun _ -> action ())
+
         // locate resource in database, if it is available. This will search
         // recently buffered stowage before the LMDB layer. Uses constant time
         // to compare stowKeyRem bytes of RscHash to resist timing attacks.
@@ -229,7 +320,31 @@ module LMDB =
             match vOpt with
             | Some rv when (ByteString.CTEq (BS.drop stowKeyLen h) (BS.take stowKeyRem rv)) ->
                 Some (BS.drop stowKeyRem rv)
-            | _ -> None
+            | _ -> 
+                match db.archive with
+                | Some store -> store.TryFind h
+                | None -> None
+
+        // test whether a resource is available, like tryLoadRsc but
+        // without copying the value out of the database.
+        let containsRsc (db : Database) (h : RscHash) : bool =
+            if (RscHash.size <> h.Length) 
+                then invalidArg "h" "invalid resource hash"
+            let struct(sb0,sb1) = lock db (fun () -> 
+                struct(db.stow, db.stowing))
+            if Option.isSome (tryFindRscSB h sb0) then true else
+            if Option.isSome (tryFindRscSB h sb1) then true else
+            let inDB = withRTX db (fun tx -> 
+                match mdb_getZC tx (db.dbi_stow) (BS.take stowKeyLen h) with
+                | Some v when (v.size >= unativeint stowKeyRem) ->
+                    let rem : byte[] = Array.zeroCreate stowKeyRem
+                    Marshal.Copy(v.data, rem, 0, stowKeyRem)
+                    ByteString.CTEq (BS.drop stowKeyLen h) (BS.unsafeCreateA rem)
+                | _ -> false)
+            if inDB then true else
+            match db.archive with
+            | Some store -> Option.isSome (store.TryFind h)
+            | None -> false
 
         // Add to stowage buffer. May cause background flush if there
         // is sufficient pending data.
@@ -247,6 +362,23 @@ module LMDB =
                     then Monitor.PulseAll(db))
             h
 
+        // Add many resources to the stowage buffer in one step.
+        let stowRscs (db : Database) (vs : ByteString[]) : RscHash[] =
+            if Array.exists (fun (v:ByteString) -> v.Length > maxValLen) vs
+                then invalidArg "vs" "oversized value"
+            let hs = Array.map RscHash.hash vs
+            for h in hs do
+                db.ephtbl.Incref (skEphId (BS.take stowKeyLen h))
+            lock db (fun () ->
+                for ix = 0 to (vs.Length - 1) do
+                    let h = hs.[ix]
+                    let v = vs.[ix]
+                    db.stow <- Map.add (BS.take stowKeyLen h) (struct(h,v)) (db.stow)
+                    db.sbsize <- db.sbsize + (sbSize (v.Length))
+                if (db.sbsize > db.sbthresh)
+                    then Monitor.PulseAll(db))
+            hs
+
         // Change stowage threshold. May cause background flush if
         // threshold is reduced below current buffer size.
         let setStowageThreshold (db:Database) (nBytes:int) : unit =
@@ -299,6 +431,16 @@ module LMDB =
         let signal (db:Database) : unit =
             writeBatch db (CritbitTree.empty) |> ignore<DB.Sync>
 
+        // run a task within the writer's next transaction, after new
+        // roots and resources are written but before GC.
+        let writerTask (db : Database) (task : MDB_txn -> unit) : DB.Sync =
+            let tcs = new TCS()
+            lock db (fun () ->
+                db.tasks <- (task :: db.tasks)
+                db.sync <- (tcs :: db.sync)
+                Monitor.PulseAll(db))
+            (fun () -> tcs.Task.Result)
+
         // reference counts are natural numbers, encoded using EncVarNat.
         // Zero counts are represented instead by keeping the reference in
         // the dbi_zero table to simplify GC.
@@ -369,6 +511,25 @@ module LMDB =
                   rfct_bytes = (stat_bytes sZero) + (stat_bytes sRfct)
                 })
 
+        let readSpace (db:Database) : SpaceStats =
+            let psize = uint64 ((mdb_env_stat (db.mdb_env)).psize)
+            withRTX db (fun rtx ->
+                let info = mdb_env_info (db.mdb_env)
+                // freelist values begin with a count of pages
+                let mutable free = 0UL
+                for k in mdb_keys rtx FREE_DBI do
+                    match mdb_getZC rtx FREE_DBI k with
+                    | Some v -> free <- free + uint64 (Marshal.ReadIntPtr(v.data))
+                    | None -> ()
+                { map_bytes = uint64 (info.mapsize)
+                  page_size = psize
+                  used_pages = uint64 (info.last_pgno) + 1UL
+                  free_pages = free
+                  gc_backlog = uint64 ((mdb_stat rtx (db.dbi_zero)).entries)
+                  map_growth = db.mapGrown
+                  elided_bytes = lock db (fun () -> db.elided)
+                })
+
         // The GC task is sophisticated enough to have its own object.
         // 
         // Durable reference counts are held in the Database, and we must
@@ -390,12 +551,14 @@ module LMDB =
             val mutable rfct  : Map<StowKey,RC> 
             val queue : Queue<StowKey>    // pending GC targets
             val mutable quota : int       // GC effort quota
+            val elided : HashSet<StowKey> // new resources not written
             new(db,wtx) = 
               { db = db
                 wtx = wtx
                 rfct = Map.empty
                 queue = new Queue<StowKey>()
                 quota = GC.DefaultQuota
+                elided = new HashSet<StowKey>()
               }
 
             // The amount of incremental GC is based on a flat quota,
@@ -410,6 +573,7 @@ module LMDB =
             member gc.AddDeleteTask (sk:StowKey) : unit = 
                 let blockGC = (0 = gc.quota)
                            || (gc.db.ephtbl.Contains (skEphId sk)) 
+                           || (gc.elided.Contains sk)
                 if blockGC then () else
                 gc.quota <- (gc.quota - 1)
                 gc.queue.Enqueue sk
@@ -454,6 +618,35 @@ module LMDB =
                 | Some s -> RscHash.iterHashDeps (gc.Decref) s
                 | None -> ()
 
+            // Elide new resources that would be collected in this frame,
+            // i.e. with zero refct after all increfs and no ephemeral
+            // references, so we never write them. Eliding a resource
+            // releases its own references, which may elide others. Must
+            // run after increfs and before new resources are written.
+            // Returns the elided resource bytes.
+            member gc.Elide (stowing:StowBuff) : uint64 =
+                let isGarbage sk =
+                    (Map.containsKey sk stowing)
+                        && not (gc.elided.Contains sk)
+                        && (0UL = gc.GetRefct sk)
+                        && not (gc.db.ephtbl.Contains (skEphId sk))
+                let pending = new Stack<StowKey>()
+                let mutable bytes = 0UL
+                for kv in stowing do
+                    if isGarbage kv.Key then pending.Push(kv.Key)
+                while (0 < pending.Count) do
+                    let sk = pending.Pop()
+                    if isGarbage sk then
+                        gc.elided.Add(sk) |> ignore<bool>
+                        gc.rfct <- Map.remove sk (gc.rfct)
+                        let struct(_,v) = Map.find sk stowing
+                        bytes <- bytes + uint64 (v.Length)
+                        v |> RscHash.iterHashDeps (fun h ->
+                            gc.Decref h
+                            let skDep = BS.take stowKeyLen h
+                            if isGarbage skDep then pending.Push(skDep))
+                bytes
+
             member gc.ScanPending() : unit =
                 // scan dbi_zero table for items we may delete.
                 let ks = mdb_keys_from (gc.wtx) (gc.db.dbi_zero) (BS.empty)
@@ -466,15 +659,24 @@ module LMDB =
             member gc.Delete (sk:StowKey) : unit =
                 assert(0UL = (gc.GetRefct sk))
                 gc.rfct <- Map.remove sk (gc.rfct)
-                mdb_get (gc.wtx) (gc.db.dbi_stow) sk
-                    |> Option.map (BS.drop stowKeyRem)
-                    |> gc.RemVal
+                let data = 
+                    match mdb_get (gc.wtx) (gc.db.dbi_stow) sk with
+                    | Some rv -> Some (BS.drop stowKeyRem rv)
+                    | None -> // archived resources keep their refcts
+                        match gc.db.archive with
+                        | Some store -> 
+                            store.TryFindKey sk 
+                                |> Option.map (fun (struct(_,v)) -> v)
+                        | None -> None
+                gc.RemVal data
                 dbDelRsc (gc.db) (gc.wtx) sk
 
             member gc.RunToCompletion () : unit =
-                // perform GC until no new tasks are enqueued.
+                // perform GC until no new tasks are enqueued. Elide may
+                // enqueue a resource before eliding it, so skip those.
                 while(0 < gc.queue.Count) do
-                    gc.Delete (gc.queue.Dequeue())
+                    let sk = gc.queue.Dequeue()
+                    if not (gc.elided.Contains sk) then gc.Delete sk
 
             member gc.FlushRefcts () : unit = 
                 // write final reference counts to the database
@@ -487,44 +689,139 @@ module LMDB =
                 gc.FlushRefcts()
                 if(0 = gc.quota) then signal (gc.db) // for incremental GC
 
+        // Growing the map requires that no transactions are active in this
+        // process. The writer grows the map between transactions, so we
+        // only need to wait for readers. New readers wait for the resize.
+        let dbResize (db:Database) (sizeMB:int) : unit =
+            let readers = lock db (fun () ->
+                db.resizing <- true
+                db.rdlock)
+            try readers.Wait()
+                db.DropReaders()
+                mdb_env_set_mapsize (db.mdb_env) sizeMB
+                db.mapGrown <- (db.mapGrown + 1UL)
+            finally
+                lock db (fun () ->
+                    db.resizing <- false
+                    Monitor.PulseAll(db))
+
+        // Grow the map when the last used page, plus pending writes, is
+        // past this fraction of the map. This is conservative: LMDB will
+        // reuse free pages, but cannot always do so due to old readers.
+        let mapGrowThresh = 0.8
+
+        let dbMapSizeMB (db:Database) : int =
+            int ((mdb_env_info (db.mdb_env)).mapsize / (1024un * 1024un))
+
+        // grow the map by half (at least 64MB) up to the limit, if any.
+        // Returns false if the map cannot grow.
+        let dbGrow (db:Database) : bool =
+            let cur = dbMapSizeMB db
+            let next = cur + max 64 (cur / 2)
+            let next = if (db.mapLimit > 0) then min next (db.mapLimit) else next
+            if (next <= cur) then false else
+            dbResize db next
+            true
+
+        let dbMaybeGrow (db:Database) (pendingBytes:int64) : unit =
+            let info = mdb_env_info (db.mdb_env)
+            let psize = uint64 ((mdb_env_stat (db.mdb_env)).psize)
+            let used = (uint64 (info.last_pgno) + 1UL) * psize
+            let need = float used + float pendingBytes
+            if (need > (mapGrowThresh * float (info.mapsize)))
+                then dbGrow db |> ignore<bool>
+
+        // Write roots, resources, and tasks, then update refcts and GC.
+        // This may be repeated in a new transaction if the map is full.
+        // Returns bytes of new resources elided as garbage.
+        let dbWriteFrameTxn (db:Database) (wtx:MDB_txn) (tasks:(MDB_txn -> unit) list) : uint64 =
+            // Write our new roots. Remember old roots for GC purposes.
+            let overwriting = CritbitTree.map (fun k _ -> dbReadKey db wtx k) (db.writing)
+            CritbitTree.iter (dbWriteKeyVal db wtx) (db.writing)
+
+            // For stowage, filter known resources. Migration removes a
+            // resource from dbi_stow but keeps its refcts, so a resource
+            // with refcts in the archive is also known. Writing it again
+            // would incref its dependencies twice. Refcts alone don't
+            // suffice, since a resource may be referenced before stowed.
+            let isArchived sk =
+                match db.archive with
+                | Some store ->
+                    let hasRefct = mdb_contains wtx (db.dbi_rfct) sk
+                                || mdb_contains wtx (db.dbi_zero) sk
+                    hasRefct && Option.isSome (store.TryFindKey sk)
+                | None -> false
+            let isNewRsc sk _ = 
+                not (mdb_contains wtx (db.dbi_stow) sk || isArchived sk)
+            db.stowing <- Map.filter isNewRsc (db.stowing)
+
+            // Compute reference counts before we write new resources, so
+            // we can skip those that would be collected in this frame,
+            // e.g. intermediate nodes from compaction. Tasks don't touch
+            // refcts, so they may run later.
+            let gc = new GC(db,wtx)
+            CritbitTree.iter (fun _ v -> gc.AddVal v) (db.writing)
+            Map.iter (fun _ (struct(_,v)) -> gc.AddVal (Some v)) (db.stowing)
+            CritbitTree.iter (fun _ v -> gc.RemVal v) (overwriting)
+            let elided = gc.Elide (db.stowing)
+            let written = Map.filter (fun sk _ -> not (gc.elided.Contains sk)) (db.stowing)
+            Map.iter (fun _ (struct(h,v)) -> dbAddRsc db wtx h v) written
+
+            // maintenance tasks, e.g. migration of resources to archive
+            List.iter (fun task -> task wtx) tasks
+
+            // perform GC.
+            Map.iter (fun sk _ -> gc.NewRsc sk) written
+            gc.Perform()
+            elided
+
+        // On MDB_MAP_FULL, abort the transaction, grow the map, and retry.
+        // Note that mdb_txn_commit frees the transaction even on failure.
+        let rec dbWriteTxn (db:Database) (tasks:(MDB_txn -> unit) list) : unit =
+            let inline isFull e = (MDB_MAP_FULL = e)
+            let wtx = mdb_readwrite_txn_begin (db.mdb_env)
+            let struct(full,elided) =
+                try let elided = dbWriteFrameTxn db wtx tasks
+                    struct(false,elided)
+                with
+                | LMDBError e when isFull e -> mdb_txn_abort wtx; struct(true,0UL)
+            let full = full || (
+                try mdb_txn_commit wtx; false
+                with
+                | LMDBError e when isFull e -> true)
+            if full then
+                // decrefs stay delayed, since the retry repeats our GC
+                if not (dbGrow db) then raise (LMDBError MDB_MAP_FULL)
+                dbWriteTxn db tasks
+            else
+                db.ephtbl.PassDecrefs() // allow decrefs after GC commits
+                lock db (fun () -> db.elided <- (db.elided + elided))
+
         let dbWriteFrame (db:Database) : bool =
             // prevent potential GC of concurrently rooted resources. 
             db.ephtbl.DelayDecrefs()
 
             // write buffers are held in Database until commit, but
             // are immediately separated from new incoming writes
-            let struct(syncing,halting) = lock db (fun () ->
+            let struct(syncing,halting,tasks,sbsize) = lock db (fun () ->
                 db.writing <- db.write
                 db.stowing <- db.stow
                 let syncing = db.sync
+                let tasks = List.rev (db.tasks)
+                let sbsize = db.sbsize
                 db.write <- CritbitTree.empty
                 db.stow <- Map.empty
                 db.sync <- List.empty
+                db.tasks <- List.empty
                 db.sbsize <- 0
-                struct(syncing,db.halt))
+                struct(syncing,db.halt,tasks,sbsize))
 
-            let wtx = mdb_readwrite_txn_begin (db.mdb_env)
-
-            // Write our new roots. Remember old roots for GC purposes.
-            let overwriting = CritbitTree.map (fun k _ -> dbReadKey db wtx k) (db.writing)
-            CritbitTree.iter (dbWriteKeyVal db wtx) (db.writing)
-
-            // For stowage, filter known resources. Write the remainder.
-            let isNewRsc sk _ = not (mdb_contains wtx (db.dbi_stow) sk) 
-            db.stowing <- Map.filter isNewRsc (db.stowing)
-            Map.iter (fun _ (struct(h,v)) -> dbAddRsc db wtx h v) (db.stowing)
-
-            // update reference counts and perform GC.
-            let gc = new GC(db,wtx)
-            CritbitTree.iter (fun _ v -> gc.AddVal v) (db.writing)
-            Map.iter (fun _ (struct(_,v)) -> gc.AddVal (Some v)) (db.stowing)
-            CritbitTree.iter (fun _ v -> gc.RemVal v) (overwriting)
-            Map.iter (fun sk _ -> gc.NewRsc sk) (db.stowing)
-            gc.Perform()
-            db.ephtbl.PassDecrefs() // allow decrefs after GC
+            // grow the map before we're near full. sbSize shifts by 6 bits,
+            // so this is roughly the size of the buffered resources.
+            dbMaybeGrow db (int64 sbsize <<< 6)
 
             // write and flush the transaction
-            mdb_txn_commit wtx
+            dbWriteTxn db tasks
             let oldReaders = lock db (fun () ->
                 let oldReadLock = db.rdlock
                 db.rdlock <- new ReadLock()
@@ -540,6 +837,7 @@ module LMDB =
 
         let inline dbHasWork (db:Database) : bool =
             let noWork = (List.isEmpty (db.sync))
+                      && (List.isEmpty (db.tasks))
                       && (CritbitTree.isEmpty (db.write))
                       && (db.sbsize < db.sbthresh)
             not noWork
@@ -573,6 +871,301 @@ module LMDB =
             db.Close()
             System.GC.SuppressFinalize(db)
 
+        // locate resource data in dbi_stow or the archive by StowKey.
+        let dbFindRscData (db:Database) (rtx:MDB_txn) (sk:StowKey) : ByteString option =
+            match mdb_get rtx (db.dbi_stow) sk with
+            | Some rv -> Some (BS.drop stowKeyRem rv)
+            | None ->
+                match db.archive with
+                | Some store -> store.TryFindKey sk |> Option.map (fun (struct(_,v)) -> v)
+                | None -> None
+
+        // StowKeys of resources reachable from hot roots.
+        let dbHotSet (db:Database) (rtx:MDB_txn) (isHot:Key -> bool) : HashSet<StowKey> =
+            let hot = new HashSet<StowKey>()
+            let pending = new Stack<RscHash>()
+            let push h = pending.Push(h)
+            for k in mdb_keys rtx (db.dbi_data) do
+                if isHot k then 
+                    match dbReadKey db rtx k with
+                    | Some v -> RscHash.iterHashDeps push v
+                    | None -> ()
+            while (pending.Count > 0) do
+                let sk = BS.take stowKeyLen (pending.Pop())
+                if hot.Add(sk) then
+                    match dbFindRscData db rtx sk with
+                    | Some v -> RscHash.iterHashDeps push v
+                    | None -> ()
+            hot
+
+        // Migration tracks when each resource was first seen to be cold,
+        // persisted as lines of `stowkey ticks` in the archive directory.
+        let coldFile (store:Pack.Store) = Path.Combine(store.Path, "cold")
+
+        let readCold (store:Pack.Store) : Dictionary<StowKey,int64> =
+            let d = new Dictionary<StowKey,int64>()
+            let f = coldFile store
+            if File.Exists(f) then
+                for ln in File.ReadAllLines(f) do
+                    match ln.Split(' ') with
+                    | [| sk; t |] -> d.[BS.fromString sk] <- int64 t
+                    | _ -> ()
+            d
+
+        let writeCold (store:Pack.Store) (d:Dictionary<StowKey,int64>) : unit =
+            let f = coldFile store
+            let lines = d |> Seq.map (fun kv -> sprintf "%s %d" (BS.toString kv.Key) kv.Value)
+            File.WriteAllLines(f + ".tmp", lines)
+            if File.Exists(f) then File.Delete(f)
+            File.Move(f + ".tmp", f)
+
+        let setArchive (db:Database) (store:Pack.Store) : unit =
+            lock db (fun () ->
+                match db.archive with
+                | Some st when not (obj.ReferenceEquals(st, store)) ->
+                    invalidOp "a different archive is already in use"
+                | _ -> db.archive <- Some store)
+
+        // Move resources that have been cold for minAge into the archive. 
+        // Reference counts remain in LMDB, so GC works as before.
+        //
+        // Migrations are serialized, including the read-modify-write of
+        // the cold file. This is a separate lock from the store, which
+        // the writer may need to complete our task.
+        let migrate (db:Database) (store:Pack.Store) (isHot:Key -> bool) (minAge:TimeSpan) : int =
+            setArchive db store
+            lock (db.migrating) (fun () ->
+            let now = DateTime.UtcNow.Ticks
+            let cold = readCold store
+            let cold' = new Dictionary<StowKey,int64>()
+            let moving = withRTX db (fun rtx ->
+                let hot = dbHotSet db rtx isHot
+                let items = new ResizeArray<RscHash * ByteString>()
+                for sk in mdb_keys rtx (db.dbi_stow) do
+                    let isCold = not (hot.Contains(sk)) 
+                              && not (db.ephtbl.Contains (skEphId sk))
+                    if isCold then
+                        let since = 
+                            match cold.TryGetValue(sk) with
+                            | true, t -> t
+                            | _ -> now
+                        if ((now - since) < minAge.Ticks) then cold'.[sk] <- since else
+                        match mdb_get rtx (db.dbi_stow) sk with
+                        | Some rv -> 
+                            let h = BS.append sk (BS.take stowKeyRem rv)
+                            items.Add((h, BS.drop stowKeyRem rv))
+                        | None -> ()
+                items.ToArray())
+            if (moving.Length > 0) then
+                store.Add moving // durable before we delete from LMDB
+                let sync = writerTask db (fun wtx ->
+                    for (h,_) in moving do
+                        mdb_del wtx (db.dbi_stow) (BS.take stowKeyLen h) |> ignore<bool>)
+                sync ()
+            writeCold store cold'
+            moving.Length)
+
+        // Integrity scrub of dbi_stow. We recompute each resource's hash
+        // and check its reference count records. The cursor (last StowKey
+        // checked) and any issues found are persisted in the DB directory
+        // so a scrub resumes after restart.
+        //
+        // Refcts without a resource are not errors: a resource may be
+        // referenced before it's stowed, or migrated to the archive. And
+        // archived resources are not scrubbed; pack files are immutable.
+        // At the end of each pass, every stored refct is compared with
+        // the references found from roots and resources.
+        type Scrub =
+            val db     : Database
+            val issues : ResizeArray<ScrubIssue>
+            val mutable cursor  : StowKey // last StowKey checked
+            val mutable count   : uint64
+            val mutable bytes   : uint64
+            val mutable passes  : uint64
+            val mutable stop    : bool
+            val mutable thread  : Thread option
+            new(db:Database) =
+                { db = db
+                  issues = new ResizeArray<ScrubIssue>()
+                  cursor = BS.empty
+                  count = 0UL
+                  bytes = 0UL
+                  passes = 0UL
+                  stop = false
+                  thread = None
+                }
+            member sc.CursorFile = Path.Combine(sc.db.path, "scrub")
+            member sc.LogFile = Path.Combine(sc.db.path, "scrub.log")
+
+        let issueLine (i:ScrubIssue) : string =
+            match i with
+            | BadHash sk -> "hash " + BS.toString sk
+            | NoRefct sk -> "norc " + BS.toString sk
+            | BadRefct sk -> "badrc " + BS.toString sk
+            | WrongRefct sk -> "wrongrc " + BS.toString sk
+
+        let parseIssue (ln:string) : ScrubIssue option =
+            match ln.Split(' ') with
+            | [| "hash"; sk |] -> Some (BadHash (BS.fromString sk))
+            | [| "norc"; sk |] -> Some (NoRefct (BS.fromString sk))
+            | [| "badrc"; sk |] -> Some (BadRefct (BS.fromString sk))
+            | [| "wrongrc"; sk |] -> Some (WrongRefct (BS.fromString sk))
+            | _ -> None
+
+        let openScrub (db:Database) : Scrub =
+            let sc = new Scrub(db)
+            if File.Exists(sc.CursorFile) then
+                sc.cursor <- BS.fromString (File.ReadAllText(sc.CursorFile).Trim())
+            if File.Exists(sc.LogFile) then
+                for ln in File.ReadAllLines(sc.LogFile) do
+                    Option.iter (sc.issues.Add) (parseIssue ln)
+            sc
+
+        // check one resource, given its StowKey and dbi_stow value.
+        let scrubCheck (db:Database) (rtx:MDB_txn) (sk:StowKey) (rv:ByteString) : ScrubIssue option =
+            let h = RscHash.hash (BS.drop stowKeyRem rv)
+            let okHash = (BS.take stowKeyLen h = sk)
+                      && (BS.drop stowKeyLen h = BS.take stowKeyRem rv)
+            if not okHash then Some (BadHash sk) else
+            let inZero = mdb_contains rtx (db.dbi_zero) sk
+            match mdb_get rtx (db.dbi_rfct) sk with
+            | None -> if inZero then None else Some (NoRefct sk)
+            | Some v ->
+                let rc = try ByteStream.read (EncVarNat.read) v with _ -> 0UL
+                if (inZero || (0UL = rc)) then Some (BadRefct sk) else None
+
+        // Count references from roots and from resources with refcts, then
+        // compare each stored refct with the count. This runs in one read
+        // transaction, so the counts are consistent with the refcts, but
+        // it scans the whole database; we run it once per pass. Stowed
+        // resources without a refct record are reported by scrubCheck.
+        let scrubRefcts (db:Database) : ScrubIssue list =
+            withRTX db (fun rtx ->
+                let found = new Dictionary<StowKey,RC>()
+                let addRef (h:RscHash) =
+                    let sk = BS.take stowKeyLen h
+                    match found.TryGetValue(sk) with
+                    | true, n -> found.[sk] <- (n + 1UL)
+                    | _ -> found.Add(BS.trimBytes sk, 1UL)
+                let addDeps vOpt = Option.iter (RscHash.iterHashDeps addRef) vOpt
+                for k in mdb_keys rtx (db.dbi_data) do
+                    addDeps (mdb_get rtx (db.dbi_data) k)
+                for sk in mdb_keys rtx (db.dbi_stow) do
+                    addDeps (dbFindRscData db rtx sk)
+                let isArchived sk = not (mdb_contains rtx (db.dbi_stow) sk)
+                for sk in mdb_keys rtx (db.dbi_rfct) do
+                    if isArchived sk then addDeps (dbFindRscData db rtx sk)
+                for sk in mdb_keys rtx (db.dbi_zero) do
+                    if isArchived sk && not (mdb_contains rtx (db.dbi_rfct) sk)
+                        then addDeps (dbFindRscData db rtx sk)
+                let refsTo sk =
+                    match found.TryGetValue(sk) with
+                    | true, n -> n
+                    | _ -> 0UL
+                let issues = new ResizeArray<ScrubIssue>()
+                for sk in mdb_keys rtx (db.dbi_rfct) do
+                    match mdb_get rtx (db.dbi_rfct) sk with
+                    | Some v ->
+                        let rcOpt = try Some (ByteStream.read (EncVarNat.read) v) with _ -> None
+                        match rcOpt with
+                        | Some rc when (rc <> refsTo sk) -> issues.Add(WrongRefct sk)
+                        | _ -> () // invalid refcts are BadRefct
+                    | None -> ()
+                for sk in mdb_keys rtx (db.dbi_zero) do
+                    let inRfct = mdb_contains rtx (db.dbi_rfct) sk
+                    if not inRfct && (0UL <> refsTo sk) then issues.Add(WrongRefct sk)
+                for kv in found do
+                    let recorded = mdb_contains rtx (db.dbi_rfct) kv.Key
+                                || mdb_contains rtx (db.dbi_zero) kv.Key
+                                || mdb_contains rtx (db.dbi_stow) kv.Key
+                    if not recorded then issues.Add(WrongRefct kv.Key)
+                List.ofSeq issues)
+
+        // check resources after the cursor, up to about maxBytes of data,
+        // within one short read transaction. Returns bytes checked and
+        // whether we reached the end of the table, which completes a pass
+        // and resets the cursor.
+        let scrubStep (sc:Scrub) (maxBytes:int) : struct(int * bool) =
+            lock sc (fun () ->
+                let db = sc.db
+                let found = new ResizeArray<ScrubIssue>()
+                let struct(last, ct, bytes, atEnd) = withRTX db (fun rtx ->
+                    use e = (mdb_keys_from rtx (db.dbi_stow) (sc.cursor)).GetEnumerator()
+                    let mutable more = e.MoveNext()
+                    if more && (e.Current = sc.cursor)
+                        then more <- e.MoveNext() // cursor was checked
+                    let mutable last = sc.cursor
+                    let mutable ct = 0UL
+                    let mutable bytes = 0
+                    while (more && (bytes < maxBytes)) do
+                        let sk = e.Current
+                        match mdb_get rtx (db.dbi_stow) sk with
+                        | Some rv ->
+                            bytes <- bytes + rv.Length
+                            ct <- ct + 1UL
+                            Option.iter (found.Add) (scrubCheck db rtx sk rv)
+                        | None -> ()
+                        last <- sk
+                        more <- e.MoveNext()
+                    struct(last, ct, bytes, not more))
+                if atEnd then found.AddRange(scrubRefcts db)
+                sc.count <- sc.count + ct
+                sc.bytes <- sc.bytes + uint64 bytes
+                if (found.Count > 0) then
+                    sc.issues.AddRange(found)
+                    File.AppendAllLines(sc.LogFile, Seq.map issueLine found)
+                if atEnd then
+                    sc.passes <- sc.passes + 1UL
+                    sc.cursor <- BS.empty
+                else sc.cursor <- last
+                File.WriteAllText(sc.CursorFile, BS.toString (sc.cursor))
+                struct(bytes, atEnd))
+
+        // Background scrub at about bytesPerSec. Steps are at least a tenth
+        // of a second apart, so a small table doesn't keep us busy.
+        let scrubLoop (sc:Scrub) (bytesPerSec:int) : unit =
+            let stepBytes = max 4096 (bytesPerSec / 10)
+            let sw = new Diagnostics.Stopwatch()
+            let rec loop () =
+                sw.Restart()
+                let struct(bytes,_) = scrubStep sc stepBytes
+                let budgetMS = (int64 bytes * 1000L) / int64 (max 1 bytesPerSec)
+                let waitMS = (max 100L budgetMS) - sw.ElapsedMilliseconds
+                let halt = lock sc (fun () ->
+                    if (not sc.stop) && (waitMS > 0L)
+                        then Monitor.Wait(sc, int waitMS) |> ignore<bool>
+                    sc.stop)
+                if not halt then loop ()
+            loop ()
+
+        let startScrub (sc:Scrub) (bytesPerSec:int) : unit =
+            if (bytesPerSec < 1) then invalidArg "bytesPerSec" "scrub rate must be positive"
+            lock sc (fun () ->
+                if Option.isSome (sc.thread) then invalidOp "scrub already running"
+                sc.stop <- false
+                let t = new Thread(fun () -> scrubLoop sc bytesPerSec)
+                t.IsBackground <- true
+                t.Priority <- ThreadPriority.BelowNormal
+                sc.thread <- Some t
+                t.Start())
+
+        let stopScrub (sc:Scrub) : unit =
+            let tOpt = lock sc (fun () ->
+                sc.stop <- true
+                Monitor.PulseAll(sc)
+                let t = sc.thread
+                sc.thread <- None
+                t)
+            Option.iter (fun (t:Thread) -> t.Join()) tOpt
+
+        let scrubStats (sc:Scrub) : ScrubStats =
+            lock sc (fun () ->
+                { scrub_count = sc.count
+                  scrub_bytes = sc.bytes
+                  scrub_passes = sc.passes
+                  scrub_issues = uint64 (sc.issues.Count)
+                })
+
     /// LMDB based Storage.
     ///
     /// LMDB is backed by a single memory-mapped file and is durable
@@ -581,8 +1174,10 @@ module LMDB =
     /// a DB object with structured data.
     type Storage =
         val private db : I.Database
+        val private scrub : I.Scrub
         new(path:string,maxSizeMB:int) = 
-            { db = I.openDB path maxSizeMB }
+            let db = I.openDB path maxSizeMB
+            { db = db; scrub = I.openScrub db }
 
         interface Stowage with
             member this.Load h =
@@ -599,13 +1194,21 @@ module LMDB =
                 let sk = BS.take (I.stowKeyLen) h
                 this.db.ephtbl.Decref (I.skEphId sk)
 
+        interface BulkStowage with
+            member this.StowMany vs = I.stowRscs (this.db) vs
+
+        interface ContainsStowage with
+            member this.Contains h = I.containsRsc (this.db) h
+
         interface DB.Storage with
             member this.Mangle k = mangle k
             member this.Read k = I.readKey (this.db) k
             member this.WriteBatch wb = I.writeBatch (this.db) wb
 
         interface System.IDisposable with
-            member this.Dispose() = I.closeDB (this.db)
+            member this.Dispose() = 
+                I.stopScrub (this.scrub)
+                I.closeDB (this.db)
         
         /// Configure Stowage Buffer (in bytes).
         ///
@@ -620,6 +1223,16 @@ module LMDB =
         member this.SetStowageBuffer (bytes:int) : unit =
             I.setStowageThreshold (this.db) bytes
 
+        /// Run an action as a read session.
+        ///
+        /// Loads and reads by the current thread within the action share
+        /// a single LMDB read transaction, rather than one per Load, so
+        /// a large traversal is cheaper. The writer cannot complete a
+        /// frame until the session ends, so sessions should be brief,
+        /// and must not wait on a flush.
+        member this.ReadSession (action:unit -> 'x) : 'x =
+            I.readSession (this.db) action
+
         /// Force GC pass of the storage layer.
         /// 
         /// This is not a full GC, it only waits for one write step which
@@ -632,3 +1245,69 @@ module LMDB =
         member this.Stats() : Stats = 
             I.readStats (this.db)
 
+        /// Memory map usage and GC backlog.
+        ///
+        /// The map grows automatically when the last used page nears the
+        /// end of the map, or when a write would not fit. Free pages are
+        /// reused by LMDB, so `used_pages - free_pages` is a better view
+        /// of live data. A large `gc_backlog` indicates GC isn't keeping
+        /// up with the writer. New resources that are garbage before the
+        /// end of a frame are never written, as `elided_bytes`.
+        member this.Space() : SpaceStats =
+            I.readSpace (this.db)
+
+        /// Limit growth of the memory map, in megabytes. Zero (default)
+        /// means no limit beyond the disk. When the map cannot grow, the
+        /// writer will fail with MDB_MAP_FULL.
+        member this.SetMapLimit (maxSizeMB:int) : unit =
+            if (maxSizeMB < 0) then invalidArg "maxSizeMB" "negative map limit"
+            lock (this.db) (fun () -> this.db.mapLimit <- maxSizeMB)
+
+        /// Use a pack store to find resources missing from LMDB. This
+        /// should be set on open if resources were migrated earlier.
+        member this.SetArchive (store:Pack.Store) : unit =
+            I.setArchive (this.db) store
+
+        /// Migrate cold resources into a new pack file in the archive.
+        ///
+        /// Resources reachable from hot roots (keys where `isHot` is true)
+        /// or from .Net memory are hot. Other resources are cold, and are
+        /// migrated once they've been observed as cold for `minAge`, e.g.
+        /// a few days. This should be run periodically, and is expensive:
+        /// it traces all hot resources. Reference counts are preserved in 
+        /// LMDB, so GC of archived resources works as before, except that
+        /// pack files are immutable and are not compacted.
+        ///
+        /// Returns the number of resources migrated.
+        member this.Migrate (store:Pack.Store) (isHot:Key -> bool) (minAge:TimeSpan) : int =
+            I.migrate (this.db) store isHot minAge
+
+        /// Verify integrity of stowage resources in the background.
+        ///
+        /// The scrubber iterates the stowage table, recomputes the secure
+        /// hash of each resource, and checks that it has exactly one valid
+        /// reference count record. At the end of each pass, it compares every
+        /// refct with the references found, which scans the whole database
+        /// in one read transaction. Issues are recorded in `scrub.log` and
+        /// the position in `scrub` within the DB directory, so the scrub
+        /// resumes after restart. It runs continuously at about the given
+        /// rate, in small read transactions, until stopped.
+        member this.StartScrub (bytesPerSec:int) : unit =
+            I.startScrub (this.scrub) bytesPerSec
+
+        /// Stop the background scrub, waiting for the current step.
+        member this.StopScrub () : unit =
+            I.stopScrub (this.scrub)
+
+        /// Scrub up to about maxBytes of resources in the foreground.
+        /// Returns true when this completes a pass over the table.
+        member this.ScrubStep (maxBytes:int) : bool =
+            let struct(_,atEnd) = I.scrubStep (this.scrub) maxBytes
+            atEnd
+
+        member this.ScrubStats() : ScrubStats =
+            I.scrubStats (this.scrub)
+
+        /// Integrity issues recorded by the scrubber, oldest first.
+        member this.ScrubIssues() : ScrubIssue list =
+            lock (this.scrub) (fun () -> List.ofSeq (this.scrub.issues))
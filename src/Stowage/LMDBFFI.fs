@@ -12,6 +12,10 @@ open Data.ByteString
 //  I could use the LightningDB package, but I'd still mostly use
 [< SecuritySafeCriticalAttribute >]
 module internal LMDB_FFI =
+    // tests use the FFI to inject faults into a closed database
+    [<assembly: System.Runtime.CompilerServices.InternalsVisibleTo("Test")>]
+    do ()
+
     type MDB_env = nativeint    // opaque MDB_env*
     type MDB_txn = nativeint    // opaque MDB_txn*
     type MDB_dbi = uint32       // database ids are simple ints
@@ -35,6 +39,15 @@ module internal LMDB_FFI =
         val overflow_pages : nativeint
         val entries : nativeint
 
+    [< Struct; StructLayoutAttribute(LayoutKind.Sequential) >]
+    type MDB_envinfo =
+        val mapaddr : nativeint
+        val mapsize : size_t        // size of the map in bytes
+        val last_pgno : size_t      // ID of last used page
+        val last_txnid : size_t
+        val maxreaders : uint32
+        val numreaders : uint32
+
     let defaultMode : mdb_mode_t = 0o660
 
     // Environment Flags
@@ -45,6 +58,10 @@ module internal LMDB_FFI =
     let MDB_NORDAHEAD   = 0x800000u     // assume mostly random reads
 
     
+    // The freelist is a database with ID 0, keyed by txnid with values
+    // holding a count then a list of page numbers, each a size_t.
+    let FREE_DBI : MDB_dbi = 0u
+
     // Database Flags
     let MDB_CREATE  = 0x40000u  // create DB if it doesn't exist
 
@@ -61,6 +78,7 @@ module internal LMDB_FFI =
 
     // Specially handled Error codes
     let MDB_NOTFOUND = (-30798)
+    let MDB_MAP_FULL = (-30792)
 
     module Native = 
         // API native methods
@@ -88,12 +106,27 @@ module internal LMDB_FFI =
         [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
         extern int mdb_env_set_maxdbs(MDB_env env, MDB_dbi dbs);
 
+        [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
+        extern int mdb_env_info(MDB_env env, [<Out>] MDB_envinfo& info);
+
+        [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
+        extern int mdb_env_stat(MDB_env env, [<Out>] MDB_stat& stat);
+
         [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
         extern int mdb_txn_begin(MDB_env env, MDB_txn parent, uint32 flags, [<Out>] MDB_txn& txn);
 
         [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
         extern int mdb_txn_commit(MDB_txn txn);
 
+        [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
+        extern void mdb_txn_abort(MDB_txn txn);
+
+        [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
+        extern void mdb_txn_reset(MDB_txn txn);
+
+        [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
+        extern int mdb_txn_renew(MDB_txn txn);
+
         [< DllImport("lmdb", CallingConvention = CallingConvention.Cdecl) >] 
         extern int mdb_dbi_open(MDB_txn txn, string name, uint32 flags, [<Out>] MDB_dbi& dbi); 
 
@@ -132,7 +165,8 @@ module internal LMDB_FFI =
         let msgStr = 
             if (IntPtr.Zero = msgPtr) then "(null)" else
             Marshal.PtrToStringAnsi(msgPtr)
-        printf "LMDB Error %d: %s" e msgStr
+        // a full map is handled by growing the map, so don't report it
+        if (MDB_MAP_FULL <> e) then printf "LMDB Error %d: %s" e msgStr
         raise (LMDBError e)
 
     let inline check (e : int) : unit =
@@ -155,6 +189,18 @@ module internal LMDB_FFI =
         let maxSizeBytes = (1024UL * 1024UL) * (uint64 maxSizeMB)
         check(Native.mdb_env_set_mapsize(env, unativeint maxSizeBytes))
 
+    // map size information (size, last used page)
+    let mdb_env_info (env : MDB_env) : MDB_envinfo =
+        let mutable info = Unchecked.defaultof<MDB_envinfo>
+        check(Native.mdb_env_info(env, &info))
+        info
+
+    // statistics for the main DB, mostly for the page size
+    let mdb_env_stat (env : MDB_env) : MDB_stat =
+        let mutable stat = Unchecked.defaultof<MDB_stat>
+        check(Native.mdb_env_stat(env, &stat))
+        stat
+
     let mdb_env_set_maxdbs (env : MDB_env) (maxDBs : int) : unit =
         assert (maxDBs > 0)
         check(Native.mdb_env_set_maxdbs(env, uint32 maxDBs))
@@ -185,6 +231,20 @@ module internal LMDB_FFI =
     let mdb_txn_commit (txn : MDB_txn) : unit =
         check(Native.mdb_txn_commit(txn))
 
+    // abandon a transaction, e.g. after a failed write. Not for use
+    // after mdb_txn_commit, which frees the txn even on failure.
+    let mdb_txn_abort (txn : MDB_txn) : unit =
+        Native.mdb_txn_abort(txn)
+
+    // release the snapshot of a read-only transaction, keeping the txn
+    // for reuse via mdb_txn_renew. A reset txn may still be aborted.
+    let mdb_txn_reset (txn : MDB_txn) : unit =
+        Native.mdb_txn_reset(txn)
+
+    // acquire a new snapshot for a read-only transaction after reset.
+    let mdb_txn_renew (txn : MDB_txn) : unit =
+        check(Native.mdb_txn_renew(txn))
+
     let mdb_dbi_open (txn : MDB_txn) (db : string) : MDB_dbi =
         let mutable dbi = 0u
         check(Native.mdb_dbi_open(txn, db, MDB_CREATE, &dbi))
@@ -0,0 +1,288 @@
+namespace Stowage
+open System
+open System.IO
+open System.IO.MemoryMappedFiles
+open Data.ByteString
+
+/// Immutable Pack Files for cold Stowage resources.
+///
+/// LMDB is a good fit for hot, frequently updated data. But we will
+/// accumulate many small, historical resources that are never updated,
+/// and these inflate the LMDB map and slow writes. A pack file is an
+/// immutable, sorted file of resources, memory-mapped for reads.
+///
+/// File format (numbers are little-endian, except index prefixes):
+///
+///     header: "WKPACK01"
+///     entries: (RscHash)(data) sorted by RscHash
+///     index: count * ((prefix:8)(offset:8)(length:4))
+///     bloom: Bloom filter bytes
+///     footer: (indexOff:8)(count:8)(bloomOff:8)(bloomLen:8)(k:4)"WKPK"
+///
+/// The index prefix is the first 8 bytes of the hash, big-endian, so
+/// the index may be binary searched. The Bloom filter is keyed by the
+/// first half of the hash, the same as the LMDB stowage key, so we can
+/// also search by half hash for internal GC. A complete match uses a
+/// constant-time comparison of the full hash.
+module Pack =
+
+    let private magic = "WKPACK01"B
+    let private footMagic = "WKPK"B
+    let private footerSize = 40L
+    let private indexElemSize = 20L
+    let private bloomBitsPerElem = 10
+    let private bloomK = 7
+
+    /// Half of the RscHash is used as the search key, as for LMDB.
+    let keyLen = (RscHash.size / 2)
+
+    // big-endian prefix from first 8 bytes of a hash.
+    let private prefix (h:ByteString) : uint64 =
+        let mutable p = 0UL
+        for ix = 0 to 7 do
+            p <- (p <<< 8) ||| uint64 (h.[ix])
+        p
+
+    // double hashing for the Bloom filter, from the search key.
+    let inline private bloomHashes (k:ByteString) : struct(uint64 * uint64) =
+        let h1 = ByteString.Hash64 (BS.take (keyLen/2) k)
+        let h2 = ByteString.Hash64 (BS.drop (keyLen/2) k) ||| 1UL
+        struct(h1,h2)
+
+    let private bloomAdd (bloom:byte[]) (k:ByteString) : unit =
+        let m = uint64 (bloom.Length * 8)
+        let struct(h1,h2) = bloomHashes k
+        for i = 0 to (bloomK - 1) do
+            let bit = (h1 + (uint64 i * h2)) % m
+            let ix = int (bit >>> 3)
+            bloom.[ix] <- bloom.[ix] ||| (1uy <<< int (bit &&& 7UL))
+
+    let private bloomTest (bloom:byte[]) (k:ByteString) : bool =
+        let m = uint64 (bloom.Length * 8)
+        let struct(h1,h2) = bloomHashes k
+        let rec loop i =
+            if (i = bloomK) then true else
+            let bit = (h1 + (uint64 i * h2)) % m
+            let b = bloom.[int (bit >>> 3)] &&& (1uy <<< int (bit &&& 7UL))
+            if (0uy = b) then false else loop (i + 1)
+        loop 0
+
+    /// Write a pack file from a collection of resources.
+    ///
+    /// Duplicate hashes are removed. The file is written to a temporary
+    /// path, flushed to disk, then moved into place, so a pack file is
+    /// either complete or absent.
+    let write (path:string) (items:seq<RscHash * ByteString>) : unit =
+        let arr =
+            items
+                |> Seq.map (fun (h,v) -> assert(RscHash.size = h.Length); (h,v))
+                |> Seq.distinctBy fst
+                |> Array.ofSeq
+        Array.sortInPlaceWith (fun (a,_) (b,_) -> ByteString.Compare a b) arr
+        let bloom = Array.zeroCreate (max 8 ((arr.Length * bloomBitsPerElem + 7) / 8))
+        let tmp = path + ".tmp"
+        do
+            use fs = new FileStream(tmp, FileMode.Create, FileAccess.Write)
+            use w = new BinaryWriter(fs)
+            let inline writeBytes (b:ByteString) = w.Write(b.UnsafeArray, b.Offset, b.Length)
+            w.Write(magic)
+            let offsets = Array.zeroCreate arr.Length
+            for ix = 0 to (arr.Length - 1) do
+                let (h,v) = arr.[ix]
+                offsets.[ix] <- fs.Position
+                writeBytes h
+                writeBytes v
+                bloomAdd bloom (BS.take keyLen h)
+            let indexOff = fs.Position
+            for ix = 0 to (arr.Length - 1) do
+                let (h,v) = arr.[ix]
+                let p = prefix h
+                for sh in [56; 48; 40; 32; 24; 16; 8; 0] do
+                    w.Write(byte (p >>> sh))
+                w.Write(offsets.[ix])
+                w.Write(v.Length)
+            let bloomOff = fs.Position
+            w.Write(bloom)
+            w.Write(indexOff)
+            w.Write(int64 arr.Length)
+            w.Write(bloomOff)
+            w.Write(int64 bloom.Length)
+            w.Write(bloomK)
+            w.Write(footMagic)
+            w.Flush()
+            fs.Flush(true)
+        if File.Exists(path) then File.Delete(path)
+        File.Move(tmp, path)
+
+    /// Exception for a pack file we cannot read.
+    exception InvalidPack of string
+
+    /// Reader for a single pack file, via memory-mapped file.
+    ///
+    /// Resource data is copied from the mapped file directly into the
+    /// array of the resulting ByteString. Our ByteStrings are backed by
+    /// managed arrays, so this single copy is the minimum.
+    type Reader =
+        val Path : string
+        val private mmf : MemoryMappedFile
+        val private view : MemoryMappedViewAccessor
+        val private indexOff : int64
+        val private count : int64
+        val private bloom : byte[]
+        new(path:string) =
+            let len = (new FileInfo(path)).Length
+            let hdrLen = int64 magic.Length
+            if (len < (hdrLen + footerSize)) then raise (InvalidPack path)
+            let mmf = MemoryMappedFile.CreateFromFile(path, FileMode.Open, null, 0L, MemoryMappedFileAccess.Read)
+            let view = mmf.CreateViewAccessor(0L, 0L, MemoryMappedFileAccess.Read)
+            let readArr pos n =
+                let arr = Array.zeroCreate n
+                view.ReadArray(pos, arr, 0, n) |> ignore<int>
+                arr
+            // the index and bloom filter must lie between the header and
+            // footer, in order, so we never read past the end of file.
+            let f = len - footerSize
+            let indexOff = view.ReadInt64(f)
+            let count = view.ReadInt64(f + 8L)
+            let bloomOff = view.ReadInt64(f + 16L)
+            let bloomLen = view.ReadInt64(f + 24L)
+            let valid = (readArr 0L magic.Length = magic)
+                     && (readArr (f + 36L) 4 = footMagic)
+                     && (view.ReadInt32(f + 32L) = bloomK)
+                     && (hdrLen <= indexOff) && (indexOff <= bloomOff)
+                     && (0L <= count) && (count <= ((bloomOff - indexOff) / indexElemSize))
+                     && (0L < bloomLen) && (bloomLen <= (f - bloomOff))
+            if not valid then
+                view.Dispose()
+                mmf.Dispose()
+                raise (InvalidPack path)
+            { Path = path
+              mmf = mmf
+              view = view
+              indexOff = indexOff
+              count = count
+              bloom = readArr bloomOff (int bloomLen)
+            }
+
+        /// Number of resources in the pack.
+        member r.Count with get() = r.count
+
+        member private r.Prefix (ix:int64) : uint64 =
+            let pos = r.indexOff + (ix * indexElemSize)
+            let mutable p = 0UL
+            for i = 0 to 7 do
+                p <- (p <<< 8) ||| uint64 (r.view.ReadByte(pos + int64 i))
+            p
+
+        member private r.ReadBytes (pos:int64) (len:int) : ByteString =
+            if (0 = len) then BS.empty else
+            let arr = Array.zeroCreate len
+            r.view.ReadArray(pos, arr, 0, len) |> ignore<int>
+            BS.unsafeCreateA arr
+
+        // (hash, data) at a given index
+        member private r.Entry (ix:int64) : struct(RscHash * ByteString) =
+            let pos = r.indexOff + (ix * indexElemSize)
+            let off = r.view.ReadInt64(pos + 8L)
+            let len = r.view.ReadInt32(pos + 16L)
+            let h = r.ReadBytes off (RscHash.size)
+            struct(h, r.ReadBytes (off + int64 RscHash.size) len)
+
+        // lower bound for an index prefix
+        member private r.LowerBound (p:uint64) : int64 =
+            let mutable lo = 0L
+            let mutable hi = r.count
+            while (lo < hi) do
+                let mid = lo + ((hi - lo) / 2L)
+                if (r.Prefix mid < p)
+                    then lo <- mid + 1L
+                    else hi <- mid
+            lo
+
+        // search entries with a matching key (half hash).
+        member private r.Search (k:ByteString) (accept:RscHash -> bool) : struct(RscHash * ByteString) option =
+            assert(k.Length >= 8)
+            if not (bloomTest (r.bloom) (BS.take keyLen k)) then None else
+            let p = prefix k
+            let rec loop ix =
+                if ((ix >= r.count) || (r.Prefix ix <> p)) then None else
+                let struct(h,v) = r.Entry ix
+                if accept h then Some (struct(h,v)) else loop (ix + 1L)
+            loop (r.LowerBound p)
+
+        /// Find a resource by full hash.
+        member r.TryFind (h:RscHash) : ByteString option =
+            if (RscHash.size <> h.Length) then None else
+            match r.Search h (fun h' -> ByteString.CTEq h h') with
+            | Some (struct(_,v)) -> Some v
+            | None -> None
+
+        /// Find a resource by the first half of its hash. This is not
+        /// protected against timing attacks, so is for internal use.
+        member r.TryFindKey (k:ByteString) : struct(RscHash * ByteString) option =
+            if (keyLen <> k.Length) then None else
+            r.Search k (fun h' -> (BS.take keyLen h') = k)
+
+        /// Hashes of all resources in the pack, in sorted order.
+        member r.Hashes : seq<RscHash> =
+            seq { for ix in 0L .. (r.count - 1L) do
+                    let struct(h,_) = r.Entry ix
+                    yield h }
+
+        interface IDisposable with
+            member r.Dispose() =
+                r.view.Dispose()
+                r.mmf.Dispose()
+
+    /// A directory of pack files, as a read-only Stowage.
+    ///
+    /// Newer packs are searched first. The store holds data regardless
+    /// of reference counts, so Incref and Decref are no-ops, and Stow
+    /// is invalid. New packs are added in bulk via `Add`.
+    type Store =
+        val Path : string
+        val mutable private packs : Reader list
+        new(path:string) =
+            Directory.CreateDirectory(path) |> ignore
+            let files = Directory.GetFiles(path, "*.pack") |> Array.sort
+            { Path = path
+              packs = files |> Array.map (fun f -> new Reader(f)) |> List.ofArray |> List.rev
+            }
+
+        /// Add a new pack file containing the given resources.
+        member s.Add (items:seq<RscHash * ByteString>) : unit =
+            // names sort by time of creation; never overwrite a pack
+            let rec freshPath t =
+                let path = Path.Combine(s.Path, sprintf "%016x.pack" t)
+                if File.Exists(path) then freshPath (t + 1L) else path
+            let path = lock s (fun () -> freshPath (DateTime.UtcNow.Ticks))
+            write path items
+            let r = new Reader(path)
+            lock s (fun () -> s.packs <- (r :: s.packs))
+
+        /// Pack files in the store, newest first.
+        member s.Packs with get() = lock s (fun () -> s.packs)
+
+        member s.TryFind (h:RscHash) : ByteString option =
+            List.tryPick (fun (r:Reader) -> r.TryFind h) (s.Packs)
+
+        member s.TryFindKey (k:ByteString) : struct(RscHash * ByteString) option =
+            List.tryPick (fun (r:Reader) -> r.TryFindKey k) (s.Packs)
+
+        interface Stowage with
+            member s.Load h =
+                match s.TryFind h with
+                | Some v -> v
+                | None -> raise (MissingRsc (s :> Stowage, h))
+            member s.Stow _ = invalidOp "pack store is read-only; use Add"
+            member s.Incref _ = ()
+            member s.Decref _ = ()
+
+        interface IDisposable with
+            member s.Dispose() =
+                let packs = lock s (fun () ->
+                    let p = s.packs
+                    s.packs <- List.empty
+                    p)
+                for r in packs do (r :> IDisposable).Dispose()
+
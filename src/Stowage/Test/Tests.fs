@@ -281,9 +281,499 @@ let ``efficient trie diff`` () =
     Assert.True(Seq.length (diff t1 t0) < 18)
     Assert.Equal(Seq.length (diff t1 t0), Seq.length (diff t0 t1))
 
+// codecs without references don't touch stowage
+let noStowage = Unchecked.defaultof<Stowage>
 
-    
+type TestRec = { name : string; count : int; tags : uint64 list }
+
+[<Fact>]
+let ``record and union codecs match combinators`` () =
+    let cRec = 
+        EncRecord.codec3 (EncString.codec) (fun r -> r.name)
+                         (EncVarInt32.codec) (fun r -> r.count)
+                         (EncList.codec EncVarNat.codec) (fun r -> r.tags)
+                         (fun n c t -> { name = n; count = c; tags = t })
+    let cTup = EncTriple.codec (EncString.codec) (EncVarInt32.codec) (EncList.codec EncVarNat.codec)
+    let r = { name = "hello"; count = -42; tags = [1UL; 200UL; 30000UL] }
+    let b = Codec.writeBytes cRec r
+    Assert.Equal<ByteString>(b, Codec.writeBytes cTup (r.name, r.count, r.tags))
+    Assert.Equal(r, Codec.readBytes cRec noStowage b)
+    let struct(_,szR) = Codec.compactSz cRec noStowage r
+    Assert.Equal(BS.length b, int szR)
+
+    let tagOf vOpt = if Option.isSome vOpt then 1 else 0
+    let cSome = Codec.view (EncVarNat.codec) (Some) (Option.get)
+    let cUnion = EncUnion.codec tagOf [| EncUnion.unit None; cSome |]
+    let cOpt = EncOpt.codec (EncVarNat.codec)
+    for v in [None; Some 0UL; Some 12345UL] do
+        let b = Codec.writeBytes cUnion v
+        Assert.Equal<ByteString>(b, Codec.writeBytes cOpt v)
+        Assert.Equal(v, Codec.readBytes cUnion noStowage b)
+    Assert.Equal(None, Codec.tryReadBytes cUnion noStowage (BS.singleton 7uy))
+    let cBad = EncUnion.codec (fun _ -> 2) [| EncUnion.unit None; cSome |]
+    Assert.Throws<ArgumentException>(fun () -> Codec.writeBytes cBad (Some 1UL) |> ignore) |> ignore
+
+[<Fact>]
+let ``record and union codec throughput`` () =
+    // Compare the builders against the equivalent combinators, i.e. a
+    // Codec.view over EncTriple or EncOpt. Timings are only reported,
+    // since they vary too much between machines to assert on.
+    let cRec = 
+        EncRecord.codec3 (EncString.codec) (fun r -> r.name)
+                         (EncVarInt32.codec) (fun r -> r.count)
+                         (EncList.codec EncVarNat.codec) (fun r -> r.tags)
+                         (fun n c t -> { name = n; count = c; tags = t })
+    let cRecView =
+        Codec.view (EncTriple.codec (EncString.codec) (EncVarInt32.codec) (EncList.codec EncVarNat.codec))
+                   (fun (n,c,t) -> { name = n; count = c; tags = t })
+                   (fun r -> (r.name, r.count, r.tags))
+    let tagOf vOpt = if Option.isSome vOpt then 1 else 0
+    let cUnion = EncUnion.codec tagOf [| EncUnion.unit None; Codec.view (EncVarNat.codec) (Some) (Option.get) |]
+    let cOpt = EncOpt.codec (EncVarNat.codec)
+    let recs = Array.init 20000 (fun i -> { name = string i; count = i - 10000; tags = [uint64 i; 7UL] })
+    let opts = Array.init 20000 (fun i -> if (0 = i % 3) then None else Some (uint64 i))
+    let reps = 10
+    let measure (name:string) (c:Codec<'T>) (vs:'T[]) =
+        let cA = EncArray.codec c
+        let sw = System.Diagnostics.Stopwatch.StartNew()
+        let mutable b = BS.empty
+        for i = 1 to reps do
+            b <- Codec.writeBytes cA vs
+        let tm_encode = sw.Elapsed.TotalMilliseconds
+        sw.Restart()
+        let mutable vs' = vs
+        for i = 1 to reps do
+            vs' <- Codec.readBytes cA noStowage b
+        let tm_decode = sw.Elapsed.TotalMilliseconds
+        Assert.Equal<'T[]>(vs, vs')
+        let mbps tm = (double (BS.length b * reps) / 1000.0) / tm
+        printfn "%s encode MB/s: %A, decode MB/s: %A" name (mbps tm_encode) (mbps tm_decode)
+        b
+    let bRec = measure "EncRecord.codec3" cRec recs
+    let bView = measure "view of EncTriple" cRecView recs
+    Assert.Equal<ByteString>(bView, bRec)
+    let bUnion = measure "EncUnion.codec" cUnion opts
+    let bOpt = measure "EncOpt.codec" cOpt opts
+    Assert.Equal<ByteString>(bOpt, bUnion)
+
+[<Fact>]
+let ``LSM Trie node encode and decode throughput`` () =
+    // Pure codec throughput, without stowage: a large threshold
+    // keeps every node local, so we measure only encode/decode.
+    // Timings are only reported, as for the builders above.
+    let tc = LSMTrie.codec' (System.UInt64.MaxValue) (EncVarInt32.codec)
+    let toKey k = string k |> BS.fromString
+    let a = [| for i = 1 to 20000 do yield i |]
+    shuffle' (new System.Random(71)) a
+    let t = Array.fold (fun t k -> LSMTrie.add (toKey k) k t) LSMTrie.empty a
+    let struct(tc0,sz) = Codec.compactSz tc noStowage t
+    let reps = 10
+    let sw = System.Diagnostics.Stopwatch.StartNew()
+    let mutable b = BS.empty
+    for i = 1 to reps do
+        b <- Codec.writeBytes tc tc0
+    let tm_encode = sw.Elapsed.TotalMilliseconds
+    sw.Restart()
+    let mutable t' = tc0
+    for i = 1 to reps do
+        t' <- Codec.readBytes tc noStowage b
+    let tm_decode = sw.Elapsed.TotalMilliseconds
+    Assert.Equal(int sz, BS.length b)
+    Assert.Equal(Array.sum a, LSMTrie.fold (fun s k v -> (s + v)) 0 t')
+    let mbps tm = (double (BS.length b * reps) / 1000.0) / tm
+    printfn "LSMTrie encode MB/s: %A, decode MB/s: %A" (mbps tm_encode) (mbps tm_decode)
+
+// A simple in-memory Stowage with reference counts, for testing
+// layers and protocols without the LMDB database. With eager GC, a
+// resource is deleted when its count reaches zero. 
+type MemStowage(eagerGC:bool) =
+    let d = new System.Collections.Generic.Dictionary<ByteString,ByteString>()
+    let rc = new System.Collections.Generic.Dictionary<ByteString,int>()
+    new() = MemStowage(false)
+    member val Loads = 0 with get, set
+    member s.Count with get() = lock d (fun () -> d.Count)
+    member s.Refct (h:RscHash) = lock d (fun () ->
+        match rc.TryGetValue(h) with
+        | true, n -> n
+        | _ -> 0)
+    member s.Contains (h:RscHash) = lock d (fun () -> d.ContainsKey(h))
+    member private s.Adj (h:RscHash) (n:int) = lock d (fun () ->
+        let n' = n + s.Refct h
+        if (n' < 0) then invalidOp "decref below zero"
+        if (eagerGC && (0 = n')) then d.Remove(h) |> ignore<bool>
+        rc.[h] <- n')
+    interface Stowage with
+        member s.Stow v = 
+            let h = RscHash.hash v
+            lock d (fun () -> d.[h] <- v)
+            s.Adj h 1
+            h
+        member s.Load h =
+            s.Loads <- s.Loads + 1
+            lock d (fun () ->
+                match d.TryGetValue(h) with
+                | true, v -> v
+                | _ -> raise (MissingRsc (s :> Stowage, h)))
+        member s.Incref h = s.Adj h 1
+        member s.Decref h = s.Adj h (-1)
+    interface ContainsStowage with
+        member s.Contains h = s.Contains h
+
+[<Fact>]
+let ``pending batch refs load after cache clear`` () =
+    let mem = new MemStowage()
+    let c = EncString.codec
+    let b = StowBatch.start ()
+    let r = LVRef.stow c (mem :> Stowage) "pending value" 100UL
+    let h = r.ID // hashed, but not written until the batch closes
+    Assert.False(mem.Contains h)
+    (r :> Cached).Clear() // as the cache manager would
+    Assert.Equal("pending value", LVRef.load r)
+    (r :> Cached).Clear()
+    Assert.Equal("pending value", LVRef.load' r)
+    b.Close()
+    Assert.True(mem.Contains h)
+    (r :> Cached).Clear()
+    Assert.Equal("pending value", LVRef.load r)
+
+[<Fact>]
+let ``lru stowage layer`` () =
+    let back = new MemStowage()
+    let lru = StowageLayer.lru 10000L back
+    let db = lru :> Stowage
+    let hs = [| for i = 1 to 100 do yield db.Stow (BS.fromString (string i)) |]
+    for h in hs do ignore (db.Load h)
+    Assert.Equal(0, back.Loads) // all stowed resources fit in memory
+    let big = db.Stow (BS.fromString (String.replicate 20000 "x"))
+    Assert.True(lru.Size <= 10000L)
+    for h in hs do ignore (db.Load h)
+    let st = lru.Counters.Stats()
+    Assert.Equal(200L, st.hits + st.misses)
+    Assert.Equal(st.misses, int64 back.Loads)
+    Assert.Equal(20000, BS.length (db.Load big))
+
+[<Fact>]
+let ``read through to archive`` () =
+    let archive = new MemStowage()
+    let primary = new MemStowage()
+    let db = StowageLayer.readThrough archive primary
+    let ha = (archive :> Stowage).Stow (BS.fromString "archived")
+    let hp = (db :> Stowage).Stow (BS.fromString "primary")
+    Assert.Equal("archived", BS.toString ((db :> Stowage).Load ha))
+    Assert.Equal("primary", BS.toString ((db :> Stowage).Load hp))
+    Assert.False(archive.Contains hp)
+    let st = db.Counters.Stats()
+    Assert.Equal(1L, st.hits)
+    Assert.Equal(1L, st.misses)
+    let missing = RscHash.hash (BS.fromString "missing")
+    Assert.Throws<MissingRsc>(fun () -> (db :> Stowage).Load missing |> ignore) |> ignore
+
+[<Fact>]
+let ``write behind migrates cold resources`` () =
+    let fast = new MemStowage(true)
+    let slow = new MemStowage(true)
+    let tiers = StowageLayer.writeBehind slow fast
+    let db = tiers :> Stowage
+    let h1 = db.Stow (BS.fromString "one")
+    let h2 = db.Stow (BS.fromString "two")
+    db.Incref h2
+    Assert.Equal(1, fast.Refct h2) // one ref per tier, held by layer
+    Assert.Equal(2, tiers.Migrate (System.TimeSpan.Zero))
+    Assert.Equal(struct(0,2), tiers.Count)
+    Assert.Equal(0, fast.Refct h1)
+    Assert.Equal(1, slow.Refct h2)
+    Assert.Equal("two", BS.toString (db.Load h2))
+    Assert.Equal(1L, tiers.Counters.Stats().misses)
+    db.Decref h1
+    db.Decref h2
+    Assert.Equal(1, slow.Refct h2)
+    db.Decref h2
+    Assert.Equal(0, slow.Refct h2)
+    Assert.Equal(struct(0,0), tiers.Count)
+
+[<Fact>]
+let ``write behind migrates dependencies`` () =
+    // MemStowage doesn't hold dependencies for stowed resources, so
+    // no eager GC here; we check which resources reach the slow tier.
+    let fast = new MemStowage()
+    let slow = new MemStowage()
+    let tiers = StowageLayer.writeBehind slow fast
+    let db = tiers :> Stowage
+    // a leaf known to the fast tier, but not tracked by the layer
+    let hLeaf = (fast :> Stowage).Stow (BS.fromString "leaf")
+    let hMid = (fast :> Stowage).Stow (BS.concat [BS.fromString "mid "; hLeaf])
+    let hShared = (slow :> Stowage).Stow (BS.fromString "shared")
+    let hRoot = db.Stow (BS.concat [BS.fromString "root "; hMid; BS.fromString " "; hShared])
+    Assert.Equal(1, tiers.Migrate (System.TimeSpan.Zero))
+    Assert.True(slow.Contains hLeaf)
+    Assert.True(slow.Contains hMid)
+    Assert.Equal(0, slow.Refct hLeaf) // held by parents
+    Assert.Equal(0, slow.Refct hMid)
+    Assert.Equal(1, slow.Refct hShared) // already present; not copied
+    Assert.Equal(1, slow.Refct hRoot)
+    Assert.Equal(0, slow.Loads) // existence checks don't load
+    // untracked decrefs are ignored, e.g. from finalizers, but counted
+    db.Decref (RscHash.hash (BS.fromString "untracked"))
+    Assert.Equal(1L, tiers.Counters.Stats().untracked)
+    db.Decref hRoot
+    Assert.Equal(0, slow.Refct hRoot)
+    // long dependency chains are copied without deep recursion
+    let hTail = Seq.fold (fun h i -> (fast :> Stowage).Stow (BS.concat [BS.fromString (string i + " "); h]))
+                         hLeaf (seq { 1 .. 100000 })
+    let hChain = db.Stow (BS.concat [BS.fromString "chain "; hTail])
+    Assert.Equal(1, tiers.Migrate (System.TimeSpan.Zero))
+    Assert.True(slow.Contains hTail)
+    Assert.Equal(1, slow.Refct hChain)
+
+[<Fact>]
+let ``have/want sync between stores`` () =
+    let tc = LSMTrie.codec' 800UL (EncVarInt32.codec)
+    let toKey k = string k |> BS.fromString
+    let build (db:Stowage) n = 
+        Array.fold (fun t k -> LSMTrie.add (toKey k) k t) LSMTrie.empty [| 1 .. n |]
+            |> Codec.compact tc db
+            |> Codec.stow tc db
+    let src = new MemStowage()
+    let dst = new MemStowage()
+    let hOld = build dst 10000        // receiver has an older version
+    let hNew = build src 10100        // sender has an updated version
+    let fullSize = 
+        Stowage.streamDeps src [hNew] 
+            |> Seq.sumBy (fun (_,v) -> match v with Some b -> int64 b.Length | None -> 0L)
+    use toRecv = new System.IO.Pipes.AnonymousPipeServerStream(System.IO.Pipes.PipeDirection.Out)
+    use fromSend = new System.IO.Pipes.AnonymousPipeClientStream(System.IO.Pipes.PipeDirection.In, toRecv.ClientSafePipeHandle)
+    use toSend = new System.IO.Pipes.AnonymousPipeServerStream(System.IO.Pipes.PipeDirection.Out)
+    use fromRecv = new System.IO.Pipes.AnonymousPipeClientStream(System.IO.Pipes.PipeDirection.In, toSend.ClientSafePipeHandle)
+    let sender = System.Threading.Tasks.Task.Run(fun () -> Sync.send src [hNew] fromRecv toRecv)
+    let struct(roots, st) = Sync.receive dst fromSend toSend
+    let sst = sender.Result
+    Assert.Equal<RscHash list>([hNew], roots)
+    let t = Codec.load tc dst hNew
+    Assert.Equal(Array.sum [| 1 .. 10100 |], LSMTrie.fold (fun s k v -> (s + v)) 0 t)
+    Assert.Equal(st.rscBytes, sst.rscBytes)
+    Assert.Equal(st.bytesRecv, sst.bytesSent)
+    printfn "sync received %d of %d bytes (%d on the wire)" st.rscBytes fullSize st.bytesRecv
+    Assert.True(st.rscBytes * 2L < fullSize) // most of the tree is shared
+    ignore hOld
+
+// A read stream that reports end-of-stream after a byte limit.
+type CutStream(inner:Stream, limit:int64) =
+    inherit Stream()
+    let mutable pos = 0L
+    override s.CanRead = true
+    override s.CanSeek = false
+    override s.CanWrite = false
+    override s.Length = raise (NotSupportedException())
+    override s.Position with get() = pos and set _ = raise (NotSupportedException())
+    override s.Flush() = ()
+    override s.Seek(_,_) = raise (NotSupportedException())
+    override s.SetLength _ = raise (NotSupportedException())
+    override s.Write(_,_,_) = raise (NotSupportedException())
+    override s.Read(buf,off,cnt) =
+        let n = inner.Read(buf, off, int (min (int64 cnt) (limit - pos)))
+        pos <- pos + int64 n
+        n
+
+[<Fact>]
+let ``aborted sync leaves only complete subtrees`` () =
+    let tc = LSMTrie.codec' 800UL (EncVarInt32.codec)
+    let src = new MemStowage()
+    let dst = new MemStowage()
+    let hRoot = 
+        Array.fold (fun t k -> LSMTrie.add (BS.fromString (string k)) k t) LSMTrie.empty [| 1 .. 5000 |]
+            |> Codec.compact tc src
+            |> Codec.stow tc src
+    let all = Stowage.streamDeps src [hRoot] |> Array.ofSeq
+    let fullSize = all |> Array.sumBy (fun (_,v) -> match v with Some b -> int64 b.Length | None -> 0L)
+    use toRecv = new System.IO.Pipes.AnonymousPipeServerStream(System.IO.Pipes.PipeDirection.Out)
+    use fromSend = new System.IO.Pipes.AnonymousPipeClientStream(System.IO.Pipes.PipeDirection.In, toRecv.ClientSafePipeHandle)
+    use toSend = new System.IO.Pipes.AnonymousPipeServerStream(System.IO.Pipes.PipeDirection.Out)
+    use fromRecv = new System.IO.Pipes.AnonymousPipeClientStream(System.IO.Pipes.PipeDirection.In, toSend.ClientSafePipeHandle)
+    let sender = System.Threading.Tasks.Task.Run(fun () -> 
+        try Sync.send src [hRoot] fromRecv toRecv |> ignore with _ -> ())
+    let cut = new CutStream(fromSend, fullSize / 2L)
+    Assert.Throws<Sync.ProtocolError>(fun () -> Sync.receive' 5 1 dst cut toSend |> ignore) |> ignore
+    toSend.Dispose() // sender sees end of stream
+    sender.Wait()
+    Assert.False(dst.Contains hRoot)
+    Assert.True(dst.Count > 0)
+    let present h = dst.Contains (BS.trimBytes h)
+    for (h,v) in all do
+        if present h then
+            let v = Option.get v
+            RscHash.iterHashDeps (fun d -> 
+                let d = BS.trimBytes d
+                if src.Contains d then Assert.True(present d)) v
+
+[<Fact>]
+let ``sync rejects oversized frames and counts`` () =
+    let recvFrom (bytes:byte[]) = 
+        use inp = new MemoryStream(bytes)
+        use out = new MemoryStream()
+        Sync.receive (new MemStowage()) inp out |> ignore
+    let frame (len:int) (payload:ByteString) =
+        Array.append [| byte 'R'; byte len; byte (len >>> 8); byte (len >>> 16); byte (len >>> 24) |] (BS.toArray payload)
+    let bigCount = ByteStream.write (EncVarNat.write 1000000UL)
+    Assert.Throws<ByteStream.ReadError>(fun () -> recvFrom (frame bigCount.Length bigCount)) |> ignore
+    Assert.Throws<ByteStream.ReadError>(fun () -> recvFrom (frame System.Int32.MaxValue BS.empty)) |> ignore
+
+[<Fact>]
+let ``pack file store`` () =
+    let path = "testPack"
+    clearTestDir path
+    let items = [| for i = 1 to 1000 do 
+                    let v = BS.fromString (sprintf "resource %d" i)
+                    yield (RscHash.hash v, v) |]
+    do
+        use store = new Pack.Store(path)
+        store.Add (Array.take 600 items)
+        store.Add (Array.skip 500 items) // overlaps first pack
+    use store = new Pack.Store(path) // reopen
+    Assert.Equal(2, List.length store.Packs)
+    for (h,v) in items do
+        Assert.Equal(Some v, store.TryFind h)
+        Assert.Equal(v, (store :> Stowage).Load h)
+    let (h0,v0) = items.[0]
+    let struct(h0',v0') = Option.get (store.TryFindKey (BS.take Pack.keyLen h0))
+    Assert.Equal(h0, h0')
+    Assert.Equal(v0, v0')
+    let h' = RscHash.hash (BS.fromString "missing")
+    Assert.Equal(None, store.TryFind h')
+    Assert.Equal(None, store.TryFind (BS.append (BS.take Pack.keyLen h0) (BS.take Pack.keyLen h'))) 
+    let hs = (List.last store.Packs).Hashes |> Array.ofSeq
+    Assert.Equal(600, hs.Length)
+    Assert.True(Array.forall2 (fun a b -> ByteString.Compare a b < 0) (Array.take 599 hs) (Array.skip 1 hs))
+
+[<Fact>]
+let ``pack reader rejects corrupt files`` () =
+    let path = "testPackBad"
+    clearTestDir path
+    Directory.CreateDirectory(path) |> ignore
+    let file = Path.Combine(path, "test.pack")
+    let v = BS.fromString "resource"
+    Pack.write file [(RscHash.hash v, v)]
+    let good = File.ReadAllBytes(file)
+    let tryPatch (pos:int) (bytes:byte[]) =
+        let b = Array.copy good
+        Array.blit bytes 0 b (if (pos < 0) then (b.Length + pos) else pos) bytes.Length
+        File.WriteAllBytes(file, b)
+        Assert.Throws<Pack.InvalidPack>(fun () -> (new Pack.Reader(file)) |> ignore) |> ignore
+    tryPatch 0 "WKPACK99"B                                  // header
+    tryPatch -32 (System.BitConverter.GetBytes(1000000L))  // count
+    tryPatch -40 (System.BitConverter.GetBytes(-8L))       // indexOff
+    tryPatch -24 (System.BitConverter.GetBytes(int64 good.Length)) // bloomOff
+    File.WriteAllBytes(file, good)
+    use r = new Pack.Reader(file)
+    Assert.Equal(Some v, r.TryFind (RscHash.hash v))
+
+[<Fact>]
+let ``chunked binaries share chunks`` () =
+    let mem = new MemStowage()
+    let db = mem :> Stowage
+    let rng = new System.Random(42)
+    let arr = Array.zeroCreate (4 * 1024 * 1024)
+    rng.NextBytes(arr)
+    let s = BS.unsafeCreateA arr
+    let cs = CDC.chunks s
+    Assert.Equal(s, BS.concat cs)
+    Assert.True(Array.forall (fun (c:ByteString) -> c.Length <= CDC.maxChunk) cs)
+    Assert.False(CByteString.isChunked (CByteString.stow 1000UL db s)) // opt-in
+    let r = CByteString.stowChunked db s
+    Assert.True(CByteString.isChunked r)
+    let rt = Codec.readBytes (EncCByteString.codec 1000UL) db (Codec.writeBytes (EncCByteString.codec 1000UL) r)
+    Assert.True(CByteString.isChunked rt)
+    mem.Loads <- 0
+    Assert.Equal(uint64 s.Length, CByteString.length rt)
+    Assert.Equal(BS.take 100 (BS.drop 3000000 s), CByteString.slice 3000000UL 100 rt)
+    Assert.True(mem.Loads <= 4) // root, path of nodes, one chunk
+    Assert.Equal(s, CByteString.load rt)
+    // a small edit in the middle shares most chunks
+    let ct0 = mem.Count
+    let s' = BS.concat [BS.take 2000000 s; BS.fromString "edit"; BS.drop 2000000 s]
+    let r' = CByteString.stowChunked db s'
+    Assert.Equal(s', CByteString.load r')
+    printfn "chunked edit: %d new of %d resources" (mem.Count - ct0) ct0
+    Assert.True((mem.Count - ct0) < 6)
+
+[<Fact>]
+let ``rope roots are built once and charge full length`` () =
+    let mem = new MemStowage()
+    let db = mem :> Stowage
+    let rng = new System.Random(43)
+    let arr = Array.zeroCreate (1024 * 1024)
+    rng.NextBytes(arr)
+    let s = BS.unsafeCreateA arr
+    let root = Rope.build db s
+    let ct = mem.Count
+    let node = Codec.writeBytes EncRopeNode.rootCodec root
+    Assert.True(node.Length < 4096) // a root node, not the binary
+    Assert.Equal(node, Codec.writeBytes EncRopeNode.rootCodec root)
+    Assert.Equal(ct, mem.Count) // writing a root doesn't stow
+    let root' = Codec.readBytes EncRopeNode.rootCodec db node
+    Assert.Equal(s, Rope.toBytes db (root'.Node))
+    let c = Rope.codec db
+    Assert.True(obj.ReferenceEquals(c, Rope.codec db))
+    Assert.Throws<InvalidOperationException>(fun () -> Codec.writeBytes c s |> ignore) |> ignore
+    let vref = Rope.stow db s
+    Assert.True(Rope.isRope vref)
+    Assert.Equal(RscHash.hash node, vref.ID)
+    let struct(s',sz) = ParseCache.load' c db (vref.ID)
+    Assert.Equal(s, s')
+    Assert.Equal(s.Length, sz)
+    // node counts are bounded by the bytes remaining
+    let huge = ByteStream.write (fun dst -> 
+        EncVarNat.write 1UL dst
+        EncVarNat.write 100000000UL dst)
+    Assert.Throws<ByteStream.ReadError>(fun () -> Codec.readBytes EncRopeNode.codec db huge |> ignore) |> ignore
+    let tall = ByteStream.write (fun dst -> EncVarNat.write 1000UL dst)
+    Assert.Throws<ByteStream.ReadError>(fun () -> Codec.readBytes EncRopeNode.codec db tall |> ignore) |> ignore
+
+[<Fact>]
+let ``stowed diffs skip equal subtrees`` () =
+    let mem = new MemStowage()
+    let db = mem :> Stowage
+    let cm = IntMap.codec' 1000UL (EncVarNat.codec)
+    let stow m = Codec.writeBytes cm (Codec.compact cm db m)
+    let m0 = IntMap.ofSeq (seq { for i in 0UL .. 99999UL -> (i * 7919UL, i) })
+    let changed = [| for i in 1UL .. 10UL -> (i * 9973UL) * 7919UL |]
+    let m1 = Array.fold (fun m k -> IntMap.add k 0UL m) m0 changed
+    let b0 = stow m0
+    let b1 = stow m1
+    let nodes = mem.Count
+    mem.Loads <- 0
+    let read b = Codec.readBytes cm db b
+    let d = IntMap.diff (read b0) (read b1) |> Array.ofSeq
+    Assert.Equal<uint64[]>(changed, Array.map fst d)
+    printfn "diff loaded %d of %d nodes" (mem.Loads) nodes
+    Assert.True(mem.Loads < 200)
 
+[<Fact>]
+let ``resumable diff cursors`` () =
+    let m0 = IntMap.ofSeq (seq { for i in 0UL .. 999UL -> (i, i) })
+    let m1 = seq { 3UL .. 37UL .. 999UL } |> Seq.fold (fun m k -> IntMap.add k 0UL m) m0
+    let full = IntMap.diff m0 m1 |> Array.ofSeq
+    let rec takeAll pos acc =
+        use c = IntMap.diffCursor (=) pos m0 m1
+        let batch = c.Take 5
+        if (0 = batch.Length) then acc else takeAll (c.Position) (Array.append acc batch)
+    Assert.Equal<(uint64 * VDiff<uint64>)[]>(full, takeAll None Array.empty)
+    let key i = BS.fromString (sprintf "k%d" i)
+    let t0 = Trie.ofSeq (seq { for i in 0 .. 999 -> (key i, i) })
+    let t1 = t0 |> Trie.add (key 5) 0 |> Trie.remove (key 50) |> Trie.add (key 5000) 1 |> Trie.add (BS.fromString "k") 2
+    let tfull = Trie.diff t0 t1 |> Array.ofSeq
+    Assert.Equal(4, tfull.Length)
+    let rec takeAllT pos acc =
+        use c = Trie.diffCursor (=) pos t0 t1
+        let batch = c.Take 1
+        if (0 = batch.Length) then acc else takeAllT (c.Position) (Array.append acc batch)
+    Assert.Equal<(ByteString * VDiff<int>)[]>(tfull, takeAllT None Array.empty)
+    let l0 = LSMTrie.ofSeq (Trie.toSeq t0)
+    let l1 = LSMTrie.ofSeq (Trie.toSeq t1)
+    let rec takeAllL pos acc =
+        use c = LSMTrie.diffCursor (=) pos l0 l1
+        let batch = c.Take 1
+        if (0 = batch.Length) then acc else takeAllL (c.Position) (Array.append acc batch)
+    Assert.Equal<(ByteString * VDiff<int>)[]>(tfull, takeAllL None Array.empty)
 
 // a fixture is needed to load the database
 type TestDB =
@@ -387,6 +877,25 @@ type DBTests =
         let rd2 = List.map (fst >> t.Storage.Read) kvs
         Assert.Equal<DB.Val list>(rd2,vs)
 
+    [<Fact>]
+    member t.``read sessions share a transaction`` () =
+        let vs = Array.init 1000 (fun i -> BS.fromString (sprintf "session-%d" i))
+        let hs = Array.map (t.Stowage.Stow) vs
+        t.Flush()
+        // nested sessions and loads from many threads
+        let loaded = t.s.ReadSession (fun () ->
+            t.s.ReadSession (fun () -> Array.map (t.Stowage.Load) hs))
+        Assert.Equal<ByteString[]>(vs, loaded)
+        let par = Array.Parallel.map (fun h -> t.s.ReadSession (fun () -> t.Stowage.Load h)) hs
+        Assert.Equal<ByteString[]>(vs, par)
+        // pooled transactions see later frames
+        let kv = t.KVP ("session-key", "v1")
+        t.Storage.WriteBatch (CritbitTree.ofList [kv]) ()
+        t.Flush()
+        Assert.Equal(t.ToVal "v1", t.Storage.Read (fst kv))
+        Array.iter (t.Stowage.Decref) hs
+        t.FullGC()
+
     member t.HasRsc (b:ByteString) =
         match t.TryLoad (RscHash.hash b) with
         | None -> false
@@ -602,6 +1111,252 @@ type DBTests =
         Assert.True(CVRef.isRemote b)
 
 
+    [<Fact>]
+    member t.``lvrefs share parsed values`` () =
+        let c = EncList.codec (EncString.codec)
+        let v = [ for i = 1 to 100 do yield string i ]
+        let h = Codec.stow c (t.Stowage) v
+        let r1 = LVRef.wrap (VRef.wrap c (t.Stowage) h)
+        let r2 = LVRef.wrap (VRef.wrap c (t.Stowage) h)
+        t.Stowage.Decref h
+        let v1 = LVRef.load r1
+        let v2 = LVRef.load r2
+        Assert.Equal(v, v2)
+        Assert.True(obj.ReferenceEquals(v1,v2))
+        // stats for our own codec instance, so parallel tests don't race
+        let s = ParseCache.tableStats c (t.Stowage)
+        Assert.Equal(1L, s.parses)
+        Assert.Equal(1L, s.hits)
+
+    [<Fact>]
+    member tf.``forks share parsed nodes`` () =
+        // two forks loaded from the same root should mostly share 
+        // their parsed nodes, rather than each parsing everything.
+        let tc = LSMTrie.codec' 800UL (EncVarInt32.codec)
+        let toKey k = string k |> BS.fromString
+        let a = [| for i = 1 to 10000 do yield i |]
+        let t0 = 
+            Array.fold (fun t k -> LSMTrie.add (toKey k) k t) LSMTrie.empty a
+                |> Codec.compact tc (tf.Stowage)
+        let h = Codec.stow tc (tf.Stowage) t0
+        tf.Flush()
+        let sum t = LSMTrie.fold (fun s k v -> (s + v)) 0 t
+        let parses () = (ParseCache.tableStats tc (tf.Stowage)).parses
+        // memory is process-wide, so it is reported but not asserted
+        let mem () = System.GC.GetTotalMemory(true)
+        let p0 = parses ()
+        let m0 = mem ()
+        let t1 = Codec.load tc (tf.Stowage) h
+        Assert.Equal(Array.sum a, sum t1)
+        let p1 = parses ()
+        let m1 = mem ()
+        let t2 = LSMTrie.add (toKey 0) 0 (Codec.load tc (tf.Stowage) h)
+        Assert.Equal(Array.sum a, sum t2)
+        let p2 = parses ()
+        let m2 = mem ()
+        System.GC.KeepAlive(t1)
+        System.GC.KeepAlive(t2)
+        tf.Stowage.Decref h
+        printfn "parses for first fork: %d, second fork: %d" (p1 - p0) (p2 - p1)
+        printfn "memory for first fork: %d bytes, second fork: %d bytes" (m1 - m0) (m2 - m1)
+        Assert.True((p2 - p1) * 10L < (p1 - p0))
+
+    [<Fact>]
+    member tf.``stow batch defers compaction`` () =
+        let tc = LSMTrie.codec' 800UL (EncVarInt32.codec)
+        let toKey k = string k |> BS.fromString
+        let b = StowBatch.start ()
+        let mutable t = LSMTrie.empty
+        for i = 1 to 10000 do
+            t <- LSMTrie.add (toKey i) i t
+            if (0 = (i % 30)) then t <- Codec.compact tc (tf.Stowage) t
+            if (0 = (i % 1000)) then System.GC.Collect()
+        t <- Codec.compact tc (tf.Stowage) t
+        Assert.Equal(Some b, StowBatch.current ())
+        b.Close()
+        Assert.Equal(None, StowBatch.current ())
+        printfn "stow batch: %d stowed, %d dropped" (b.Stowed) (b.Dropped)
+        Assert.True(b.Dropped > 0)
+        let h = Codec.stow tc (tf.Stowage) t
+        tf.FullGC()
+        let t' = Codec.load tc (tf.Stowage) h
+        Assert.Equal(Some 777, LSMTrie.tryFind (toKey 777) t')
+        Assert.Equal(50005000, LSMTrie.fold (fun s k v -> (s + v)) 0 t')
+        tf.Stowage.Decref h
+
+    [<Fact>]
+    member t.``migrate cold resources to pack store`` () =
+        let path = "testArchive"
+        clearTestDir path
+        use store = new Pack.Store(path)
+        let hot = BS.fromString "migrate-hot"
+        let cold = BS.fromString "migrate-cold"
+        let mkRsc s = t.Stowage.Stow (BS.fromString s)
+        let hHot = mkRsc "a hot resource"
+        let hLeaf = mkRsc "a shared leaf" // referenced by hot and cold
+        let coldVal = BS.concat [BS.fromString "a cold resource "; hLeaf]
+        let hCold = t.Stowage.Stow coldVal
+        let sync = t.Storage.WriteBatch (CritbitTree.ofList [(hot, Some (BS.append hHot hLeaf)); (cold, Some hCold)])
+        sync ()
+        t.Stowage.Decref hHot
+        t.Stowage.Decref hLeaf
+        t.Stowage.Decref hCold
+        t.Flush()
+        let isHot k = (k = hot)
+        Assert.Equal(0, t.s.Migrate store isHot (System.TimeSpan.FromDays(1.0)))
+        Assert.Equal(1, t.s.Migrate store isHot (System.TimeSpan.Zero))
+        Assert.Equal(Some coldVal, store.TryFind hCold)
+        Assert.Equal(None, store.TryFind hHot)
+        Assert.Equal<ByteString>(coldVal, t.Stowage.Load hCold)
+        Assert.Equal("a hot resource", BS.toString (t.Stowage.Load hHot))
+        // stowing an archived resource again is not a new resource, so
+        // doesn't incref its dependencies a second time
+        t.Stowage.Decref (t.Stowage.Stow coldVal)
+        t.Flush()
+        // refcounts are preserved: removing the root allows GC
+        (t.Storage.WriteBatch (CritbitTree.ofList [(cold, None); (hot, None)])) ()
+        t.FullGC()
+        Assert.False(t.HasRsc (BS.fromString "a hot resource"))
+        Assert.False(t.HasRsc (BS.fromString "a shared leaf"))
+
+    [<Fact>]
+    member t.``scrub verifies stowed resources`` () =
+        let k = BS.fromString "scrub-test"
+        let hs = [ for i in 1 .. 20 -> t.Stowage.Stow (BS.fromString (sprintf "scrub rsc %d" i)) ]
+        let root = BS.concat hs
+        (t.Storage.WriteBatch (CritbitTree.ofList [(k, Some root)])) ()
+        for h in hs do t.Stowage.Decref h
+        t.Flush()
+        let rec finishPass () = if not (t.s.ScrubStep 100) then finishPass ()
+        finishPass () // from wherever an earlier scrub stopped
+        let s0 = t.s.ScrubStats()
+        finishPass ()
+        let s1 = t.s.ScrubStats()
+        Assert.Equal(s0.scrub_passes + 1UL, s1.scrub_passes)
+        Assert.Equal(t.s.Stats().stow_count, s1.scrub_count - s0.scrub_count)
+        Assert.Equal(0UL, s1.scrub_issues)
+        Assert.True(List.isEmpty (t.s.ScrubIssues()))
+        (t.Storage.WriteBatch (CritbitTree.ofList [(k, None)])) ()
+
+    [<Fact>]
+    member t.``scrub reports corruption and resumes after reopen`` () =
+        let path = "testScrubDB"
+        clearTestDir path
+        let sk (h:RscHash) = BS.take (RscHash.size / 2) h
+        let struct(hBad, hLost, hParent) =
+            use s = new LMDB.Storage(path, 100)
+            let db = s :> Stowage
+            let hBad = db.Stow (BS.fromString "scrub corrupt")
+            let hLost = db.Stow (BS.fromString "scrub lost refct")
+            let hParent = db.Stow (BS.concat [BS.fromString "scrub parent "; hLost])
+            let hs = [ for i in 1 .. 10 -> db.Stow (BS.fromString (sprintf "scrub fill %d" i)) ]
+            let root = BS.concat (hBad :: hParent :: hs)
+            ((s :> DB.Storage).WriteBatch (CritbitTree.ofList [(BS.fromString "root", Some root)])) ()
+            for h in (hBad :: hLost :: hParent :: hs) do db.Decref h
+            struct(hBad, hLost, hParent)
+        // inject faults directly, while the database is closed
+        do
+            let env = LMDB_FFI.mdb_env_create ()
+            LMDB_FFI.mdb_env_set_mapsize env 100
+            LMDB_FFI.mdb_env_set_maxdbs env 4
+            LMDB_FFI.mdb_env_open env path (LMDB_FFI.MDB_NOSYNC ||| LMDB_FFI.MDB_NOLOCK)
+            let tx = LMDB_FFI.mdb_readwrite_txn_begin env
+            let dbi_stow = LMDB_FFI.mdb_dbi_open tx "$"
+            let dbi_rfct = LMDB_FFI.mdb_dbi_open tx "#"
+            let put dbi k (v:ByteString) =
+                let dst = LMDB_FFI.mdb_reserve tx dbi k (v.Length)
+                System.Runtime.InteropServices.Marshal.Copy(v.UnsafeArray, v.Offset, dst, v.Length)
+            let rv = LMDB_FFI.mdb_getZC tx dbi_stow (sk hBad) |> Option.get |> LMDB_FFI.copyVal
+            let hRem = BS.take (RscHash.size - (RscHash.size / 2)) (BS.unsafeCreateA rv)
+            put dbi_stow (sk hBad) (BS.append hRem (BS.fromString "scrub c0rrupt"))
+            Assert.True(LMDB_FFI.mdb_del tx dbi_rfct (sk hLost))
+            put dbi_rfct (sk hParent) (ByteStream.write (EncVarNat.write 5UL))
+            LMDB_FFI.mdb_txn_commit tx
+            LMDB_FFI.mdb_env_sync env
+            LMDB_FFI.mdb_env_close env
+        // check one resource, then resume from the cursor after reopen
+        do
+            use s = new LMDB.Storage(path, 100)
+            Assert.False(s.ScrubStep 1)
+            Assert.Equal(1UL, s.ScrubStats().scrub_count)
+        use s = new LMDB.Storage(path, 100)
+        let rec finishPass () = if not (s.ScrubStep 100) then finishPass ()
+        finishPass ()
+        let st = s.ScrubStats()
+        Assert.Equal(1UL, st.scrub_passes)
+        Assert.Equal(s.Stats().stow_count - 1UL, st.scrub_count)
+        let issues = s.ScrubIssues() // includes those logged before reopen
+        let expect = [ LMDB.BadHash (sk hBad); LMDB.NoRefct (sk hLost); LMDB.WrongRefct (sk hParent) ]
+        Assert.Equal(List.length expect, List.length issues)
+        for i in expect do Assert.True(List.contains i issues)
+
+    [<Fact>]
+    member t.``garbage is elided within a frame`` () =
+        let path = "testElideDB"
+        clearTestDir path
+        let sk (h:RscHash) = BS.take (RscHash.size / 2) h
+        let struct(hw, hy) =
+            use s = new LMDB.Storage(path, 100)
+            let db = s :> Stowage
+            let tryLoad h = try Some (db.Load h) with | MissingRsc _ -> None
+            // a chain of intermediate nodes, dropped before the frame
+            let x = BS.fromString "elided leaf"
+            let hx = db.Stow x
+            let y = BS.concat [BS.fromString "elided parent "; hx]
+            let hy = db.Stow y
+            let w = BS.concat [BS.fromString "elided grandparent "; hy]
+            let hw = db.Stow w
+            db.Decref hx
+            db.Decref hy
+            db.Decref hw
+            // a rooted node is written
+            let z = BS.concat [BS.fromString "rooted "; hx]
+            let hz = db.Stow z
+            let k = BS.fromString "elision-root"
+            ((s :> DB.Storage).WriteBatch (CritbitTree.ofList [(k, Some hz)])) ()
+            db.Decref hz
+            Assert.True(s.Space().elided_bytes >= uint64 (y.Length + w.Length))
+            Assert.Equal<ByteString option>(None, tryLoad hy)
+            Assert.Equal<ByteString option>(None, tryLoad hw)
+            Assert.Equal<ByteString option>(Some x, tryLoad hx)
+            Assert.Equal<ByteString option>(Some z, tryLoad hz)
+            ((s :> DB.Storage).WriteBatch (CritbitTree.ofList [(k, None)])) ()
+            let rec gcLoop ct =
+                s.GC()
+                let ct' = s.Stats().stow_count
+                if (ct' <> ct) then gcLoop ct'
+            gcLoop 0UL
+            Assert.Equal<ByteString option>(None, tryLoad hx)
+            struct(hw, hy)
+        // elided resources leave no zero-refct records for GC
+        let env = LMDB_FFI.mdb_env_create ()
+        LMDB_FFI.mdb_env_set_mapsize env 100
+        LMDB_FFI.mdb_env_set_maxdbs env 4
+        LMDB_FFI.mdb_env_open env path (LMDB_FFI.MDB_NOSYNC ||| LMDB_FFI.MDB_NOLOCK)
+        let tx = LMDB_FFI.mdb_readwrite_txn_begin env
+        let dbi_zero = LMDB_FFI.mdb_dbi_open tx "0"
+        let zero = LMDB_FFI.mdb_keys_from tx dbi_zero (BS.empty) |> List.ofSeq
+        LMDB_FFI.mdb_txn_abort tx
+        LMDB_FFI.mdb_env_close env
+        Assert.False(List.contains (sk hy) zero)
+        Assert.False(List.contains (sk hw) zero)
+
+    [<Fact>]
+    member t.``map grows when full`` () =
+        let path = "testGrowDB"
+        clearTestDir path
+        use s = new LMDB.Storage(path, 1)
+        let rsc i = BS.fromString (sprintf "%d:%s" i (String.replicate 1000 "x"))
+        let hs = [| for i in 1 .. 4000 -> (s :> Stowage).Stow (rsc i) |]
+        let root = BS.concat (List.ofArray hs)
+        ((s :> DB.Storage).WriteBatch (CritbitTree.ofList [(BS.fromString "root", Some root)])) ()
+        let sp = s.Space()
+        Assert.True(sp.map_growth > 0UL)
+        Assert.True(sp.map_bytes > (1024UL * 1024UL))
+        Assert.True(sp.used_pages * sp.page_size <= sp.map_bytes)
+        Assert.True(sp.free_pages < sp.used_pages)
+        Assert.Equal(rsc 4000, (s :> Stowage).Load (hs.[3999]))
+
     [<Fact>]
     member t.``intmap serialization`` () =
         let mutable m = IntMap.empty
@@ -783,7 +1538,22 @@ type DBTests =
         Assert.True(usec_per_read < 10.0)
         Assert.True(usec_per_read < 12.0)
 
-        
+    [<Fact>]
+    member t.``durable cache sync and quota`` () =
+        let k = BS.fromString "durable cache"
+        let c = DCache.load (t.DB) k (EncBytes.codec) 100_000UL
+        for i in 1 .. 5000 do
+            c.Add (BS.fromString (string i)) (BS.fromString (string (i * 7))) 100UL
+        Assert.True(c.Size <= 100_000UL)
+        Assert.True(c.Size > 85_000UL) // decay erases small prefixes
+        Assert.Equal(c.Size, 100UL * c.Count)
+        c.Add (BS.fromString "x") (BS.fromString "y") 100UL
+        c.Sync()
+        let c' = DCache.load (t.DB) k (EncBytes.codec) 100_000UL
+        Assert.Equal(c.Count, c'.Count)
+        Assert.Equal(Some (BS.fromString "y"), c'.TryFind (BS.fromString "x"))
+        Assert.Equal(None, c'.TryFind (BS.fromString "z"))
+
 
     // TODO:
     //  - Trie compaction